@@ -0,0 +1,557 @@
+// Benchmark harness for every SM3 and SM4 backend in the tree.
+//
+// Each (backend, size) case is warmed up, then timed sample by sample with both
+// the TSC and steady_clock. One JSON object per case is written to stdout (or
+// --output), so runs can be diffed and regressions caught by a script.
+//
+//   sm_bench [--min-size N] [--max-size N] [--backend SUBSTR] [--cpu N]
+//            [--min-time SECONDS] [--output FILE] [--stats] [--list]
+//
+// Sizes accept K/M/G suffixes (powers of 1024). The default range stops at
+// 16M; pass --max-size 1G for the full sweep.
+//
+// Before anything is timed, the selected backends are run on fixed inputs and
+// checked against the reference of their group (sm3/reference for SM3,
+// sm4/table-ecb for the ECB kernels, ...); any disagreement exits with status 1.
+//
+// --stats adds the SM3/SM4 phase counters gathered over the timed samples of
+// each case as "sm3_stats" and "sm4_stats". They only count in a build
+// configured with -DSM_INSTRUMENT=ON, and report cache and branch misses only
+// where perf_event_open is permitted.
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <vector>
+#include <sched.h>
+#include <x86intrin.h>
+
+#include "sm3.h"
+#include "sm3_hmac.h"
+#include "sm3_kdf.h"
+#include "sm3_mb.h"
+#include "sm3_service.h"
+#include "sm3_stats.h"
+#include "sm4.h"
+#include "sm4_ctr_hmac_sm3.h"
+#include "sm4_stats.h"
+
+namespace {
+
+struct Backend {
+    std::string algorithm;
+    std::string name;
+    // Messages hashed or encrypted per timed operation; the input buffer holds
+    // batch(size) consecutive messages of the given size.
+    std::function<size_t(size_t)> batch;
+    std::function<void(const uint8_t* in, uint8_t* out, size_t size, size_t count)> run;
+    // Backends sharing a non-empty group compute the same function and must give
+    // identical output; the first one registered is the group's reference.
+    std::string group;
+};
+
+struct Options {
+    size_t minSize = 0;
+    size_t maxSize = size_t(16) << 20;
+    std::string filter;
+    int cpu = 0;
+    double minTime = 0.3;
+    std::string output;
+    bool stats = false;
+    bool list = false;
+};
+
+size_t ParseSize(const char* text) {
+    char* end = nullptr;
+    double value = std::strtod(text, &end);
+    switch (*end) {
+    case 'k': case 'K': value *= 1024.0; break;
+    case 'm': case 'M': value *= 1024.0 * 1024.0; break;
+    case 'g': case 'G': value *= 1024.0 * 1024.0 * 1024.0; break;
+    default: break;
+    }
+    return static_cast<size_t>(value);
+}
+
+Options ParseOptions(int argc, char** argv) {
+    Options options;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        auto value = [&]() -> const char* {
+            if (i + 1 >= argc) {
+                std::fprintf(stderr, "missing value for %s\n", arg.c_str());
+                std::exit(2);
+            }
+            return argv[++i];
+        };
+        if (arg == "--min-size") {
+            options.minSize = ParseSize(value());
+        } else if (arg == "--max-size") {
+            options.maxSize = ParseSize(value());
+        } else if (arg == "--backend") {
+            options.filter = value();
+        } else if (arg == "--cpu") {
+            options.cpu = std::atoi(value());
+        } else if (arg == "--min-time") {
+            options.minTime = std::atof(value());
+        } else if (arg == "--output") {
+            options.output = value();
+        } else if (arg == "--stats") {
+            options.stats = true;
+        } else if (arg == "--list") {
+            options.list = true;
+        } else {
+            std::fprintf(stderr, "unknown option %s\n", arg.c_str());
+            std::exit(2);
+        }
+    }
+    return options;
+}
+
+// Several short messages per operation so that a single sample is not just
+// timer overhead; big messages run one at a time.
+size_t StreamBatch(size_t size) {
+    return size >= 4096 ? 1 : 4096 / std::max<size_t>(size, 64);
+}
+
+// Multi-buffer backends need many independent messages to fill their lanes.
+size_t LaneBatch(size_t size) {
+    size_t bytes = std::max<size_t>(size, 64);
+    return std::clamp<size_t>((size_t(4) << 20) / bytes, 1, 256);
+}
+
+std::vector<Backend> Backends() {
+    std::vector<Backend> backends;
+
+    const std::pair<const char*, SM3_Backend> sm3Backends[] = {
+        {"reference", SM3_Backend::Reference},
+        {"unrolled", SM3_Backend::Unrolled},
+        {"interleaved", SM3_Backend::Interleaved},
+        {"avx512", SM3_Backend::AVX512},
+    };
+    for (const auto& entry : sm3Backends) {
+        SM3_Backend backend = entry.second;
+        if (!SM3_Algorithm::Supported(backend)) {
+            continue;
+        }
+        backends.push_back({"sm3", entry.first, StreamBatch,
+                            [backend](const uint8_t* in, uint8_t* out, size_t size, size_t count) {
+                                for (size_t i = 0; i < count; ++i) {
+                                    SM3_Algorithm hasher(backend);
+                                    hasher.Update(in + i * size, size);
+                                    SM3_Digest digest = hasher.Finalize();
+                                    std::memcpy(out + 32 * i, digest.data(), 32);
+                                }
+                            },
+                            "sm3"});
+    }
+
+    const std::pair<const char*, SM3_MultiBuffer::Width> laneWidths[] = {
+        {"mb-avx2", SM3_MultiBuffer::Width::AVX2},
+        {"mb-avx512", SM3_MultiBuffer::Width::AVX512},
+    };
+    for (const auto& entry : laneWidths) {
+        SM3_MultiBuffer::Width width = entry.second;
+        if (!SM3_MultiBuffer::Supported(width)) {
+            continue;
+        }
+        backends.push_back({"sm3", entry.first, LaneBatch,
+                            [width](const uint8_t* in, uint8_t* out, size_t size, size_t count) {
+                                std::vector<SM3_Message> messages(count);
+                                for (size_t i = 0; i < count; ++i) {
+                                    messages[i] = {in + i * size, size};
+                                }
+                                SM3_MultiBuffer::HashBatch(messages.data(), count, out, width);
+                            },
+                            "sm3"});
+    }
+
+    // Submit and wait through the batching service from one thread: what its
+    // queue, futex handoff and bucketing add on top of mb lanes.
+    backends.push_back({"sm3", "service", LaneBatch, [](const uint8_t* in, uint8_t* out, size_t size, size_t count) {
+                            static SM3_HashService service;
+                            std::vector<SM3_HashService::Future> pending(count);
+                            for (size_t i = 0; i < count; ++i) {
+                                pending[i] = service.Submit(in + i * size, size);
+                            }
+                            for (size_t i = 0; i < count; ++i) {
+                                std::memcpy(out + 32 * i, pending[i].Get().data(), 32);
+                            }
+                        },
+                        "sm3"});
+
+    static const SM3_HMAC hmac(std::string("bench hmac key"));
+    backends.push_back({"hmac-sm3", "cached", StreamBatch,
+                        [](const uint8_t* in, uint8_t* out, size_t size, size_t count) {
+                            for (size_t i = 0; i < count; ++i) {
+                                SM3_Digest tag = hmac.Sign(in + i * size, size);
+                                std::memcpy(out + 32 * i, tag.data(), 32);
+                            }
+                        },
+                        "hmac-sm3"});
+    backends.push_back({"hmac-sm3", "batch", LaneBatch,
+                        [](const uint8_t* in, uint8_t* out, size_t size, size_t count) {
+                            std::vector<SM3_Message> messages(count);
+                            for (size_t i = 0; i < count; ++i) {
+                                messages[i] = {in + i * size, size};
+                            }
+                            hmac.SignBatch(messages.data(), count, out);
+                        },
+                        "hmac-sm3"});
+
+    // Key stream of `size` bytes per message from a one-block Z, as SM2
+    // encryption derives it from x2 || y2.
+    static const std::string kdfInput(64, '\x5a');
+    backends.push_back({"sm3-kdf", "per-counter", StreamBatch,
+                        [](const uint8_t*, uint8_t* out, size_t size, size_t count) {
+                            for (size_t i = 0; i < count; ++i) {
+                                for (uint32_t ct = 1; 32 * (ct - 1) < size; ++ct) {
+                                    SM3_Algorithm hasher;
+                                    hasher.Update(kdfInput);
+                                    const uint8_t counter[4] = {static_cast<uint8_t>(ct >> 24),
+                                                                static_cast<uint8_t>(ct >> 16),
+                                                                static_cast<uint8_t>(ct >> 8), static_cast<uint8_t>(ct)};
+                                    hasher.Update(counter, 4);
+                                    SM3_Digest digest = hasher.Finalize();
+                                    std::memcpy(out + i * size + 32 * (ct - 1), digest.data(),
+                                                std::min<size_t>(32, size - 32 * (ct - 1)));
+                                }
+                            }
+                        },
+                        "sm3-kdf"});
+    static const SM3_KDF kdf(kdfInput);
+    backends.push_back({"sm3-kdf", "lanes", StreamBatch, [](const uint8_t*, uint8_t* out, size_t size, size_t count) {
+                            for (size_t i = 0; i < count; ++i) {
+                                kdf.Derive(out + i * size, size);
+                            }
+                        },
+                        "sm3-kdf"});
+
+    static sm4_key_t key;
+    static const uint8_t keyBytes[16] = {
+        0x01, 0x23, 0x45, 0x67, 0x89, 0xab, 0xcd, 0xef, 0xfe, 0xdc, 0xba, 0x98, 0x76, 0x54, 0x32, 0x10
+    };
+    sm4_build_Ttables();
+    sm4_key_schedule(&key, keyBytes);
+    backends.push_back({"sm4", "ctr", StreamBatch,
+                        [](const uint8_t* in, uint8_t* out, size_t size, size_t count) {
+                            static const uint8_t iv[16] = {0};
+                            for (size_t i = 0; i < count; ++i) {
+                                sm4_ctr_encrypt(&key, iv, in + i * size, out + i * size, size);
+                            }
+                        },
+                        "sm4-ctr"});
+    backends.push_back({"sm4", "ctr-mt", StreamBatch,
+                        [](const uint8_t* in, uint8_t* out, size_t size, size_t count) {
+                            static const uint8_t iv[16] = {0};
+                            for (size_t i = 0; i < count; ++i) {
+                                sm4_ctr_encrypt_mt(&key, iv, in + i * size, out + i * size, size, 0);
+                            }
+                        },
+                        "sm4-ctr"});
+
+    // Records of 4096 tenants with a key each, picked by a scrambled record
+    // number: one key schedule and CTR call per record, against the multi-key
+    // batch with cached schedules.
+    static std::vector<std::array<uint8_t, 16>> tenantKeys(4096);
+    for (size_t t = 0; t < tenantKeys.size(); ++t) {
+        for (size_t j = 0; j < 16; ++j) {
+            tenantKeys[t][j] = static_cast<uint8_t>((t * 2654435761u) >> (j % 4 * 8)) ^ keyBytes[j];
+        }
+    }
+    auto tenant = [](size_t record) { return tenantKeys[(record * 2654435761u >> 7) % tenantKeys.size()].data(); };
+    backends.push_back({"sm4", "ctr-tenants", StreamBatch,
+                        [tenant](const uint8_t* in, uint8_t* out, size_t size, size_t count) {
+                            static const uint8_t iv[16] = {0};
+                            for (size_t i = 0; i < count; ++i) {
+                                sm4_key_t recordKey;
+                                sm4_key_schedule(&recordKey, tenant(i));
+                                sm4_ctr_encrypt(&recordKey, iv, in + i * size, out + i * size, size);
+                            }
+                        },
+                        "sm4-ctr-tenants"});
+    static sm4_key_cache_t keyCache;
+    sm4_key_cache_init(&keyCache, tenantKeys.size());
+    backends.push_back({"sm4", "ctr-records", StreamBatch,
+                        [tenant](const uint8_t* in, uint8_t* out, size_t size, size_t count) {
+                            static const uint8_t iv[16] = {0};
+                            std::vector<sm4_ctr_record_t> records(count);
+                            for (size_t i = 0; i < count; ++i) {
+                                records[i] = {tenant(i), iv, in + i * size, out + i * size, size};
+                            }
+                            sm4_ctr_encrypt_records(&keyCache, records.data(), count);
+                        },
+                        "sm4-ctr-tenants"});
+
+    const std::pair<const char*, sm4_impl_t> sm4Impls[] = {
+        {"table-ecb", SM4_IMPL_TABLE},
+        {"table-1k-ecb", SM4_IMPL_TABLE_1K},
+        {"sbox-ecb", SM4_IMPL_SBOX},
+        {"aesni-ecb", SM4_IMPL_AESNI},
+        {"gfni-ecb", SM4_IMPL_GFNI},
+        {"bitslice-ecb", SM4_IMPL_BITSLICE},
+    };
+    for (const auto& entry : sm4Impls) {
+        sm4_impl_t impl = entry.second;
+        if (!sm4_impl_supported(impl)) {
+            continue;
+        }
+        backends.push_back({"sm4", entry.first, StreamBatch,
+                            [impl](const uint8_t* in, uint8_t* out, size_t size, size_t count) {
+                                for (size_t i = 0; i < count; ++i) {
+                                    sm4_crypt_blocks(&key, in + i * size, out + i * size, size / 16, 0, impl);
+                                }
+                            },
+                            "sm4-ecb"});
+    }
+    backends.push_back({"sm4", "cbc-decrypt", StreamBatch,
+                        [](const uint8_t* in, uint8_t* out, size_t size, size_t count) {
+                            static const uint8_t iv[16] = {0};
+                            for (size_t i = 0; i < count; ++i) {
+                                sm4_cbc_decrypt(&key, iv, in + i * size, out + i * size, size / 16 * 16);
+                            }
+                        },
+                        "sm4-cbc-decrypt"});
+
+    /* 4 KB sectors; messages shorter than a sector are one data unit. */
+    static sm4_xts_key_t xtsKey;
+    static const uint8_t xtsKeyBytes[32] = {
+        0x01, 0x23, 0x45, 0x67, 0x89, 0xab, 0xcd, 0xef, 0xfe, 0xdc, 0xba, 0x98, 0x76, 0x54, 0x32, 0x10,
+        0x10, 0x32, 0x54, 0x76, 0x98, 0xba, 0xdc, 0xfe, 0xef, 0xcd, 0xab, 0x89, 0x67, 0x45, 0x23, 0x01
+    };
+    sm4_xts_init(&xtsKey, xtsKeyBytes);
+    backends.push_back({"sm4", "xts-4k", StreamBatch,
+                        [](const uint8_t* in, uint8_t* out, size_t size, size_t count) {
+                            const size_t sector = size < 4096 ? size : 4096;
+                            if (sector < 16) {
+                                return;
+                            }
+                            for (size_t i = 0; i < count; ++i) {
+                                sm4_xts_encrypt_sectors(&xtsKey, 0, sector, in + i * size, out + i * size,
+                                                        size / sector);
+                            }
+                        },
+                        "sm4-xts"});
+
+    static sm4_gcm_key_t gcmKey;
+    sm4_gcm_init(&gcmKey, keyBytes);
+    backends.push_back({"sm4", "gcm-encrypt", StreamBatch,
+                        [](const uint8_t* in, uint8_t* out, size_t size, size_t count) {
+                            static const uint8_t iv[12] = {0};
+                            uint8_t tag[16];
+                            for (size_t i = 0; i < count; ++i) {
+                                sm4_gcm_encrypt(&gcmKey, iv, sizeof(iv), nullptr, 0, in + i * size, out + i * size,
+                                                size, tag);
+                            }
+                        },
+                        "sm4-gcm"});
+
+    // Encrypt-then-MAC records: SM4-CTR and HMAC-SM3 as two passes over the
+    // record, and fused one chunk at a time.
+    static const SM4_CTR_HMAC_SM3 etm(keyBytes, keyBytes, sizeof(keyBytes));
+    static const SM3_HMAC etmMac(keyBytes, sizeof(keyBytes));
+    backends.push_back({"sm4-hmac-sm3", "two-pass", StreamBatch,
+                        [](const uint8_t* in, uint8_t* out, size_t size, size_t count) {
+                            static const uint8_t iv[16] = {0};
+                            static const uint8_t bits[8] = {0};
+                            for (size_t i = 0; i < count; ++i) {
+                                sm4_ctr_encrypt(&key, iv, in + i * size, out + i * size, size);
+                                SM3_Algorithm mac = etmMac.Begin();
+                                mac.Update(iv, 16);
+                                mac.Update(out + i * size, size);
+                                mac.Update(bits, 8);
+                                etmMac.Finish(mac);
+                            }
+                        },
+                        "sm4-hmac-sm3"});
+    backends.push_back({"sm4-hmac-sm3", "fused", StreamBatch,
+                        [](const uint8_t* in, uint8_t* out, size_t size, size_t count) {
+                            static const uint8_t iv[16] = {0};
+                            uint8_t tag[32];
+                            for (size_t i = 0; i < count; ++i) {
+                                etm.Seal(iv, nullptr, 0, in + i * size, out + i * size, size, tag);
+                            }
+                        },
+                        "sm4-hmac-sm3"});
+    return backends;
+}
+
+std::vector<size_t> Sizes(const Options& options) {
+    std::vector<size_t> sizes = {0, 16, 64, 256};
+    for (size_t size = 1024; size <= (size_t(1) << 30); size *= 4) {
+        sizes.push_back(size);
+    }
+    sizes.erase(std::remove_if(sizes.begin(), sizes.end(),
+                               [&](size_t s) { return s < options.minSize || s > options.maxSize; }),
+                sizes.end());
+    return sizes;
+}
+
+void FillInput(std::vector<uint8_t>& input) {
+    for (size_t i = 0; i < input.size(); ++i) {
+        input[i] = static_cast<uint8_t>(i * 131 + 7);
+    }
+}
+
+// Runs every selected backend that has a group on a few fixed inputs and
+// compares its output with the group's reference, so that a broken kernel
+// cannot post a fast result. The shapes cover partly filled lanes, a partial
+// CTR chunk and whole multi-block messages.
+bool VerifyBackends(const std::vector<Backend>& backends, const std::string& filter) {
+    const std::pair<size_t, size_t> shapes[] = {{16, 40}, {80, 37}, {4096 + 48, 3}};
+    bool ok = true;
+    for (const auto& shape : shapes) {
+        size_t size = shape.first, count = shape.second;
+        std::vector<uint8_t> input(size * count);
+        FillInput(input);
+        size_t outputSize = std::max(size * count, 32 * count);
+        for (size_t r = 0; r < backends.size(); ++r) {
+            const Backend& reference = backends[r];
+            bool first = !reference.group.empty();
+            for (size_t j = 0; first && j < r; ++j) {
+                first = backends[j].group != reference.group;
+            }
+            if (!first) {
+                continue;
+            }
+            std::vector<uint8_t> expected(outputSize);
+            reference.run(input.data(), expected.data(), size, count);
+            for (size_t i = r + 1; i < backends.size(); ++i) {
+                const Backend& backend = backends[i];
+                std::string fullName = backend.algorithm + "/" + backend.name;
+                if (backend.group != reference.group || fullName.find(filter) == std::string::npos) {
+                    continue;
+                }
+                std::vector<uint8_t> output(outputSize);
+                backend.run(input.data(), output.data(), size, count);
+                if (output != expected) {
+                    std::fprintf(stderr, "%s disagrees with %s/%s on %zu messages of %zu bytes\n",
+                                 fullName.c_str(), reference.algorithm.c_str(), reference.name.c_str(), count,
+                                 size);
+                    ok = false;
+                }
+            }
+        }
+    }
+    return ok;
+}
+
+void PinToCpu(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+        std::fprintf(stderr, "warning: could not pin to cpu %d\n", cpu);
+    }
+}
+
+double Percentile(const std::vector<double>& sorted, double p) {
+    size_t index = static_cast<size_t>(p * (sorted.size() - 1) + 0.5);
+    return sorted[std::min(index, sorted.size() - 1)];
+}
+
+void RunCase(const Backend& backend, size_t size, const Options& options, FILE* out) {
+    using Clock = std::chrono::steady_clock;
+    size_t count = backend.batch(size);
+    size_t bytes = size * count;
+    std::vector<uint8_t> input(std::max<size_t>(bytes, 1));
+    FillInput(input);
+    std::vector<uint8_t> output(std::max<size_t>(bytes, 32 * count));
+
+    // Warm caches, page in the buffers and let the clock ramp up.
+    auto warmEnd = Clock::now() + std::chrono::duration<double>(options.minTime / 4);
+    int warm = 0;
+    do {
+        backend.run(input.data(), output.data(), size, count);
+    } while (++warm < 2 || Clock::now() < warmEnd);
+
+    if (options.stats) {
+        SM3_Stats::Reset();
+        sm4_stats_reset();
+    }
+    std::vector<double> nanos;
+    std::vector<double> cycles;
+    auto end = Clock::now() + std::chrono::duration<double>(options.minTime);
+    do {
+        auto t0 = Clock::now();
+        uint64_t c0 = __rdtsc();
+        backend.run(input.data(), output.data(), size, count);
+        uint64_t c1 = __rdtsc();
+        auto t1 = Clock::now();
+        nanos.push_back(std::chrono::duration<double, std::nano>(t1 - t0).count());
+        cycles.push_back(static_cast<double>(c1 - c0));
+    } while ((nanos.size() < 5 || Clock::now() < end) && nanos.size() < 1000000);
+
+    std::sort(nanos.begin(), nanos.end());
+    std::sort(cycles.begin(), cycles.end());
+    double medianNs = Percentile(nanos, 0.5);
+    double medianCycles = Percentile(cycles, 0.5);
+    // Latency is per message; throughput and cycles/byte are per operation.
+    std::fprintf(out,
+                 "{\"algorithm\":\"%s\",\"backend\":\"%s\",\"size\":%zu,\"messages\":%zu,\"samples\":%zu,"
+                 "\"cycles_per_byte\":%.3f,\"cycles_per_message\":%.1f,\"gb_per_s\":%.4f,"
+                 "\"latency_ns\":{\"min\":%.1f,\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f}",
+                 backend.algorithm.c_str(), backend.name.c_str(), size, count, nanos.size(),
+                 bytes ? medianCycles / bytes : 0.0, medianCycles / count,
+                 bytes / medianNs, nanos.front() / count, medianNs / count,
+                 Percentile(nanos, 0.9) / count, Percentile(nanos, 0.99) / count);
+    if (options.stats) {
+        sm4_stats_t sm4;
+        sm4_stats_snapshot(&sm4);
+        std::fprintf(out, ",\"sm3_stats\":%s,\"sm4_stats\":", SM3_Stats::Snapshot().ToJson().c_str());
+        sm4_stats_write_json(&sm4, out);
+    }
+    std::fputs("}\n", out);
+    std::fflush(out);
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    Options options = ParseOptions(argc, argv);
+    std::vector<Backend> backends = Backends();
+    if (options.list) {
+        for (const Backend& backend : backends) {
+            std::printf("%s/%s\n", backend.algorithm.c_str(), backend.name.c_str());
+        }
+        return 0;
+    }
+
+    if (!VerifyBackends(backends, options.filter)) {
+        return 1;
+    }
+
+    FILE* out = stdout;
+    if (!options.output.empty()) {
+        out = std::fopen(options.output.c_str(), "w");
+        if (!out) {
+            std::perror(options.output.c_str());
+            return 1;
+        }
+    }
+
+    PinToCpu(options.cpu);
+    if (options.stats && (!SM3_Stats::EnablePerf() || sm4_stats_perf_enable() != 0)) {
+        std::fprintf(stderr, "warning: %s\n",
+                     SM3_Stats::enabled ? "perf counters unavailable, reporting cycles only"
+                                        : "built without -DSM_INSTRUMENT=ON, stats will read zero");
+    }
+    for (const Backend& backend : backends) {
+        std::string fullName = backend.algorithm + "/" + backend.name;
+        if (fullName.find(options.filter) == std::string::npos) {
+            continue;
+        }
+        for (size_t size : Sizes(options)) {
+            RunCase(backend, size, options, out);
+        }
+    }
+    if (out != stdout) {
+        std::fclose(out);
+    }
+    return 0;
+}
@@ -0,0 +1,381 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <x86intrin.h>
+#include "sm4.h"
+#include "sm4_internal.h"
+#include "sm4_stats.h"
+
+static inline uint32_t rotl32(uint32_t x, int n) { return (x << n) | (x >> (32 - n)); }
+static inline uint32_t bswap32(uint32_t x) {
+    return ((x & 0x000000FFu) << 24) |
+           ((x & 0x0000FF00u) << 8) |
+           ((x & 0x00FF0000u) >> 8) |
+           ((x & 0xFF000000u) >> 24);
+}
+
+static inline uint32_t load_be32(const void* p) {
+    uint32_t x; memcpy(&x, p, 4); return bswap32(x);
+}
+
+static inline void store_be32(void* p, uint32_t x) {
+    x = bswap32(x); memcpy(p, &x, 4);
+}
+
+static const uint32_t FK[4] = {
+    0xA3B1BAC6u, 0x56AA3350u, 0x677D9197u, 0xB27022DCu
+};
+
+static const uint32_t CK[32] = {
+    0x00070E15u, 0x1C232A31u, 0x383F464Du, 0x545B6269u,
+    0x70777E85u, 0x8C939AA1u, 0xA8AFB6BDu, 0xC4CBD2D9u,
+    0xE0E7EEF5u, 0xFC030A11u, 0x181F262Du, 0x343B4249u,
+    0x50575E65u, 0x6C737A81u, 0x888F969Du, 0xA4ABB2B9u,
+    0xC0C7CED5u, 0xDCE3EAF1u, 0xF8FF060Du, 0x141B2229u,
+    0x30373E45u, 0x4C535A61u, 0x686F767Du, 0x848B9299u,
+    0xA0A7AEB5u, 0xBCC3CAD1u, 0xD8DFE6EDu, 0xF4FB0209u,
+    0x10171E25u, 0x2C333A41u, 0x484F565Du, 0x646B7279u
+};
+
+/* The S-box as an X-macro, F(s) for each entry in order, so that it and the
+   T-tables derived from it are initializers the compiler evaluates: nothing
+   is built at startup. */
+#define SM4_SBOX(F) \
+    F(0xD6) F(0x90) F(0xE9) F(0xFE) F(0xCC) F(0xE1) F(0x3D) F(0xB7) F(0x16) F(0xB6) F(0x14) F(0xC2) F(0x28) F(0xFB) F(0x2C) F(0x05) \
+    F(0x2B) F(0x67) F(0x9A) F(0x76) F(0x2A) F(0xBE) F(0x04) F(0xC3) F(0xAA) F(0x44) F(0x13) F(0x26) F(0x49) F(0x86) F(0x06) F(0x99) \
+    F(0x9C) F(0x42) F(0x50) F(0xF4) F(0x91) F(0xEF) F(0x98) F(0x7A) F(0x33) F(0x54) F(0x0B) F(0x43) F(0xED) F(0xCF) F(0xAC) F(0x62) \
+    F(0xE4) F(0xB3) F(0x1C) F(0xA9) F(0xC9) F(0x08) F(0xE8) F(0x95) F(0x80) F(0xDF) F(0x94) F(0xFA) F(0x75) F(0x8F) F(0x3F) F(0xA6) \
+    F(0x47) F(0x07) F(0xA7) F(0xFC) F(0xF3) F(0x73) F(0x17) F(0xBA) F(0x83) F(0x59) F(0x3C) F(0x19) F(0xE6) F(0x85) F(0x4F) F(0xA8) \
+    F(0x68) F(0x6B) F(0x81) F(0xB2) F(0x71) F(0x64) F(0xDA) F(0x8B) F(0xF8) F(0xEB) F(0x0F) F(0x4B) F(0x70) F(0x56) F(0x9D) F(0x35) \
+    F(0x1E) F(0x24) F(0x0E) F(0x5E) F(0x63) F(0x58) F(0xD1) F(0xA2) F(0x25) F(0x22) F(0x7C) F(0x3B) F(0x01) F(0x21) F(0x78) F(0x87) \
+    F(0xD4) F(0x00) F(0x46) F(0x57) F(0x9F) F(0xD3) F(0x27) F(0x52) F(0x4C) F(0x36) F(0x02) F(0xE7) F(0xA0) F(0xC4) F(0xC8) F(0x9E) \
+    F(0xEA) F(0xBF) F(0x8A) F(0xD2) F(0x40) F(0xC7) F(0x38) F(0xB5) F(0xA3) F(0xF7) F(0xF2) F(0xCE) F(0xF9) F(0x61) F(0x15) F(0xA1) \
+    F(0xE0) F(0xAE) F(0x5D) F(0xA4) F(0x9B) F(0x34) F(0x1A) F(0x55) F(0xAD) F(0x93) F(0x32) F(0x30) F(0xF5) F(0x8C) F(0xB1) F(0xE3) \
+    F(0x1D) F(0xF6) F(0xE2) F(0x2E) F(0x82) F(0x66) F(0xCA) F(0x60) F(0xC0) F(0x29) F(0x23) F(0xAB) F(0x0D) F(0x53) F(0x4E) F(0x6F) \
+    F(0xD5) F(0xDB) F(0x37) F(0x45) F(0xDE) F(0xFD) F(0x8E) F(0x2F) F(0x03) F(0xFF) F(0x6A) F(0x72) F(0x6D) F(0x6C) F(0x5B) F(0x51) \
+    F(0x8D) F(0x1B) F(0xAF) F(0x92) F(0xBB) F(0xDD) F(0xBC) F(0x7F) F(0x11) F(0xD9) F(0x5C) F(0x41) F(0x1F) F(0x10) F(0x5A) F(0xD8) \
+    F(0x0A) F(0xC1) F(0x31) F(0x88) F(0xA5) F(0xCD) F(0x7B) F(0xBD) F(0x2D) F(0x74) F(0xD0) F(0x12) F(0xB8) F(0xE5) F(0xB4) F(0xB0) \
+    F(0x89) F(0x69) F(0x97) F(0x4A) F(0x0C) F(0x96) F(0x77) F(0x7E) F(0x65) F(0xB9) F(0xF1) F(0x09) F(0xC5) F(0x6E) F(0xC6) F(0x84) \
+    F(0x18) F(0xF0) F(0x7D) F(0xEC) F(0x3A) F(0xDC) F(0x4D) F(0x20) F(0x79) F(0xEE) F(0x5F) F(0x3E) F(0xD7) F(0xCB) F(0x39) F(0x48)
+
+#define SM4_BYTE(s) s,
+#define SM4_ROTL_CONST(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+#define SM4_L_CONST(x) \
+    ((x) ^ SM4_ROTL_CONST(x, 2) ^ SM4_ROTL_CONST(x, 10) ^ SM4_ROTL_CONST(x, 18) ^ SM4_ROTL_CONST(x, 24))
+/* Column k holds L(S(b) << 24) rotated right by 8k. */
+#define SM4_T0(s) SM4_L_CONST((uint32_t)(s) << 24),
+#define SM4_T1(s) SM4_ROTL_CONST(SM4_L_CONST((uint32_t)(s) << 24), 24),
+#define SM4_T2(s) SM4_ROTL_CONST(SM4_L_CONST((uint32_t)(s) << 24), 16),
+#define SM4_T3(s) SM4_ROTL_CONST(SM4_L_CONST((uint32_t)(s) << 24), 8),
+
+__attribute__((aligned(64))) const uint8_t sm4_sbox[256] = { SM4_SBOX(SM4_BYTE) };
+
+__attribute__((aligned(64))) const uint32_t sm4_T[4][256] = {
+    { SM4_SBOX(SM4_T0) }, { SM4_SBOX(SM4_T1) }, { SM4_SBOX(SM4_T2) }, { SM4_SBOX(SM4_T3) }
+};
+
+static uint32_t tau(uint32_t x) {
+    return ((uint32_t)sm4_sbox[x >> 24] << 24) | ((uint32_t)sm4_sbox[(x >> 16) & 0xFF] << 16) |
+           ((uint32_t)sm4_sbox[(x >> 8) & 0xFF] << 8) | sm4_sbox[x & 0xFF];
+}
+
+/* The tables are constant now; kept so that existing callers still link. */
+void sm4_build_Ttables(void) {
+}
+
+void sm4_key_schedule(sm4_key_t* ks, const uint8_t key[16]) {
+    SM4_STATS_BEGIN(mark);
+    uint32_t K[4];
+    for (int i = 0; i < 4; i++) {
+        K[i] = load_be32(key + 4 * i) ^ FK[i];
+    }
+    for (int i = 0; i < 32; i++) {
+        uint32_t t = tau(K[1] ^ K[2] ^ K[3] ^ CK[i]);
+        ks->rk[i] = K[0] ^ t ^ rotl32(t, 13) ^ rotl32(t, 23);
+        K[0] = K[1]; K[1] = K[2]; K[2] = K[3]; K[3] = ks->rk[i];
+    }
+    for (int i = 0; i < 32; i++) {
+        ks->drk[i] = ks->rk[31 - i];
+    }
+    SM4_STATS_END(mark, SM4_PHASE_KEY_SCHEDULE);
+}
+
+static inline void sm4_round(uint32_t* X, uint32_t rk) {
+    uint32_t t = X[1] ^ X[2] ^ X[3] ^ rk;
+    X[0] ^= sm4_T[0][(t >> 24) & 0xFF] ^ sm4_T[1][(t >> 16) & 0xFF] ^
+             sm4_T[2][(t >> 8) & 0xFF] ^ sm4_T[3][t & 0xFF];
+}
+
+static void sm4_table_crypt_blocks(const uint32_t rk[32], const uint8_t* in, uint8_t* out, size_t blocks) {
+    for (; blocks; blocks--, in += 16, out += 16) {
+        uint32_t X[4];
+        X[0] = load_be32(in + 0); X[1] = load_be32(in + 4);
+        X[2] = load_be32(in + 8); X[3] = load_be32(in + 12);
+        for (int i = 0; i < 32; i++) {
+            sm4_round(X, rk[i]);
+            uint32_t tmp = X[0]; X[0] = X[1]; X[1] = X[2]; X[2] = X[3]; X[3] = tmp;
+        }
+        store_be32(out + 0, X[3]); store_be32(out + 4, X[2]);
+        store_be32(out + 8, X[1]); store_be32(out + 12, X[0]);
+    }
+}
+
+typedef void (*sm4_blocks_fn)(const uint32_t rk[32], const uint8_t* in, uint8_t* out, size_t blocks);
+
+static sm4_blocks_fn sm4_impl_kernel(sm4_impl_t impl);
+
+/* Every kernel call outside the self-test goes through here, so an
+   instrumented build sees each one; otherwise it is the bare call. */
+static inline void sm4_run_kernel(sm4_impl_t impl, const uint32_t rk[32], const uint8_t* in, uint8_t* out,
+                                  size_t blocks) {
+    SM4_STATS_BEGIN(mark);
+    sm4_impl_kernel(impl)(rk, in, out, blocks);
+    SM4_STATS_END(mark, SM4_PHASE_KERNEL);
+    SM4_STATS_COUNT(impl, blocks);
+}
+
+/* The direction is fixed by the round-key array, picked once per call. */
+void sm4_process_block(const sm4_key_t* ks, const uint8_t in[16], uint8_t out[16], int decrypt) {
+    sm4_run_kernel(sm4_table_impl(), decrypt ? ks->drk : ks->rk, in, out, 1);
+}
+
+static sm4_blocks_fn sm4_impl_kernel(sm4_impl_t impl) {
+    switch (impl) {
+    case SM4_IMPL_AESNI: return sm4_aesni_crypt_blocks;
+    case SM4_IMPL_GFNI: return sm4_gfni_crypt_blocks;
+    case SM4_IMPL_BITSLICE: return sm4_bitslice_crypt_blocks;
+    case SM4_IMPL_TABLE_1K: return sm4_table1k_crypt_blocks;
+    case SM4_IMPL_SBOX: return sm4_sbox_crypt_blocks;
+    default: return sm4_table_crypt_blocks;
+    }
+}
+
+int sm4_impl_supported(sm4_impl_t impl) {
+    __builtin_cpu_init();
+    switch (impl) {
+    case SM4_IMPL_AUTO:
+    case SM4_IMPL_TABLE:
+    case SM4_IMPL_TABLE_1K:
+        return 1;
+    case SM4_IMPL_AESNI:
+        return __builtin_cpu_supports("ssse3") && __builtin_cpu_supports("aes");
+    case SM4_IMPL_GFNI:
+        return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") &&
+               __builtin_cpu_supports("gfni") && sm4_impl_supported(SM4_IMPL_AESNI);
+    case SM4_IMPL_BITSLICE:
+    case SM4_IMPL_SBOX:
+        return __builtin_cpu_supports("ssse3");
+    }
+    return 0;
+}
+
+const char* sm4_impl_name(sm4_impl_t impl) {
+    switch (impl) {
+    case SM4_IMPL_AUTO: return "auto";
+    case SM4_IMPL_TABLE: return "table";
+    case SM4_IMPL_AESNI: return "aesni";
+    case SM4_IMPL_GFNI: return "gfni";
+    case SM4_IMPL_BITSLICE: return "bitslice";
+    case SM4_IMPL_TABLE_1K: return "table-1k";
+    case SM4_IMPL_SBOX: return "sbox";
+    }
+    return "unknown";
+}
+
+/* Runs a candidate kernel on a span that covers both its wide loop and its
+   tail, in both directions, and compares with the table path. */
+static int sm4_impl_selftest(sm4_impl_t impl) {
+    static const uint8_t key[16] = {
+        0x01, 0x23, 0x45, 0x67, 0x89, 0xAB, 0xCD, 0xEF, 0xFE, 0xDC, 0xBA, 0x98, 0x76, 0x54, 0x32, 0x10
+    };
+    enum { blocks = 128 + 64 + 32 + 16 + 8 + 3 };
+    uint8_t in[16 * blocks], expect[16 * blocks], got[16 * blocks];
+    sm4_key_t ks;
+    sm4_key_schedule(&ks, key);
+    for (size_t i = 0; i < sizeof(in); i++) {
+        in[i] = (uint8_t)(i * 167 + 13);
+    }
+    for (int decrypt = 0; decrypt < 2; decrypt++) {
+        const uint32_t* rk = decrypt ? ks.drk : ks.rk;
+        sm4_table_crypt_blocks(rk, in, expect, blocks);
+        sm4_impl_kernel(impl)(rk, in, got, blocks);
+        if (memcmp(expect, got, sizeof(got)) != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int sm4_table = -1;
+
+#define SM4_TABLE_TRIALS 15
+#define SM4_TABLE_SWEEP (64 * 1024)
+
+/* Median cycles for one 64-byte record encrypted block by block, as CBC
+   does, after a write sweep twice the size of a typical L1 data cache. */
+static uint64_t sm4_table_time(sm4_impl_t impl, const sm4_key_t* ks, uint8_t* sweep) {
+    uint64_t samples[SM4_TABLE_TRIALS];
+    uint8_t block[16] = { 0 };
+    sm4_blocks_fn kernel = sm4_impl_kernel(impl);
+    for (int trial = 0; trial < SM4_TABLE_TRIALS; trial++) {
+        for (size_t i = 0; i < SM4_TABLE_SWEEP; i += 64) {
+            sweep[i]++;
+        }
+        uint64_t start = __rdtsc();
+        for (int b = 0; b < 4; b++) {
+            kernel(ks->rk, block, block, 1);
+        }
+        samples[trial] = __rdtsc() - start;
+    }
+    for (int i = 1; i < SM4_TABLE_TRIALS; i++) {
+        for (int j = i; j > 0 && samples[j] < samples[j - 1]; j--) {
+            uint64_t t = samples[j]; samples[j] = samples[j - 1]; samples[j - 1] = t;
+        }
+    }
+    return samples[SM4_TABLE_TRIALS / 2];
+}
+
+sm4_impl_t sm4_table_impl(void) {
+    int table = __atomic_load_n(&sm4_table, __ATOMIC_ACQUIRE);
+    if (table < 0) {
+        static const uint8_t key[16] = { 0 };
+        const sm4_impl_t candidates[] = { SM4_IMPL_TABLE, SM4_IMPL_TABLE_1K, SM4_IMPL_SBOX };
+        uint8_t* sweep = calloc(1, SM4_TABLE_SWEEP);
+        sm4_key_t ks;
+        uint64_t fastest = UINT64_MAX;
+        sm4_key_schedule(&ks, key);
+        table = SM4_IMPL_TABLE;
+        for (size_t i = 0; sweep && i < sizeof(candidates) / sizeof(candidates[0]); i++) {
+            if (!sm4_impl_supported(candidates[i]) || (i && !sm4_impl_selftest(candidates[i]))) {
+                continue;
+            }
+            uint64_t cycles = sm4_table_time(candidates[i], &ks, sweep);
+            if (cycles < fastest) {
+                fastest = cycles;
+                table = candidates[i];
+            }
+        }
+        free(sweep);
+        /* A layout set meanwhile wins over the measurement. */
+        int unset = -1;
+        if (!__atomic_compare_exchange_n(&sm4_table, &unset, table, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            table = unset;
+        }
+    }
+    return (sm4_impl_t)table;
+}
+
+int sm4_set_table_impl(sm4_impl_t impl) {
+    if ((impl != SM4_IMPL_TABLE && impl != SM4_IMPL_TABLE_1K && impl != SM4_IMPL_SBOX) ||
+        !sm4_impl_supported(impl)) {
+        return -1;
+    }
+    __atomic_store_n(&sm4_table, impl, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static int sm4_best = -1;
+
+sm4_impl_t sm4_best_impl(void) {
+    int best = __atomic_load_n(&sm4_best, __ATOMIC_ACQUIRE);
+    if (best < 0) {
+        /* Fastest first. With AVX2 lanes the bitsliced kernel beats AES-NI, and
+           without AES-NI it is still the constant-time choice over the tables. */
+        __builtin_cpu_init();
+        sm4_impl_t second = __builtin_cpu_supports("avx2") ? SM4_IMPL_BITSLICE : SM4_IMPL_AESNI;
+        const sm4_impl_t candidates[] = { SM4_IMPL_GFNI, second, SM4_IMPL_AESNI, SM4_IMPL_BITSLICE };
+        best = sm4_table_impl();
+        for (size_t i = 0; i < sizeof(candidates) / sizeof(candidates[0]); i++) {
+            if (sm4_impl_supported(candidates[i]) && sm4_impl_selftest(candidates[i])) {
+                best = candidates[i];
+                break;
+            }
+        }
+        __atomic_store_n(&sm4_best, best, __ATOMIC_RELEASE);
+    }
+    return (sm4_impl_t)best;
+}
+
+void sm4_crypt_blocks(const sm4_key_t* ks, const uint8_t* in, uint8_t* out, size_t blocks, int decrypt,
+                      sm4_impl_t impl) {
+    /* An implementation this CPU cannot run would die on SIGILL. */
+    if (impl == SM4_IMPL_AUTO || !sm4_impl_supported(impl)) {
+        impl = sm4_best_impl();
+    }
+    sm4_run_kernel(impl, decrypt ? ks->drk : ks->rk, in, out, blocks);
+}
+
+void sm4_run_multikey(const uint32_t* const* rks, const uint8_t* in, uint8_t* out, size_t blocks) {
+    sm4_impl_t impl = sm4_best_impl();
+    if (impl == SM4_IMPL_GFNI) {
+        SM4_STATS_BEGIN(mark);
+        sm4_gfni_crypt_blocks_multikey(rks, in, out, blocks);
+        SM4_STATS_END(mark, SM4_PHASE_KERNEL);
+        SM4_STATS_COUNT(impl, blocks);
+        return;
+    }
+    for (size_t i = 0, n; i < blocks; i += n) {
+        for (n = 1; i + n < blocks && rks[i + n] == rks[i]; n++) {}
+        sm4_run_kernel(impl, rks[i], in + 16 * i, out + 16 * i, n);
+    }
+}
+
+void sm4_crypt_blocks_multikey(const sm4_key_t* const* keys, const uint8_t* in, uint8_t* out, size_t blocks,
+                               int decrypt) {
+    const uint32_t* rks[SM4_BATCH_BLOCKS];
+    while (blocks) {
+        size_t n = blocks < SM4_BATCH_BLOCKS ? blocks : SM4_BATCH_BLOCKS;
+        for (size_t i = 0; i < n; i++) {
+            rks[i] = decrypt ? keys[i]->drk : keys[i]->rk;
+        }
+        sm4_run_multikey(rks, in, out, n);
+        keys += n; in += 16 * n; out += 16 * n; blocks -= n;
+    }
+}
+
+void sm4_ecb_encrypt(const sm4_key_t* ks, const uint8_t* in, uint8_t* out, size_t blocks) {
+    sm4_run_kernel(sm4_best_impl(), ks->rk, in, out, blocks);
+}
+
+void sm4_ecb_decrypt(const sm4_key_t* ks, const uint8_t* in, uint8_t* out, size_t blocks) {
+    sm4_run_kernel(sm4_best_impl(), ks->drk, in, out, blocks);
+}
+
+/* Each block depends on the previous ciphertext, so this runs at the latency
+   of one block. The table path has the lowest: the vector kernels would pad
+   every block to a group of four or more (AES-NI measured 380 ns per block
+   against 205 for the tables). */
+void sm4_cbc_encrypt(const sm4_key_t* ks, const uint8_t iv[16], const uint8_t* in, uint8_t* out, size_t len) {
+    sm4_impl_t impl = sm4_table_impl();
+    uint8_t block[16];
+    memcpy(block, iv, 16);
+    for (; len >= 16; len -= 16, in += 16, out += 16) {
+        for (int i = 0; i < 16; i++) {
+            block[i] ^= in[i];
+        }
+        sm4_run_kernel(impl, ks->rk, block, block, 1);
+        memcpy(out, block, 16);
+    }
+}
+
+void sm4_cbc_decrypt(const sm4_key_t* ks, const uint8_t iv[16], const uint8_t* in, uint8_t* out, size_t len) {
+    uint8_t prev[16]; memcpy(prev, iv, 16);
+    uint8_t plain[16 * SM4_BATCH_BLOCKS];
+
+    /* Every block decrypts independently; the chaining is only the XOR after.
+       Decrypting into a scratch batch and XORing from the back keeps in == out
+       working. */
+    while (len >= 16) {
+        size_t blocks = len / 16 < SM4_BATCH_BLOCKS ? len / 16 : SM4_BATCH_BLOCKS;
+        sm4_crypt_blocks(ks, in, plain, blocks, 1, SM4_IMPL_AUTO);
+        uint8_t next[16]; memcpy(next, in + 16 * (blocks - 1), 16);
+        for (size_t i = 16 * blocks; i-- > 16;) {
+            out[i] = plain[i] ^ in[i - 16];
+        }
+        for (size_t i = 0; i < 16; i++) {
+            out[i] = plain[i] ^ prev[i];
+        }
+        memcpy(prev, next, 16);
+        in += 16 * blocks; out += 16 * blocks; len -= 16 * blocks;
+    }
+}
@@ -0,0 +1,147 @@
+#ifndef SM4_H
+#define SM4_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct { uint32_t rk[32]; uint32_t drk[32]; } sm4_key_t;
+
+/* Block kernels. AUTO picks the fastest one the CPU supports that also agrees
+   with the table path on a self-test. TABLE, TABLE_1K and SBOX are the three
+   table layouts: four rotated 1 KB T-tables, one T-table rotated in registers,
+   and the 256-byte S-box with L computed in SSE registers. */
+typedef enum {
+    SM4_IMPL_AUTO = 0,
+    SM4_IMPL_TABLE,
+    SM4_IMPL_AESNI,
+    SM4_IMPL_GFNI,
+    SM4_IMPL_BITSLICE,
+    SM4_IMPL_TABLE_1K,
+    SM4_IMPL_SBOX
+} sm4_impl_t;
+
+/* No-op: every table is a compile-time constant. */
+void sm4_build_Ttables(void);
+void sm4_key_schedule(sm4_key_t* ks, const uint8_t key[16]);
+void sm4_process_block(const sm4_key_t* ks, const uint8_t in[16], uint8_t out[16], int decrypt);
+int sm4_impl_supported(sm4_impl_t impl);
+sm4_impl_t sm4_best_impl(void);
+/* The table layout serving the single-block paths (sm4_process_block, CBC
+   encryption) and AUTO on CPUs without a vector kernel. Unless set, it is
+   picked on first use by timing each layout with L1 flushed by a sweep of
+   unrelated data before every call, the way a core shared with other work
+   finds them; set it to fix the layout per deployment. Setting anything but
+   a table layout returns -1. */
+sm4_impl_t sm4_table_impl(void);
+int sm4_set_table_impl(sm4_impl_t impl);
+const char* sm4_impl_name(sm4_impl_t impl);
+/* ECB over whole blocks; in and out may be the same buffer. An impl the CPU
+   does not support (sm4_impl_supported) runs as AUTO instead. */
+void sm4_crypt_blocks(const sm4_key_t* ks, const uint8_t* in, uint8_t* out, size_t blocks, int decrypt,
+                      sm4_impl_t impl);
+/* CTR with iv as the first 128-bit big-endian counter block; any len, in and
+   out may be the same buffer. The _mt variant splits the buffer by counter
+   offset across `threads` threads (0: one per online CPU) and gives the same
+   output. */
+void sm4_ctr_encrypt(const sm4_key_t* ks, const uint8_t iv[16], const uint8_t* in, uint8_t* out, size_t len);
+void sm4_ctr_encrypt_mt(const sm4_key_t* ks, const uint8_t iv[16], const uint8_t* in, uint8_t* out, size_t len,
+                        unsigned threads);
+/* ECB where block i is processed with *keys[i], e.g. small records of many
+   tenants in one call; in and out may be the same buffer. With GFNI each of
+   the kernel's 16 lanes loads its own round keys, so mixed keys run at the
+   single-key rate; other kernels take each run of blocks sharing a key. */
+void sm4_crypt_blocks_multikey(const sm4_key_t* const* keys, const uint8_t* in, uint8_t* out, size_t blocks,
+                               int decrypt);
+
+/* Key-schedule cache for thousands of keys, e.g. one per tenant. A key may
+   live in either of two sets of SM4_KEY_CACHE_WAYS schedules, whose 16-byte
+   keys share a cache line; a miss schedules it into the least recently used
+   way of the two. Not thread-safe: use one cache per thread. */
+#define SM4_KEY_CACHE_WAYS 4
+
+typedef struct sm4_key_cache_set sm4_key_cache_set_t;
+
+typedef struct {
+    sm4_key_cache_set_t* sets;
+    size_t set_mask;
+    uint32_t clock;
+    uint64_t hits;
+    uint64_t misses;
+} sm4_key_cache_t;
+
+/* Room for capacity keys: twice that many ways, rounded up to a power of two
+   number of sets. 0 on success, -1 if the allocation fails. */
+int sm4_key_cache_init(sm4_key_cache_t* cache, size_t capacity);
+/* Clears every cached key and schedule and releases the memory. */
+void sm4_key_cache_free(sm4_key_cache_t* cache);
+/* The schedule of key, computed on a miss. The pointer is only valid until
+   the next lookup in the same cache, which may evict it. */
+const sm4_key_t* sm4_key_cache_get(sm4_key_cache_t* cache, const uint8_t key[16]);
+
+/* One record of sm4_ctr_encrypt_records: a 16-byte key, the first counter
+   block and any length of data. */
+typedef struct {
+    const uint8_t* key;
+    const uint8_t* iv;
+    const uint8_t* in;
+    uint8_t* out;
+    size_t len;
+} sm4_ctr_record_t;
+
+/* CTR over many records, each under its own key looked up in cache. The
+   blocks of consecutive records share one multi-key kernel batch, so a record
+   of a block or two costs neither a key schedule nor a kernel call of its
+   own. Gives the same output as sm4_ctr_encrypt on every record. */
+void sm4_ctr_encrypt_records(sm4_key_cache_t* cache, const sm4_ctr_record_t* records, size_t count);
+
+/* ECB with the fastest kernel, one direction each. */
+void sm4_ecb_encrypt(const sm4_key_t* ks, const uint8_t* in, uint8_t* out, size_t blocks);
+void sm4_ecb_decrypt(const sm4_key_t* ks, const uint8_t* in, uint8_t* out, size_t blocks);
+/* CBC; len is a multiple of 16 and in and out may be the same buffer.
+   Encryption is inherently serial, decryption runs batches through the wide
+   kernels. */
+void sm4_cbc_encrypt(const sm4_key_t* ks, const uint8_t iv[16], const uint8_t* in, uint8_t* out, size_t len);
+void sm4_cbc_decrypt(const sm4_key_t* ks, const uint8_t iv[16], const uint8_t* in, uint8_t* out, size_t len);
+
+/* SM4-XTS as in IEEE 1619: key is the data key followed by the tweak key, iv
+   the 16-byte tweak of one data unit of len >= 16 bytes (a partial last block
+   uses ciphertext stealing). The _sectors calls treat in as consecutive
+   sectors numbered from `sector`, each tweaked by its number in little-endian.
+   All return 0, or -1 if a data unit is shorter than one block. */
+typedef struct {
+    sm4_key_t data;
+    sm4_key_t tweak;
+} sm4_xts_key_t;
+
+void sm4_xts_init(sm4_xts_key_t* xk, const uint8_t key[32]);
+int sm4_xts_encrypt(const sm4_xts_key_t* xk, const uint8_t iv[16], const uint8_t* in, uint8_t* out, size_t len);
+int sm4_xts_decrypt(const sm4_xts_key_t* xk, const uint8_t iv[16], const uint8_t* in, uint8_t* out, size_t len);
+int sm4_xts_encrypt_sectors(const sm4_xts_key_t* xk, uint64_t sector, size_t sector_size, const uint8_t* in,
+                            uint8_t* out, size_t sectors);
+int sm4_xts_decrypt_sectors(const sm4_xts_key_t* xk, uint64_t sector, size_t sector_size, const uint8_t* in,
+                            uint8_t* out, size_t sectors);
+
+/* SM4-GCM (NIST SP 800-38D, RFC 8998) with 16-byte tags. The context holds the
+   key schedule and the GHASH key powers H .. H^8; any IV length is accepted,
+   12 bytes being the fast path. Decryption returns 0 if the tag matches and -1
+   otherwise, in which case out is cleared. */
+typedef struct {
+    sm4_key_t ks;
+    uint8_t h[8][16];
+} sm4_gcm_key_t;
+
+void sm4_gcm_init(sm4_gcm_key_t* gk, const uint8_t key[16]);
+void sm4_gcm_encrypt(const sm4_gcm_key_t* gk, const uint8_t* iv, size_t iv_len, const uint8_t* aad, size_t aad_len,
+                     const uint8_t* in, uint8_t* out, size_t len, uint8_t tag[16]);
+int sm4_gcm_decrypt(const sm4_gcm_key_t* gk, const uint8_t* iv, size_t iv_len, const uint8_t* aad, size_t aad_len,
+                    const uint8_t* in, uint8_t* out, size_t len, const uint8_t tag[16]);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,122 @@
+/* SM4 with AES-NI. The SM4 and AES S-boxes are both inversion in GF(2^8)
+   wrapped in affine maps, and the two fields are isomorphic, so
+   S_sm4(x) = post(S_aes(pre(x))) for affine pre/post. pre and post are applied
+   as two 16-entry nibble lookups with PSHUFB, and S_aes comes from AESENCLAST
+   with a zero round key, after undoing its ShiftRows. Four blocks are held
+   transposed in four registers (one word of each block per lane); the main
+   loop keeps two such groups in flight. */
+
+#include <string.h>
+#include <immintrin.h>
+#include "sm4_internal.h"
+
+#define SM4_AESNI_TARGET __attribute__((target("ssse3,aes"), always_inline)) static inline
+
+SM4_AESNI_TARGET __m128i sm4_aesni_affine(__m128i x, __m128i lo, __m128i hi) {
+    const __m128i nibble = _mm_set1_epi8(0x0F);
+    __m128i l = _mm_shuffle_epi8(lo, _mm_and_si128(x, nibble));
+    __m128i h = _mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi32(x, 4), nibble));
+    return _mm_xor_si128(l, h);
+}
+
+SM4_AESNI_TARGET __m128i sm4_aesni_sbox(__m128i x) {
+    const __m128i pre_lo = _mm_set_epi64x((long long)0x9814a8241d912da1ULL, 0x078b37bb820eb23eLL);
+    const __m128i pre_hi = _mm_set_epi64x(0x3fe311cdfa26d408LL, 0x37eb19c5f22edc00LL);
+    const __m128i post_lo = _mm_set_epi64x(0x47ff8d3579c1b30bLL, 0x2098ea521ea6d46cLL);
+    const __m128i post_hi = _mm_set_epi64x((long long)0xed0dbd5d709020c0ULL, 0x2dcd7d9db050e000LL);
+    const __m128i inv_shift_rows = _mm_setr_epi8(0, 13, 10, 7, 4, 1, 14, 11, 8, 5, 2, 15, 12, 9, 6, 3);
+    x = sm4_aesni_affine(x, pre_lo, pre_hi);
+    x = _mm_aesenclast_si128(_mm_shuffle_epi8(x, inv_shift_rows), _mm_setzero_si128());
+    return sm4_aesni_affine(x, post_lo, post_hi);
+}
+
+/* L(x) = x ^ rotl(x, 24) ^ rotl(x ^ rotl(x, 8) ^ rotl(x, 16), 2); the byte
+   rotates are shuffles, leaving a single shift pair. */
+SM4_AESNI_TARGET __m128i sm4_aesni_l(__m128i x) {
+    const __m128i rol8 = _mm_setr_epi8(3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14);
+    const __m128i rol16 = _mm_setr_epi8(2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13);
+    const __m128i rol24 = _mm_setr_epi8(1, 2, 3, 0, 5, 6, 7, 4, 9, 10, 11, 8, 13, 14, 15, 12);
+    __m128i t = _mm_xor_si128(x, _mm_xor_si128(_mm_shuffle_epi8(x, rol8), _mm_shuffle_epi8(x, rol16)));
+    t = _mm_or_si128(_mm_slli_epi32(t, 2), _mm_srli_epi32(t, 30));
+    return _mm_xor_si128(_mm_xor_si128(x, _mm_shuffle_epi8(x, rol24)), t);
+}
+
+SM4_AESNI_TARGET void sm4_aesni_transpose(__m128i* x) {
+    __m128i t0 = _mm_unpacklo_epi32(x[0], x[1]);
+    __m128i t1 = _mm_unpackhi_epi32(x[0], x[1]);
+    __m128i t2 = _mm_unpacklo_epi32(x[2], x[3]);
+    __m128i t3 = _mm_unpackhi_epi32(x[2], x[3]);
+    x[0] = _mm_unpacklo_epi64(t0, t2);
+    x[1] = _mm_unpackhi_epi64(t0, t2);
+    x[2] = _mm_unpacklo_epi64(t1, t3);
+    x[3] = _mm_unpackhi_epi64(t1, t3);
+}
+
+/* Loads 4 blocks per group as big-endian words, transposed. */
+SM4_AESNI_TARGET void sm4_aesni_load(__m128i (*x)[4], int groups, const uint8_t* in) {
+    const __m128i bswap = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    for (int g = 0; g < groups; g++) {
+        for (int j = 0; j < 4; j++) {
+            x[g][j] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(in + 64 * g + 16 * j)), bswap);
+        }
+        sm4_aesni_transpose(x[g]);
+    }
+}
+
+/* Stores the final (X35, X34, X33, X32) of every block. */
+SM4_AESNI_TARGET void sm4_aesni_store(__m128i (*x)[4], int groups, uint8_t* out) {
+    const __m128i bswap = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    for (int g = 0; g < groups; g++) {
+        __m128i y[4] = { x[g][3], x[g][2], x[g][1], x[g][0] };
+        sm4_aesni_transpose(y);
+        for (int j = 0; j < 4; j++) {
+            _mm_storeu_si128((__m128i*)(out + 64 * g + 16 * j), _mm_shuffle_epi8(y[j], bswap));
+        }
+    }
+}
+
+#define SM4_AESNI_ROUND(a, b, c, d, k)                                                          \
+    for (int g = 0; g < groups; g++) {                                                           \
+        __m128i t = _mm_xor_si128(_mm_xor_si128(x[g][b], x[g][c]), _mm_xor_si128(x[g][d], k));  \
+        x[g][a] = _mm_xor_si128(x[g][a], sm4_aesni_l(sm4_aesni_sbox(t)));                        \
+    }
+
+SM4_AESNI_TARGET void sm4_aesni_rounds(__m128i (*x)[4], int groups, const uint32_t* rk) {
+    for (int i = 0; i < 32; i += 4) {
+        __m128i k0 = _mm_set1_epi32((int)rk[i]);
+        __m128i k1 = _mm_set1_epi32((int)rk[i + 1]);
+        __m128i k2 = _mm_set1_epi32((int)rk[i + 2]);
+        __m128i k3 = _mm_set1_epi32((int)rk[i + 3]);
+        SM4_AESNI_ROUND(0, 1, 2, 3, k0)
+        SM4_AESNI_ROUND(1, 2, 3, 0, k1)
+        SM4_AESNI_ROUND(2, 3, 0, 1, k2)
+        SM4_AESNI_ROUND(3, 0, 1, 2, k3)
+    }
+}
+
+#undef SM4_AESNI_ROUND
+
+__attribute__((target("ssse3,aes")))
+void sm4_aesni_crypt_blocks(const uint32_t rk[32], const uint8_t* in, uint8_t* out, size_t blocks) {
+    for (; blocks >= 8; blocks -= 8, in += 128, out += 128) {
+        __m128i x[2][4];
+        sm4_aesni_load(x, 2, in);
+        sm4_aesni_rounds(x, 2, rk);
+        sm4_aesni_store(x, 2, out);
+    }
+    for (; blocks >= 4; blocks -= 4, in += 64, out += 64) {
+        __m128i x[1][4];
+        sm4_aesni_load(x, 1, in);
+        sm4_aesni_rounds(x, 1, rk);
+        sm4_aesni_store(x, 1, out);
+    }
+    if (blocks) {
+        uint8_t buffer[64] = { 0 };
+        __m128i x[1][4];
+        memcpy(buffer, in, 16 * blocks);
+        sm4_aesni_load(x, 1, buffer);
+        sm4_aesni_rounds(x, 1, rk);
+        sm4_aesni_store(x, 1, buffer);
+        memcpy(out, buffer, 16 * blocks);
+    }
+}
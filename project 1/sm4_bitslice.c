@@ -0,0 +1,146 @@
+/* Bitsliced SM4: no table lookups and no secret-dependent branches or
+   addresses, only AND/XOR/NOT and fixed shuffles. Blocks are transposed into
+   bit planes (see sm4_bitslice_impl.h) 16 at a time with SSE byte transposes
+   and PMOVMSKB, then 32, 64 or 128 blocks go through the rounds together
+   depending on the vector width the CPU has. */
+
+#include <string.h>
+#include <immintrin.h>
+#include "sm4_internal.h"
+
+typedef uint32_t sm4_bs_u32x4 __attribute__((vector_size(16)));
+typedef uint64_t sm4_bs_u64x4 __attribute__((vector_size(32)));
+typedef uint64_t sm4_bs_u64x8 __attribute__((vector_size(64)));
+
+/* 16x16 byte transpose: each pass interleaves rows i and i + 8, which rotates
+   the (row, column) index bits by one; four passes swap them. */
+static inline void sm4_bs_transpose16(__m128i* r) {
+    for (int pass = 0; pass < 4; pass++) {
+        __m128i t[16];
+        for (int i = 0; i < 8; i++) {
+            t[2 * i] = _mm_unpacklo_epi8(r[i], r[i + 8]);
+            t[2 * i + 1] = _mm_unpackhi_epi8(r[i], r[i + 8]);
+        }
+        memcpy(r, t, sizeof(t));
+    }
+}
+
+/* planes is [word][bit][segment][seg] uint16 chunks; chunk c covers blocks
+   16c .. 16c + 15 of the pass. */
+static inline uint16_t* sm4_bs_chunk(uint16_t* planes, int seg, int word, int bit, int byte, int c) {
+    return planes + ((word * 8 + bit) * 4 + byte) * seg + c;
+}
+
+static void sm4_bs_pack16(const uint8_t* in, uint16_t* planes, int seg, int c) {
+    __m128i r[16];
+    for (int b = 0; b < 16; b++) {
+        r[b] = _mm_loadu_si128((const __m128i*)(in + 16 * b));
+    }
+    sm4_bs_transpose16(r);
+    for (int m = 0; m < 16; m++) {
+        /* Byte m is byte 3 - m % 4 of big-endian word m / 4. */
+        __m128i v = r[m];
+        for (int i = 7; i >= 0; i--) {
+            *sm4_bs_chunk(planes, seg, m >> 2, i, 3 - (m & 3), c) = (uint16_t)_mm_movemask_epi8(v);
+            v = _mm_add_epi8(v, v);
+        }
+    }
+}
+
+/* The inverse runs PMOVMSKB the other way round: with the eight planes of byte
+   m laid out as (half, bit) bytes, the mask of bit position l holds byte m of
+   block l in its low byte and of block 8 + l in its high byte. */
+static void sm4_bs_unpack16(const uint16_t* planes, int seg, int c, uint8_t* out) {
+    const __m128i order = _mm_setr_epi8(0, 2, 4, 6, 8, 10, 12, 14, 1, 3, 5, 7, 9, 11, 13, 15);
+    const __m128i low = _mm_set1_epi16(0xFF);
+    uint16_t words[8][16];
+    for (int m = 0; m < 16; m++) {
+        const uint16_t* p = sm4_bs_chunk((uint16_t*)planes, seg, m >> 2, 0, 3 - (m & 3), c);
+        const int stride = 4 * seg;
+        __m128i v = _mm_setr_epi16((short)p[0], (short)p[stride], (short)p[2 * stride], (short)p[3 * stride],
+                                   (short)p[4 * stride], (short)p[5 * stride], (short)p[6 * stride],
+                                   (short)p[7 * stride]);
+        v = _mm_shuffle_epi8(v, order);
+        for (int l = 7; l >= 0; l--) {
+            words[l][m] = (uint16_t)_mm_movemask_epi8(v);
+            v = _mm_add_epi8(v, v);
+        }
+    }
+    for (int l = 0; l < 8; l++) {
+        __m128i lo = _mm_loadu_si128((const __m128i*)words[l]);
+        __m128i hi = _mm_loadu_si128((const __m128i*)(words[l] + 8));
+        _mm_storeu_si128((__m128i*)(out + 16 * l),
+                         _mm_packus_epi16(_mm_and_si128(lo, low), _mm_and_si128(hi, low)));
+        _mm_storeu_si128((__m128i*)(out + 16 * (l + 8)),
+                         _mm_packus_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8)));
+    }
+}
+
+/* 32 blocks: a segment is one 32-bit element. */
+#define SM4_BS_V sm4_bs_u32x4
+#define SM4_BS_BLOCKS 32
+#define SM4_BS_ROTATE(v, m) \
+    __builtin_shuffle(v, (sm4_bs_u32x4){ (0 - (m)) & 3, (1 - (m)) & 3, (2 - (m)) & 3, (3 - (m)) & 3 })
+#define SM4_BS_TARGET
+#define SM4_BS_INLINE __attribute__((always_inline)) static inline
+#define SM4_BS_NAME(name) sm4_bs32_##name
+#include "sm4_bitslice_impl.h"
+#undef SM4_BS_V
+#undef SM4_BS_BLOCKS
+#undef SM4_BS_ROTATE
+#undef SM4_BS_TARGET
+#undef SM4_BS_INLINE
+#undef SM4_BS_NAME
+
+/* 64 blocks: a segment is one 64-bit element. */
+#define SM4_BS_V sm4_bs_u64x4
+#define SM4_BS_BLOCKS 64
+#define SM4_BS_ROTATE(v, m) \
+    __builtin_shuffle(v, (sm4_bs_u64x4){ (0 - (m)) & 3, (1 - (m)) & 3, (2 - (m)) & 3, (3 - (m)) & 3 })
+#define SM4_BS_TARGET __attribute__((target("avx2")))
+#define SM4_BS_INLINE __attribute__((target("avx2"), always_inline)) static inline
+#define SM4_BS_NAME(name) sm4_bs64_##name
+#include "sm4_bitslice_impl.h"
+#undef SM4_BS_V
+#undef SM4_BS_BLOCKS
+#undef SM4_BS_ROTATE
+#undef SM4_BS_TARGET
+#undef SM4_BS_INLINE
+#undef SM4_BS_NAME
+
+/* 128 blocks: a segment is a pair of 64-bit elements. */
+#define SM4_BS_SEGMENT(k, m) 2 * (((k) - (m)) & 3), 2 * (((k) - (m)) & 3) + 1
+#define SM4_BS_V sm4_bs_u64x8
+#define SM4_BS_BLOCKS 128
+#define SM4_BS_ROTATE(v, m) \
+    __builtin_shuffle(v, (sm4_bs_u64x8){ SM4_BS_SEGMENT(0, m), SM4_BS_SEGMENT(1, m), SM4_BS_SEGMENT(2, m), SM4_BS_SEGMENT(3, m) })
+#define SM4_BS_TARGET __attribute__((target("avx512f")))
+#define SM4_BS_INLINE __attribute__((target("avx512f"), always_inline)) static inline
+#define SM4_BS_NAME(name) sm4_bs128_##name
+#include "sm4_bitslice_impl.h"
+#undef SM4_BS_SEGMENT
+#undef SM4_BS_V
+#undef SM4_BS_BLOCKS
+#undef SM4_BS_ROTATE
+#undef SM4_BS_TARGET
+#undef SM4_BS_INLINE
+#undef SM4_BS_NAME
+
+void sm4_bitslice_crypt_blocks(const uint32_t rk[32], const uint8_t* in, uint8_t* out, size_t blocks) {
+    size_t done = 0;
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        done += sm4_bs128_crypt(rk, in, out, blocks);
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        done += sm4_bs64_crypt(rk, in + 16 * done, out + 16 * done, blocks - done);
+    }
+    done += sm4_bs32_crypt(rk, in + 16 * done, out + 16 * done, blocks - done);
+    if (done < blocks) {
+        /* Pad the last partial pass; the extra blocks are discarded. */
+        uint8_t buffer[16 * 32] = { 0 };
+        memcpy(buffer, in + 16 * done, 16 * (blocks - done));
+        sm4_bs32_crypt(rk, buffer, buffer, 32);
+        memcpy(out + 16 * done, buffer, 16 * (blocks - done));
+    }
+}
@@ -0,0 +1,215 @@
+/* One width of the bitsliced SM4 kernel, included by sm4_bitslice.c once per
+   vector type. The includer defines:
+     SM4_BS_V             vector type of 4 * SM4_BS_BLOCKS bits
+     SM4_BS_BLOCKS        blocks per pass
+     SM4_BS_ROTATE(v, m)  rotate the four byte segments of v up by m
+     SM4_BS_TARGET        target attribute for this width
+     SM4_BS_INLINE        the same, for always-inline helpers
+     SM4_BS_NAME(name)    unique function name
+   A state word is 8 planes. Plane i holds bit i of every byte of the word for
+   every block: segment k (byte k, least significant first) is SM4_BS_BLOCKS
+   bits wide, one per block. */
+
+/* S-box on all 4 * SM4_BS_BLOCKS bytes at once, in place. Inversion is done in
+   the tower field GF((2^4)^2); the linear maps into and out of the tower basis
+   absorb the SM4 affine transforms, so there is no table anywhere. */
+SM4_BS_INLINE void SM4_BS_NAME(sbox)(SM4_BS_V* x) {
+    SM4_BS_V t0 = x[0] ^ x[1];
+    SM4_BS_V t1 = x[2] ^ x[5];
+    SM4_BS_V t2 = x[3] ^ x[4];
+    SM4_BS_V t3 = x[6] ^ x[7];
+    SM4_BS_V t4 = x[6] ^ t1;
+    SM4_BS_V t5 = t2 ^ t3;
+    SM4_BS_V t6 = x[0] ^ t4;
+    SM4_BS_V t7 = x[1] ^ x[7] ^ t1 ^ t2;
+    SM4_BS_V t8 = x[5] ^ t0 ^ t3;
+    SM4_BS_V t9 = x[4] ^ x[7] ^ t0;
+    SM4_BS_V t10 = x[2] ^ t3;
+    SM4_BS_V t11 = t0 ^ t2 ^ t4;
+    SM4_BS_V t12 = ~t7;
+    SM4_BS_V t13 = ~t8;
+    SM4_BS_V t14 = ~x[6];
+    SM4_BS_V t15 = ~t11;
+    SM4_BS_V t16 = t12 ^ t10;
+    SM4_BS_V t17 = t5 ^ t16;
+    SM4_BS_V t18 = t14 ^ t15 ^ t16;
+    SM4_BS_V t19 = t6 ^ t13 ^ t14;
+    SM4_BS_V t20 = t13 ^ t9 ^ t10 ^ t15;
+    SM4_BS_V t21 = t9 & t5;
+    SM4_BS_V t22 = t9 & t6;
+    SM4_BS_V t23 = t9 & t12;
+    SM4_BS_V t24 = t9 & t13;
+    SM4_BS_V t25 = t14 & t5;
+    SM4_BS_V t26 = t14 & t6;
+    SM4_BS_V t27 = t14 & t12;
+    SM4_BS_V t28 = t14 & t13;
+    SM4_BS_V t29 = t10 & t5;
+    SM4_BS_V t30 = t10 & t6;
+    SM4_BS_V t31 = t10 & t12;
+    SM4_BS_V t32 = t10 & t13;
+    SM4_BS_V t33 = t15 & t5;
+    SM4_BS_V t34 = t15 & t6;
+    SM4_BS_V t35 = t15 & t12;
+    SM4_BS_V t36 = t15 & t13;
+    SM4_BS_V t37 = t21 ^ t28 ^ t31 ^ t34;
+    SM4_BS_V t38 = t22 ^ t25 ^ t28 ^ t31 ^ t34 ^ t32 ^ t35;
+    SM4_BS_V t39 = t23 ^ t26 ^ t29 ^ t32 ^ t35 ^ t36;
+    SM4_BS_V t40 = t24 ^ t27 ^ t30 ^ t33 ^ t36;
+    SM4_BS_V t41 = t17 ^ t37;
+    SM4_BS_V t42 = t18 ^ t38;
+    SM4_BS_V t43 = t19 ^ t39;
+    SM4_BS_V t44 = t20 ^ t40;
+    SM4_BS_V t45 = t41 & t43;
+    SM4_BS_V t46 = t42 & t43;
+    SM4_BS_V t47 = t41 & t42;
+    SM4_BS_V t48 = t47 & t43;
+    SM4_BS_V t49 = t46 & t44;
+    SM4_BS_V t50 = t41 ^ t42 ^ t43 ^ t45 ^ t46 ^ t48 ^ t44 ^ t49;
+    SM4_BS_V t51 = t42 & t44;
+    SM4_BS_V t52 = t47 & t44;
+    SM4_BS_V t53 = t47 ^ t45 ^ t46 ^ t44 ^ t51 ^ t52;
+    SM4_BS_V t54 = t41 & t44;
+    SM4_BS_V t55 = t45 & t44;
+    SM4_BS_V t56 = t47 ^ t43 ^ t45 ^ t44 ^ t54 ^ t55;
+    SM4_BS_V t57 = t43 & t44;
+    SM4_BS_V t58 = t42 ^ t43 ^ t44 ^ t54 ^ t51 ^ t57 ^ t49;
+    SM4_BS_V t59 = t5 ^ t9;
+    SM4_BS_V t60 = t6 ^ t14;
+    SM4_BS_V t61 = t12 ^ t10;
+    SM4_BS_V t62 = t13 ^ t15;
+    SM4_BS_V t63 = t9 & t50;
+    SM4_BS_V t64 = t9 & t53;
+    SM4_BS_V t65 = t9 & t56;
+    SM4_BS_V t66 = t9 & t58;
+    SM4_BS_V t67 = t14 & t50;
+    SM4_BS_V t68 = t14 & t53;
+    SM4_BS_V t69 = t14 & t56;
+    SM4_BS_V t70 = t14 & t58;
+    SM4_BS_V t71 = t10 & t50;
+    SM4_BS_V t72 = t10 & t53;
+    SM4_BS_V t73 = t10 & t56;
+    SM4_BS_V t74 = t10 & t58;
+    SM4_BS_V t75 = t15 & t50;
+    SM4_BS_V t76 = t15 & t53;
+    SM4_BS_V t77 = t15 & t56;
+    SM4_BS_V t78 = t15 & t58;
+    SM4_BS_V t79 = t63 ^ t70 ^ t73 ^ t76;
+    SM4_BS_V t80 = t64 ^ t67 ^ t70 ^ t73 ^ t76 ^ t74 ^ t77;
+    SM4_BS_V t81 = t65 ^ t68 ^ t71 ^ t74 ^ t77 ^ t78;
+    SM4_BS_V t82 = t66 ^ t69 ^ t72 ^ t75 ^ t78;
+    SM4_BS_V t83 = t59 & t50;
+    SM4_BS_V t84 = t59 & t53;
+    SM4_BS_V t85 = t59 & t56;
+    SM4_BS_V t86 = t59 & t58;
+    SM4_BS_V t87 = t60 & t50;
+    SM4_BS_V t88 = t60 & t53;
+    SM4_BS_V t89 = t60 & t56;
+    SM4_BS_V t90 = t60 & t58;
+    SM4_BS_V t91 = t61 & t50;
+    SM4_BS_V t92 = t61 & t53;
+    SM4_BS_V t93 = t61 & t56;
+    SM4_BS_V t94 = t61 & t58;
+    SM4_BS_V t95 = t62 & t50;
+    SM4_BS_V t96 = t62 & t53;
+    SM4_BS_V t97 = t62 & t56;
+    SM4_BS_V t98 = t62 & t58;
+    SM4_BS_V t99 = t83 ^ t90 ^ t93 ^ t96;
+    SM4_BS_V t100 = t84 ^ t87 ^ t90 ^ t93 ^ t96 ^ t94 ^ t97;
+    SM4_BS_V t101 = t85 ^ t88 ^ t91 ^ t94 ^ t97 ^ t98;
+    SM4_BS_V t102 = t86 ^ t89 ^ t92 ^ t95 ^ t98;
+    SM4_BS_V t103 = t99 ^ t79;
+    SM4_BS_V t104 = t101 ^ t81;
+    SM4_BS_V t105 = t100 ^ t102;
+    SM4_BS_V t106 = t100 ^ t103;
+    SM4_BS_V t107 = t79 ^ t105;
+    SM4_BS_V t108 = t80 ^ t82;
+    SM4_BS_V t109 = t82 ^ t106;
+    SM4_BS_V t110 = t99 ^ t104;
+    SM4_BS_V t111 = t104 ^ t108;
+    SM4_BS_V t112 = t101 ^ t82 ^ t103;
+    SM4_BS_V t113 = t107 ^ t108;
+    SM4_BS_V t114 = t104 ^ t106;
+    SM4_BS_V t115 = t102 ^ t103;
+    x[0] = ~t109;
+    x[1] = ~t110;
+    x[2] = t111;
+    x[3] = t112;
+    x[4] = ~t107;
+    x[5] = t113;
+    x[6] = ~t114;
+    x[7] = ~t115;
+}
+
+/* x ^= L(s), with L's bit rotations split into a plane shift and a segment
+   rotation: rotl(s, 2) ^ rotl(s, 10) ^ rotl(s, 18) is r(s) = s ^ S1(s) ^ S2(s)
+   taken from two planes down (from the top planes one segment up). */
+SM4_BS_INLINE void SM4_BS_NAME(linear)(SM4_BS_V* x, const SM4_BS_V* s) {
+    SM4_BS_V r[8];
+    for (int i = 0; i < 8; i++) {
+        r[i] = s[i] ^ SM4_BS_ROTATE(s[i], 1) ^ SM4_BS_ROTATE(s[i], 2);
+    }
+    for (int i = 0; i < 8; i++) {
+        SM4_BS_V low = i >= 2 ? r[i - 2] : SM4_BS_ROTATE(r[i + 6], 1);
+        x[i] ^= s[i] ^ SM4_BS_ROTATE(s[i], 3) ^ low;
+    }
+}
+
+#define SM4_BS_ROUND(a, b, c, d, k)                                 \
+    do {                                                            \
+        SM4_BS_V t[8];                                              \
+        for (int i = 0; i < 8; i++) {                               \
+            t[i] = x[b][i] ^ x[c][i] ^ x[d][i] ^ key[k][i];         \
+        }                                                           \
+        SM4_BS_NAME(sbox)(t);                                       \
+        SM4_BS_NAME(linear)(x[a], t);                               \
+    } while (0)
+
+SM4_BS_INLINE void SM4_BS_NAME(rounds)(SM4_BS_V x[4][8], const SM4_BS_V key[32][8]) {
+    for (int r = 0; r < 32; r += 4) {
+        SM4_BS_ROUND(0, 1, 2, 3, r);
+        SM4_BS_ROUND(1, 2, 3, 0, r + 1);
+        SM4_BS_ROUND(2, 3, 0, 1, r + 2);
+        SM4_BS_ROUND(3, 0, 1, 2, r + 3);
+    }
+}
+
+#undef SM4_BS_ROUND
+
+/* Processes whole passes of SM4_BS_BLOCKS blocks and returns how many blocks
+   were done. */
+static SM4_BS_TARGET size_t SM4_BS_NAME(crypt)(const uint32_t rk[32], const uint8_t* in, uint8_t* out, size_t blocks) {
+    enum { seg = SM4_BS_BLOCKS / 16 };
+    SM4_BS_V key[32][8];
+    SM4_BS_V x[4][8];
+    uint16_t planes[4][8][4 * seg];
+    size_t done = 0;
+
+    if (blocks < SM4_BS_BLOCKS) {
+        return 0;
+    }
+    for (int r = 0; r < 32; r++) {
+        for (int i = 0; i < 8; i++) {
+            uint8_t fill[SM4_BS_BLOCKS / 2];
+            for (int k = 0; k < 4; k++) {
+                memset(fill + k * (SM4_BS_BLOCKS / 8), (rk[r] >> (8 * k + i)) & 1 ? 0xFF : 0, SM4_BS_BLOCKS / 8);
+            }
+            memcpy(&key[r][i], fill, sizeof(SM4_BS_V));
+        }
+    }
+
+    for (; blocks - done >= SM4_BS_BLOCKS; done += SM4_BS_BLOCKS) {
+        for (int c = 0; c < seg; c++) {
+            sm4_bs_pack16(in + 16 * (done + 16 * c), planes[0][0], seg, c);
+        }
+        memcpy(x, planes, sizeof(x));
+        SM4_BS_NAME(rounds)(x, (const SM4_BS_V(*)[8])key);
+        /* The output block is (X35, X34, X33, X32). */
+        for (int j = 0; j < 4; j++) {
+            memcpy(planes[j], x[3 - j], sizeof(x[0]));
+        }
+        for (int c = 0; c < seg; c++) {
+            sm4_bs_unpack16(planes[0][0], seg, c, out + 16 * (done + 16 * c));
+        }
+    }
+    return done;
+}
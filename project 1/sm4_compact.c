@@ -0,0 +1,102 @@
+/* Table kernels with a smaller cache footprint than the 4 KB T-table, for
+   callers whose SM4 shares a core with other hot data. Both read the constant
+   tables of sm4.c. TABLE_1K looks up only the first column of sm4_T and
+   rotates the result into the other three positions in a register. SBOX looks
+   up the 256-byte S-box alone and computes L on four blocks at once in SSE
+   registers, with the byte rotations as PSHUFB. */
+
+#include <tmmintrin.h>
+#include "sm4_internal.h"
+
+static inline uint32_t sm4_rotr(uint32_t x, int n) {
+    return (x >> n) | (x << (32 - n));
+}
+
+#define SM4_1K_ROUND(a, b, c, d, k)                                                                          \
+    do {                                                                                                     \
+        uint32_t t = b ^ c ^ d ^ (k);                                                                        \
+        a ^= T[t >> 24] ^ sm4_rotr(T[(t >> 16) & 0xFF], 8) ^ sm4_rotr(T[(t >> 8) & 0xFF], 16) ^             \
+             sm4_rotr(T[t & 0xFF], 24);                                                                      \
+    } while (0)
+
+void sm4_table1k_crypt_blocks(const uint32_t rk[32], const uint8_t* in, uint8_t* out, size_t blocks) {
+    const uint32_t* T = sm4_T[0];
+    for (; blocks; blocks--, in += 16, out += 16) {
+        uint32_t x0 = sm4_load_be32(in), x1 = sm4_load_be32(in + 4);
+        uint32_t x2 = sm4_load_be32(in + 8), x3 = sm4_load_be32(in + 12);
+        for (int i = 0; i < 32; i += 4) {
+            SM4_1K_ROUND(x0, x1, x2, x3, rk[i]);
+            SM4_1K_ROUND(x1, x2, x3, x0, rk[i + 1]);
+            SM4_1K_ROUND(x2, x3, x0, x1, rk[i + 2]);
+            SM4_1K_ROUND(x3, x0, x1, x2, rk[i + 3]);
+        }
+        sm4_store_be32(out, x3); sm4_store_be32(out + 4, x2);
+        sm4_store_be32(out + 8, x1); sm4_store_be32(out + 12, x0);
+    }
+}
+
+/* S-box on every byte of four words. The lanes go out through scalar
+   registers and come back in one set, not through memory, so no load waits
+   on four narrower stores. */
+static inline __m128i sm4_sbox_tau(__m128i t) {
+    uint32_t w[4];
+    for (int k = 0; k < 4; k++) {
+        uint32_t x = (uint32_t)_mm_cvtsi128_si32(t);
+        w[k] = ((uint32_t)sm4_sbox[x >> 24] << 24) | ((uint32_t)sm4_sbox[(x >> 16) & 0xFF] << 16) |
+               ((uint32_t)sm4_sbox[(x >> 8) & 0xFF] << 8) | sm4_sbox[x & 0xFF];
+        t = _mm_srli_si128(t, 4);
+    }
+    return _mm_set_epi32((int)w[3], (int)w[2], (int)w[1], (int)w[0]);
+}
+
+/* L(x) = x ^ rotl(x, 24) ^ rotl(x ^ rotl(x, 8) ^ rotl(x, 16), 2). */
+static inline __m128i sm4_sbox_l(__m128i x) {
+    const __m128i rot8 = _mm_set_epi8(14, 13, 12, 15, 10, 9, 8, 11, 6, 5, 4, 7, 2, 1, 0, 3);
+    const __m128i rot16 = _mm_set_epi8(13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2);
+    const __m128i rot24 = _mm_set_epi8(12, 15, 14, 13, 8, 11, 10, 9, 4, 7, 6, 5, 0, 3, 2, 1);
+    __m128i y = _mm_xor_si128(_mm_xor_si128(x, _mm_shuffle_epi8(x, rot8)), _mm_shuffle_epi8(x, rot16));
+    y = _mm_or_si128(_mm_slli_epi32(y, 2), _mm_srli_epi32(y, 30));
+    return _mm_xor_si128(_mm_xor_si128(x, _mm_shuffle_epi8(x, rot24)), y);
+}
+
+#define SM4_SBOX_ROUND(a, b, c, d, k)                                                                        \
+    a = _mm_xor_si128(a, sm4_sbox_l(sm4_sbox_tau(                                                            \
+                             _mm_xor_si128(_mm_xor_si128(b, c), _mm_xor_si128(d, _mm_set1_epi32((int)(k)))))))
+
+/* Four blocks, transposed so that register k holds word k of each. */
+static void sm4_sbox_crypt4(const uint32_t rk[32], const uint8_t* in, uint8_t* out) {
+    const __m128i bswap = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+    __m128i b0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)in), bswap);
+    __m128i b1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(in + 16)), bswap);
+    __m128i b2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(in + 32)), bswap);
+    __m128i b3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(in + 48)), bswap);
+    __m128i t0 = _mm_unpacklo_epi32(b0, b1), t1 = _mm_unpackhi_epi32(b0, b1);
+    __m128i t2 = _mm_unpacklo_epi32(b2, b3), t3 = _mm_unpackhi_epi32(b2, b3);
+    __m128i x0 = _mm_unpacklo_epi64(t0, t2), x1 = _mm_unpackhi_epi64(t0, t2);
+    __m128i x2 = _mm_unpacklo_epi64(t1, t3), x3 = _mm_unpackhi_epi64(t1, t3);
+    for (int i = 0; i < 32; i += 4) {
+        SM4_SBOX_ROUND(x0, x1, x2, x3, rk[i]);
+        SM4_SBOX_ROUND(x1, x2, x3, x0, rk[i + 1]);
+        SM4_SBOX_ROUND(x2, x3, x0, x1, rk[i + 2]);
+        SM4_SBOX_ROUND(x3, x0, x1, x2, rk[i + 3]);
+    }
+    /* Output words are X35, X34, X33, X32: transpose back in reverse order. */
+    t0 = _mm_unpacklo_epi32(x3, x2); t1 = _mm_unpackhi_epi32(x3, x2);
+    t2 = _mm_unpacklo_epi32(x1, x0); t3 = _mm_unpackhi_epi32(x1, x0);
+    _mm_storeu_si128((__m128i*)out, _mm_shuffle_epi8(_mm_unpacklo_epi64(t0, t2), bswap));
+    _mm_storeu_si128((__m128i*)(out + 16), _mm_shuffle_epi8(_mm_unpackhi_epi64(t0, t2), bswap));
+    _mm_storeu_si128((__m128i*)(out + 32), _mm_shuffle_epi8(_mm_unpacklo_epi64(t1, t3), bswap));
+    _mm_storeu_si128((__m128i*)(out + 48), _mm_shuffle_epi8(_mm_unpackhi_epi64(t1, t3), bswap));
+}
+
+void sm4_sbox_crypt_blocks(const uint32_t rk[32], const uint8_t* in, uint8_t* out, size_t blocks) {
+    for (; blocks >= 4; blocks -= 4, in += 64, out += 64) {
+        sm4_sbox_crypt4(rk, in, out);
+    }
+    if (blocks) {
+        uint8_t buffer[64] = { 0 };
+        memcpy(buffer, in, 16 * blocks);
+        sm4_sbox_crypt4(rk, buffer, buffer);
+        memcpy(out, buffer, 16 * blocks);
+    }
+}
@@ -0,0 +1,232 @@
+/* SM4-CTR with a 128-bit big-endian counter over any length; a final partial
+   block uses the leading bytes of one more keystream block. With GFNI the
+   counter blocks are generated inside the kernel; otherwise they are written a
+   batch at a time with 64-bit vector adds, encrypted by the best block kernel
+   and XORed in 16-byte vectors. sm4_ctr_encrypt_mt splits a large buffer into
+   chunks and hands them to worker threads, each starting from the counter at
+   its chunk's offset. sm4_ctr_encrypt_records packs the counter blocks of
+   many records, each with its own key, into shared multi-key batches. */
+
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <immintrin.h>
+#include "sm4.h"
+#include "sm4_internal.h"
+#include "sm4_stats.h"
+
+/* Bytes per work item in sm4_ctr_encrypt_mt; a multiple of 256 so every chunk
+   but the last stays on the whole-batch path. */
+#define SM4_CTR_CHUNK ((size_t)1 << 20)
+#define SM4_CTR_MAX_THREADS 256
+
+static void sm4_ctr_add(uint8_t counter[16], uint64_t blocks) {
+    uint64_t hi = (uint64_t)sm4_load_be32(counter) << 32 | sm4_load_be32(counter + 4);
+    uint64_t lo = (uint64_t)sm4_load_be32(counter + 8) << 32 | sm4_load_be32(counter + 12);
+    uint64_t sum = lo + blocks;
+    hi += sum < lo;
+    sm4_store_be32(counter, (uint32_t)(hi >> 32));
+    sm4_store_be32(counter + 4, (uint32_t)hi);
+    sm4_store_be32(counter + 8, (uint32_t)(sum >> 32));
+    sm4_store_be32(counter + 12, (uint32_t)sum);
+}
+
+/* Writes n consecutive counter blocks and advances counter past them. */
+static void sm4_ctr_fill(uint8_t counter[16], uint8_t* blocks, size_t n) {
+    uint64_t lo = (uint64_t)sm4_load_be32(counter + 8) << 32 | sm4_load_be32(counter + 12);
+    if (lo > UINT64_MAX - n) {
+        for (size_t b = 0; b < n; b++) {
+            memcpy(blocks + 16 * b, counter, 16);
+            sm4_ctr_add(counter, 1);
+        }
+        return;
+    }
+    /* Held little-endian as (lo, hi), one byte reversal away from the block. */
+    const __m128i reverse = _mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+    const __m128i one = _mm_set_epi64x(0, 1);
+    __m128i x = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)counter), reverse);
+    for (size_t b = 0; b < n; b++) {
+        _mm_storeu_si128((__m128i*)(blocks + 16 * b), _mm_shuffle_epi8(x, reverse));
+        x = _mm_add_epi64(x, one);
+    }
+    _mm_storeu_si128((__m128i*)counter, _mm_shuffle_epi8(x, reverse));
+}
+
+/* out = in ^ keystream; out may be in. */
+static void sm4_ctr_xor(uint8_t* out, const uint8_t* in, const uint8_t* keystream, size_t n) {
+    size_t i = 0;
+    for (; i + 64 <= n; i += 64) {
+        for (int j = 0; j < 64; j += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i*)(in + i + j));
+            __m128i k = _mm_loadu_si128((const __m128i*)(keystream + i + j));
+            _mm_storeu_si128((__m128i*)(out + i + j), _mm_xor_si128(v, k));
+        }
+    }
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(in + i));
+        __m128i k = _mm_loadu_si128((const __m128i*)(keystream + i));
+        _mm_storeu_si128((__m128i*)(out + i), _mm_xor_si128(v, k));
+    }
+    for (; i < n; i++) {
+        out[i] = in[i] ^ keystream[i];
+    }
+}
+
+static void sm4_ctr_crypt(const sm4_key_t* ks, uint8_t counter[16], const uint8_t* in, uint8_t* out, size_t len) {
+    if (len >= 256 && sm4_best_impl() == SM4_IMPL_GFNI) {
+        size_t batches = len / 256;
+        SM4_STATS_BEGIN(mark);
+        sm4_gfni_ctr_blocks(ks->rk, counter, in, out, batches);
+        SM4_STATS_END(mark, SM4_PHASE_KERNEL);
+        SM4_STATS_COUNT(SM4_IMPL_GFNI, 16 * batches);
+        in += 256 * batches; out += 256 * batches; len -= 256 * batches;
+    }
+
+    uint8_t keystream[16 * SM4_BATCH_BLOCKS];
+    while (len) {
+        size_t blocks = (len + 15) / 16 < SM4_BATCH_BLOCKS ? (len + 15) / 16 : SM4_BATCH_BLOCKS;
+        size_t n = len < 16 * blocks ? len : 16 * blocks;
+        SM4_STATS_BEGIN(fill);
+        sm4_ctr_fill(counter, keystream, blocks);
+        SM4_STATS_END(fill, SM4_PHASE_MODE);
+        sm4_crypt_blocks(ks, keystream, keystream, blocks, 0, SM4_IMPL_AUTO);
+        SM4_STATS_BEGIN(xor);
+        sm4_ctr_xor(out, in, keystream, n);
+        SM4_STATS_END(xor, SM4_PHASE_MODE);
+        in += n; out += n; len -= n;
+    }
+}
+
+void sm4_ctr_encrypt(const sm4_key_t* ks, const uint8_t iv[16], const uint8_t* in, uint8_t* out, size_t len) {
+    uint8_t counter[16];
+    memcpy(counter, iv, 16);
+    sm4_ctr_crypt(ks, counter, in, out, len);
+}
+
+void sm4_ctr_encrypt_records(sm4_key_cache_t* cache, const sm4_ctr_record_t* records, size_t count) {
+    uint8_t keystream[16 * SM4_BATCH_BLOCKS];
+    /* A batch holds pieces of at most SM4_BATCH_BLOCKS records, each a block
+       or more, and points into the cache for their round keys. */
+    const uint32_t* rks[SM4_BATCH_BLOCKS];
+    const uint8_t* piece_in[SM4_BATCH_BLOCKS];
+    uint8_t* piece_out[SM4_BATCH_BLOCKS];
+    size_t piece_len[SM4_BATCH_BLOCKS];
+    size_t record = 0, offset = 0;
+
+    while (record < count) {
+        size_t blocks = 0, pieces = 0;
+        uint32_t since = cache->clock + 1 ? cache->clock + 1 : 1;
+        while (record < count && blocks < SM4_BATCH_BLOCKS) {
+            const sm4_ctr_record_t* r = &records[record];
+            if (offset == 0 && record + 8 < count) {
+                sm4_key_cache_prefetch(cache, records[record + 8].key);
+            }
+            if (offset == 0 && r->len >= 16 * SM4_BATCH_BLOCKS) {
+                /* A batch of its own anyway: the single-key path, fused with
+                   the counter on GFNI, is faster than packing it. */
+                const sm4_key_t* ks = sm4_key_cache_lookup(cache, r->key, since);
+                if (!ks) {
+                    break;
+                }
+                uint8_t counter[16];
+                memcpy(counter, r->iv, 16);
+                sm4_ctr_crypt(ks, counter, r->in, r->out, r->len);
+                record++;
+                continue;
+            }
+            size_t left = r->len - offset;
+            size_t take = (left + 15) / 16 < SM4_BATCH_BLOCKS - blocks ? (left + 15) / 16 : SM4_BATCH_BLOCKS - blocks;
+            if (take) {
+                const sm4_key_t* ks = sm4_key_cache_lookup(cache, r->key, since);
+                if (!ks) {
+                    break; /* its set is full of this batch's keys */
+                }
+                uint8_t counter[16];
+                memcpy(counter, r->iv, 16);
+                if (offset) {
+                    sm4_ctr_add(counter, offset / 16);
+                }
+                SM4_STATS_BEGIN(fill);
+                sm4_ctr_fill(counter, keystream + 16 * blocks, take);
+                SM4_STATS_END(fill, SM4_PHASE_MODE);
+                for (size_t j = 0; j < take; j++) {
+                    rks[blocks + j] = ks->rk;
+                }
+                piece_in[pieces] = r->in + offset;
+                piece_out[pieces] = r->out + offset;
+                piece_len[pieces] = left < 16 * take ? left : 16 * take;
+                pieces++;
+                blocks += take;
+                offset += 16 * take;
+            }
+            if (offset >= r->len) {
+                record++;
+                offset = 0;
+            }
+        }
+        if (!blocks) {
+            continue;
+        }
+        sm4_run_multikey(rks, keystream, keystream, blocks);
+        SM4_STATS_BEGIN(xor);
+        for (size_t p = 0, at = 0; p < pieces; at += (piece_len[p] + 15) / 16 * 16, p++) {
+            sm4_ctr_xor(piece_out[p], piece_in[p], keystream + at, piece_len[p]);
+        }
+        SM4_STATS_END(xor, SM4_PHASE_MODE);
+    }
+}
+
+typedef struct {
+    const sm4_key_t* ks;
+    const uint8_t* iv;
+    const uint8_t* in;
+    uint8_t* out;
+    size_t len;
+    size_t chunks;
+    size_t next;
+} sm4_ctr_job_t;
+
+static void* sm4_ctr_worker(void* arg) {
+    sm4_ctr_job_t* job = (sm4_ctr_job_t*)arg;
+    for (;;) {
+        size_t chunk = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+        if (chunk >= job->chunks) {
+            return NULL;
+        }
+        size_t offset = chunk * SM4_CTR_CHUNK;
+        size_t n = job->len - offset < SM4_CTR_CHUNK ? job->len - offset : SM4_CTR_CHUNK;
+        uint8_t counter[16];
+        memcpy(counter, job->iv, 16);
+        sm4_ctr_add(counter, offset / 16);
+        sm4_ctr_crypt(job->ks, counter, job->in + offset, job->out + offset, n);
+    }
+}
+
+void sm4_ctr_encrypt_mt(const sm4_key_t* ks, const uint8_t iv[16], const uint8_t* in, uint8_t* out, size_t len,
+                        unsigned threads) {
+    sm4_ctr_job_t job = { ks, iv, in, out, len, (len + SM4_CTR_CHUNK - 1) / SM4_CTR_CHUNK, 0 };
+    if (threads == 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = online > 0 ? (unsigned)online : 1;
+    }
+    if (threads > job.chunks) threads = (unsigned)job.chunks;
+    if (threads > SM4_CTR_MAX_THREADS) threads = SM4_CTR_MAX_THREADS;
+    if (threads <= 1) {
+        sm4_ctr_encrypt(ks, iv, in, out, len);
+        return;
+    }
+
+    /* Settle the kernel choice (and its self-test) once, before the fan-out. */
+    sm4_best_impl();
+    pthread_t workers[SM4_CTR_MAX_THREADS];
+    unsigned started = 0;
+    while (started < threads - 1 && pthread_create(&workers[started], NULL, sm4_ctr_worker, &job) == 0) {
+        started++;
+    }
+    /* The caller drains chunks too, so a failed pthread_create only costs
+       parallelism. */
+    sm4_ctr_worker(&job);
+    for (unsigned i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+}
@@ -0,0 +1,217 @@
+/* SM4-GCM. With GFNI the bulk of the message goes through the stitched
+   CTR+GHASH kernel in sm4_gfni.c; otherwise, and for the last partial batch,
+   counter blocks are encrypted with the best block kernel and hashed with the
+   8-way aggregated PCLMULQDQ GHASH below. Without PCLMULQDQ a bitwise GHASH
+   stands in. */
+
+#include <string.h>
+#include "sm4.h"
+#include "sm4_internal.h"
+#include "sm4_stats.h"
+#include "sm4_ghash.h"
+
+static void sm4_gcm_inc32(uint8_t counter[16]) {
+    sm4_store_be32(counter + 12, sm4_load_be32(counter + 12) + 1);
+}
+
+static int sm4_gcm_has_clmul(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("ssse3");
+}
+
+/* Absorbs len bytes, zero-padding a final partial block. */
+__attribute__((target("ssse3,pclmul")))
+static void sm4_ghash_clmul(const uint8_t htable[8][16], uint8_t xi[16], const uint8_t* data, size_t len) {
+    __m128i h[8];
+    for (int i = 0; i < 8; i++) {
+        h[i] = _mm_loadu_si128((const __m128i*)htable[i]);
+    }
+    __m128i x = _mm_loadu_si128((const __m128i*)xi);
+    for (; len >= 128; len -= 128, data += 128) {
+        x = sm4_ghash_8(x, h, data);
+    }
+    for (; len; ) {
+        uint8_t block[16] = { 0 };
+        size_t n = len < 16 ? len : 16;
+        memcpy(block, data, n);
+        __m128i lo = _mm_setzero_si128(), mid = _mm_setzero_si128(), hi = _mm_setzero_si128();
+        __m128i d = _mm_xor_si128(x, sm4_ghash_reverse(_mm_loadu_si128((const __m128i*)block)));
+        sm4_ghash_mul_acc(d, h[0], &lo, &mid, &hi);
+        x = sm4_ghash_reduce(lo, mid, hi);
+        data += n; len -= n;
+    }
+    _mm_storeu_si128((__m128i*)xi, x);
+}
+
+/* SP 800-38D algorithm 1 on big-endian halves, with masks instead of branches. */
+static void sm4_ghash_portable(const uint8_t htable[8][16], uint8_t xi[16], const uint8_t* data, size_t len) {
+    uint64_t hh = 0, hl = 0, xh = 0, xl = 0;
+    for (int i = 0; i < 8; i++) {
+        hh = hh << 8 | htable[0][15 - i];
+        hl = hl << 8 | htable[0][7 - i];
+        xh = xh << 8 | xi[15 - i];
+        xl = xl << 8 | xi[7 - i];
+    }
+    while (len) {
+        uint8_t block[16] = { 0 };
+        size_t n = len < 16 ? len : 16;
+        memcpy(block, data, n);
+        for (int i = 0; i < 8; i++) {
+            xh ^= (uint64_t)block[i] << (56 - 8 * i);
+            xl ^= (uint64_t)block[8 + i] << (56 - 8 * i);
+        }
+        uint64_t zh = 0, zl = 0, vh = hh, vl = hl;
+        for (int i = 0; i < 128; i++) {
+            uint64_t bit = 0 - ((i < 64 ? xh >> (63 - i) : xl >> (127 - i)) & 1);
+            zh ^= vh & bit;
+            zl ^= vl & bit;
+            uint64_t reduce = 0 - (vl & 1);
+            vl = vl >> 1 | vh << 63;
+            vh = vh >> 1 ^ (0xE100000000000000ull & reduce);
+        }
+        xh = zh; xl = zl;
+        data += n; len -= n;
+    }
+    for (int i = 0; i < 8; i++) {
+        xi[15 - i] = (uint8_t)(xh >> (56 - 8 * i));
+        xi[7 - i] = (uint8_t)(xl >> (56 - 8 * i));
+    }
+}
+
+static void sm4_ghash_update(const sm4_gcm_key_t* gk, uint8_t xi[16], const uint8_t* data, size_t len) {
+    SM4_STATS_BEGIN(mark);
+    if (sm4_gcm_has_clmul()) {
+        sm4_ghash_clmul((const uint8_t(*)[16])gk->h, xi, data, len);
+    } else {
+        sm4_ghash_portable((const uint8_t(*)[16])gk->h, xi, data, len);
+    }
+    SM4_STATS_END(mark, SM4_PHASE_GHASH);
+}
+
+__attribute__((target("ssse3,pclmul")))
+static void sm4_gcm_powers_clmul(uint8_t h[8][16]) {
+    __m128i h1 = _mm_loadu_si128((const __m128i*)h[0]);
+    __m128i p = h1;
+    for (int i = 1; i < 8; i++) {
+        __m128i lo = _mm_setzero_si128(), mid = _mm_setzero_si128(), hi = _mm_setzero_si128();
+        sm4_ghash_mul_acc(p, h1, &lo, &mid, &hi);
+        p = sm4_ghash_reduce(lo, mid, hi);
+        _mm_storeu_si128((__m128i*)h[i], p);
+    }
+}
+
+void sm4_gcm_init(sm4_gcm_key_t* gk, const uint8_t key[16]) {
+    uint8_t zero[16] = { 0 };
+    uint8_t hash_key[16];
+    sm4_key_schedule(&gk->ks, key);
+    sm4_crypt_blocks(&gk->ks, zero, hash_key, 1, 0, SM4_IMPL_AUTO);
+    for (int i = 0; i < 16; i++) {
+        gk->h[0][i] = hash_key[15 - i];
+    }
+    /* Only the PCLMULQDQ path reads the higher powers. */
+    if (sm4_gcm_has_clmul()) {
+        sm4_gcm_powers_clmul(gk->h);
+    } else {
+        memset(gk->h[1], 0, sizeof(gk->h) - sizeof(gk->h[0]));
+    }
+}
+
+static void sm4_gcm_j0(const sm4_gcm_key_t* gk, const uint8_t* iv, size_t iv_len, uint8_t j0[16]) {
+    if (iv_len == 12) {
+        memcpy(j0, iv, 12);
+        j0[12] = 0; j0[13] = 0; j0[14] = 0; j0[15] = 1;
+        return;
+    }
+    uint8_t xi[16] = { 0 };
+    uint8_t lengths[16] = { 0 };
+    sm4_ghash_update(gk, xi, iv, iv_len);
+    sm4_store_be32(lengths + 8, (uint32_t)((uint64_t)iv_len >> 29));
+    sm4_store_be32(lengths + 12, (uint32_t)(iv_len << 3));
+    sm4_ghash_update(gk, xi, lengths, 16);
+    for (int i = 0; i < 16; i++) {
+        j0[i] = xi[15 - i];
+    }
+}
+
+/* CTR from inc32(J0) over the message, hashing the ciphertext into xi. */
+static void sm4_gcm_crypt(const sm4_gcm_key_t* gk, const uint8_t j0[16], uint8_t xi[16], const uint8_t* in,
+                          uint8_t* out, size_t len, int decrypt) {
+    uint8_t counter[16];
+    memcpy(counter, j0, 16);
+    sm4_gcm_inc32(counter);
+
+    if (len >= 256 && sm4_best_impl() == SM4_IMPL_GFNI && sm4_gcm_has_clmul()) {
+        size_t batches = len / 256;
+        SM4_STATS_BEGIN(mark);
+        sm4_gfni_gcm_blocks(gk->ks.rk, (const uint8_t(*)[16])gk->h, counter, xi, in, out, batches, decrypt);
+        SM4_STATS_END(mark, SM4_PHASE_KERNEL);
+        SM4_STATS_COUNT(SM4_IMPL_GFNI, 16 * batches);
+        in += 256 * batches; out += 256 * batches; len -= 256 * batches;
+    }
+
+    uint8_t keystream[16 * SM4_BATCH_BLOCKS];
+    while (len) {
+        size_t blocks = (len + 15) / 16 < SM4_BATCH_BLOCKS ? (len + 15) / 16 : SM4_BATCH_BLOCKS;
+        size_t n = len < 16 * blocks ? len : 16 * blocks;
+        SM4_STATS_BEGIN(fill);
+        for (size_t b = 0; b < blocks; b++) {
+            memcpy(keystream + 16 * b, counter, 16);
+            sm4_gcm_inc32(counter);
+        }
+        SM4_STATS_END(fill, SM4_PHASE_MODE);
+        sm4_crypt_blocks(&gk->ks, keystream, keystream, blocks, 0, SM4_IMPL_AUTO);
+        if (decrypt) {
+            sm4_ghash_update(gk, xi, in, n);
+        }
+        SM4_STATS_BEGIN(xor);
+        for (size_t i = 0; i < n; i++) {
+            out[i] = in[i] ^ keystream[i];
+        }
+        SM4_STATS_END(xor, SM4_PHASE_MODE);
+        if (!decrypt) {
+            sm4_ghash_update(gk, xi, out, n);
+        }
+        in += n; out += n; len -= n;
+    }
+}
+
+static void sm4_gcm_tag(const sm4_gcm_key_t* gk, const uint8_t j0[16], uint8_t xi[16], size_t aad_len, size_t len,
+                        uint8_t tag[16]) {
+    uint8_t lengths[16];
+    sm4_store_be32(lengths, (uint32_t)((uint64_t)aad_len >> 29));
+    sm4_store_be32(lengths + 4, (uint32_t)(aad_len << 3));
+    sm4_store_be32(lengths + 8, (uint32_t)((uint64_t)len >> 29));
+    sm4_store_be32(lengths + 12, (uint32_t)(len << 3));
+    sm4_ghash_update(gk, xi, lengths, 16);
+    sm4_crypt_blocks(&gk->ks, j0, tag, 1, 0, SM4_IMPL_AUTO);
+    for (int i = 0; i < 16; i++) {
+        tag[i] ^= xi[15 - i];
+    }
+}
+
+void sm4_gcm_encrypt(const sm4_gcm_key_t* gk, const uint8_t* iv, size_t iv_len, const uint8_t* aad, size_t aad_len,
+                     const uint8_t* in, uint8_t* out, size_t len, uint8_t tag[16]) {
+    uint8_t j0[16], xi[16] = { 0 };
+    sm4_gcm_j0(gk, iv, iv_len, j0);
+    sm4_ghash_update(gk, xi, aad, aad_len);
+    sm4_gcm_crypt(gk, j0, xi, in, out, len, 0);
+    sm4_gcm_tag(gk, j0, xi, aad_len, len, tag);
+}
+
+int sm4_gcm_decrypt(const sm4_gcm_key_t* gk, const uint8_t* iv, size_t iv_len, const uint8_t* aad, size_t aad_len,
+                    const uint8_t* in, uint8_t* out, size_t len, const uint8_t tag[16]) {
+    uint8_t j0[16], xi[16] = { 0 }, expected[16];
+    sm4_gcm_j0(gk, iv, iv_len, j0);
+    sm4_ghash_update(gk, xi, aad, aad_len);
+    sm4_gcm_crypt(gk, j0, xi, in, out, len, 1);
+    sm4_gcm_tag(gk, j0, xi, aad_len, len, expected);
+    uint8_t diff = 0;
+    for (int i = 0; i < 16; i++) {
+        diff |= expected[i] ^ tag[i];
+    }
+    if (diff) {
+        memset(out, 0, len);
+        return -1;
+    }
+    return 0;
+}
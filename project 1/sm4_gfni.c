@@ -0,0 +1,250 @@
+/* SM4 with GFNI and AVX-512. The S-box is S_sm4(x) = A * inv(pre(x)) ^ 0xD3
+   with inversion in the AES field, i.e. one GF2P8AFFINEQB for the affine
+   isomorphism pre and one GF2P8AFFINEINVQB for the rest. L is four VPROLDs
+   folded by VPTERNLOGD. Sixteen blocks are held transposed in four ZMM
+   registers (within each 128-bit lane, one word of four blocks); fewer than
+   sixteen remaining blocks go to the AES-NI kernel. */
+
+#include <immintrin.h>
+#include "sm4_internal.h"
+#include "sm4_ghash.h"
+
+#define SM4_GFNI_TARGET __attribute__((target("avx512f,avx512bw,gfni"), always_inline)) static inline
+
+/* GF2P8AFFINEQB matrices: byte 7 - i of the qword is the mask for output bit i. */
+#define SM4_GFNI_PRE_MATRIX 0x4c287db91a22505dLL
+#define SM4_GFNI_PRE_CONSTANT 0x3e
+#define SM4_GFNI_POST_MATRIX ((long long)0xf3ab34a974a6b589ULL)
+#define SM4_GFNI_POST_CONSTANT 0xd3
+
+SM4_GFNI_TARGET __m512i sm4_gfni_sbox(__m512i x) {
+    x = _mm512_gf2p8affine_epi64_epi8(x, _mm512_set1_epi64(SM4_GFNI_PRE_MATRIX), SM4_GFNI_PRE_CONSTANT);
+    return _mm512_gf2p8affineinv_epi64_epi8(x, _mm512_set1_epi64(SM4_GFNI_POST_MATRIX), SM4_GFNI_POST_CONSTANT);
+}
+
+SM4_GFNI_TARGET void sm4_gfni_transpose(__m512i* x) {
+    __m512i t0 = _mm512_unpacklo_epi32(x[0], x[1]);
+    __m512i t1 = _mm512_unpackhi_epi32(x[0], x[1]);
+    __m512i t2 = _mm512_unpacklo_epi32(x[2], x[3]);
+    __m512i t3 = _mm512_unpackhi_epi32(x[2], x[3]);
+    x[0] = _mm512_unpacklo_epi64(t0, t2);
+    x[1] = _mm512_unpackhi_epi64(t0, t2);
+    x[2] = _mm512_unpacklo_epi64(t1, t3);
+    x[3] = _mm512_unpackhi_epi64(t1, t3);
+}
+
+/* a ^= L(S(b ^ c ^ d ^ k)) */
+#define SM4_GFNI_ROUND(a, b, c, d, k)                                                  \
+    do {                                                                               \
+        __m512i t = sm4_gfni_sbox(_mm512_xor_si512(_mm512_ternarylogic_epi32(b, c, d, 0x96), k)); \
+        __m512i u = _mm512_ternarylogic_epi32(t, _mm512_rol_epi32(t, 2), _mm512_rol_epi32(t, 10), 0x96); \
+        a = _mm512_ternarylogic_epi32(a, u, _mm512_rol_epi32(t, 18), 0x96);             \
+        a = _mm512_xor_si512(a, _mm512_rol_epi32(t, 24));                               \
+    } while (0)
+
+SM4_GFNI_TARGET void sm4_gfni_rounds(__m512i* x, const uint32_t* rk) {
+    for (int i = 0; i < 32; i += 4) {
+        SM4_GFNI_ROUND(x[0], x[1], x[2], x[3], _mm512_set1_epi32((int)rk[i]));
+        SM4_GFNI_ROUND(x[1], x[2], x[3], x[0], _mm512_set1_epi32((int)rk[i + 1]));
+        SM4_GFNI_ROUND(x[2], x[3], x[0], x[1], _mm512_set1_epi32((int)rk[i + 2]));
+        SM4_GFNI_ROUND(x[3], x[0], x[1], x[2], _mm512_set1_epi32((int)rk[i + 3]));
+    }
+}
+
+/* Round keys i .. i + 3 for sixteen blocks under keys of their own, in the
+   transposed layout: k[j] holds round key i + j of block 4e + l in (128-bit
+   lane l, word e). Each key contributes one 16-byte load and the four rows are
+   put in place by the same transpose as the data. */
+SM4_GFNI_TARGET void sm4_gfni_load_keys(const uint32_t* const* rks, int i, __m512i* k) {
+    for (int e = 0; e < 4; e++) {
+        __m512i a = _mm512_castsi128_si512(_mm_loadu_si128((const __m128i*)(rks[4 * e] + i)));
+        a = _mm512_inserti32x4(a, _mm_loadu_si128((const __m128i*)(rks[4 * e + 1] + i)), 1);
+        a = _mm512_inserti32x4(a, _mm_loadu_si128((const __m128i*)(rks[4 * e + 2] + i)), 2);
+        k[e] = _mm512_inserti32x4(a, _mm_loadu_si128((const __m128i*)(rks[4 * e + 3] + i)), 3);
+    }
+    sm4_gfni_transpose(k);
+}
+
+SM4_GFNI_TARGET void sm4_gfni_rounds_multikey(__m512i* x, const uint32_t* const* rks) {
+    for (int i = 0; i < 32; i += 4) {
+        __m512i k[4];
+        sm4_gfni_load_keys(rks, i, k);
+        SM4_GFNI_ROUND(x[0], x[1], x[2], x[3], k[0]);
+        SM4_GFNI_ROUND(x[1], x[2], x[3], x[0], k[1]);
+        SM4_GFNI_ROUND(x[2], x[3], x[0], x[1], k[2]);
+        SM4_GFNI_ROUND(x[3], x[0], x[1], x[2], k[3]);
+    }
+}
+
+__attribute__((target("avx512f,avx512bw,gfni")))
+void sm4_gfni_crypt_blocks(const uint32_t rk[32], const uint8_t* in, uint8_t* out, size_t blocks) {
+    const __m512i bswap = _mm512_broadcast_i32x4(_mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12));
+    for (; blocks >= 16; blocks -= 16, in += 256, out += 256) {
+        __m512i x[4];
+        for (int j = 0; j < 4; j++) {
+            x[j] = _mm512_shuffle_epi8(_mm512_loadu_si512(in + 64 * j), bswap);
+        }
+        sm4_gfni_transpose(x);
+        sm4_gfni_rounds(x, rk);
+        __m512i y[4] = { x[3], x[2], x[1], x[0] };
+        sm4_gfni_transpose(y);
+        for (int j = 0; j < 4; j++) {
+            _mm512_storeu_si512(out + 64 * j, _mm512_shuffle_epi8(y[j], bswap));
+        }
+    }
+    if (blocks) {
+        sm4_aesni_crypt_blocks(rk, in, out, blocks);
+    }
+}
+
+/* Block i runs with round keys rks[i]. A last partial batch is padded with
+   copies of its final block, so it costs a whole batch but no extra kernel. */
+__attribute__((target("avx512f,avx512bw,gfni")))
+void sm4_gfni_crypt_blocks_multikey(const uint32_t* const* rks, const uint8_t* in, uint8_t* out, size_t blocks) {
+    const __m512i bswap = _mm512_broadcast_i32x4(_mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12));
+    uint8_t pad[256];
+    const uint32_t* pad_rks[16];
+    while (blocks) {
+        const uint8_t* src = in;
+        uint8_t* dst = out;
+        const uint32_t* const* keys = rks;
+        size_t n = blocks < 16 ? blocks : 16;
+        if (n < 16) {
+            for (size_t j = 0; j < 16; j++) {
+                size_t from = j < n ? j : n - 1;
+                memcpy(pad + 16 * j, in + 16 * from, 16);
+                pad_rks[j] = rks[from];
+            }
+            src = dst = pad;
+            keys = pad_rks;
+        }
+        /* Thousands of schedules do not stay in L1; fetch the next batch's
+           while this one runs. */
+        for (size_t j = 16; j < 32 && j < blocks; j++) {
+            __builtin_prefetch(rks[j]);
+            __builtin_prefetch(rks[j] + 16);
+        }
+        __m512i x[4];
+        for (int j = 0; j < 4; j++) {
+            x[j] = _mm512_shuffle_epi8(_mm512_loadu_si512(src + 64 * j), bswap);
+        }
+        sm4_gfni_transpose(x);
+        sm4_gfni_rounds_multikey(x, keys);
+        __m512i y[4] = { x[3], x[2], x[1], x[0] };
+        sm4_gfni_transpose(y);
+        for (int j = 0; j < 4; j++) {
+            _mm512_storeu_si512(dst + 64 * j, _mm512_shuffle_epi8(y[j], bswap));
+        }
+        if (n < 16) {
+            memcpy(out, pad, 16 * n);
+        }
+        blocks -= n; in += 16 * n; out += 16 * n; rks += n;
+    }
+}
+
+/* CTR over 16-block batches with a 128-bit big-endian counter. The counter
+   blocks never touch memory: they are built in transposed form, the last word
+   being the low counter word plus each lane's block index, with the carry out
+   of it rippled into the higher words by masked adds. The keystream is XORed
+   into the input a ZMM register at a time. */
+__attribute__((target("avx512f,avx512bw,gfni")))
+void sm4_gfni_ctr_blocks(const uint32_t rk[32], uint8_t counter[16], const uint8_t* in, uint8_t* out,
+                         size_t batches) {
+    const __m512i bswap = _mm512_broadcast_i32x4(_mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12));
+    /* Lane (128-bit lane l, word e) of a transposed register is block 4e + l. */
+    const __m512i lanes = _mm512_setr_epi32(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15);
+    const __m512i one = _mm512_set1_epi32(1);
+    uint32_t c[4];
+    for (int i = 0; i < 4; i++) {
+        c[i] = sm4_load_be32(counter + 4 * i);
+    }
+    for (; batches; batches--, in += 256, out += 256) {
+        __m512i base = _mm512_set1_epi32((int)c[3]);
+        __m512i s[4];
+        s[3] = _mm512_add_epi32(base, lanes);
+        __mmask16 carry = _mm512_cmplt_epu32_mask(s[3], base);
+        for (int w = 2; w >= 0; w--) {
+            s[w] = _mm512_mask_add_epi32(_mm512_set1_epi32((int)c[w]), carry, _mm512_set1_epi32((int)c[w]), one);
+            carry = _mm512_mask_cmpeq_epi32_mask(carry, s[w], _mm512_setzero_si512());
+        }
+        sm4_gfni_rounds(s, rk);
+        __m512i y[4] = { s[3], s[2], s[1], s[0] };
+        sm4_gfni_transpose(y);
+        for (int j = 0; j < 4; j++) {
+            __m512i keystream = _mm512_shuffle_epi8(y[j], bswap);
+            _mm512_storeu_si512(out + 64 * j, _mm512_xor_si512(keystream, _mm512_loadu_si512(in + 64 * j)));
+        }
+        c[3] += 16;
+        if (c[3] < 16) {
+            for (int w = 2; w >= 0 && ++c[w] == 0; w--) {}
+        }
+    }
+    for (int i = 0; i < 4; i++) {
+        sm4_store_be32(counter + 4 * i, c[i]);
+    }
+}
+
+/* GCM bulk: counter mode over 16-block batches with GHASH stitched into the
+   round loop, two blocks every four rounds, so the carry-less multiplier works
+   while the S-box and rotate units do. The counter blocks are built straight in
+   transposed form: the first three words are constant over a batch and the
+   last one is the 32-bit counter plus each lane's block index. Decryption
+   hashes the batch it is decrypting; encryption hashes the batch it wrote the
+   time before and finishes the last one afterwards. */
+__attribute__((target("avx512f,avx512bw,gfni,pclmul")))
+void sm4_gfni_gcm_blocks(const uint32_t rk[32], const uint8_t htable[8][16], uint8_t counter[16], uint8_t xi[16],
+                         const uint8_t* in, uint8_t* out, size_t batches, int decrypt) {
+    const __m512i bswap = _mm512_broadcast_i32x4(_mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12));
+    /* Lane (128-bit lane l, word e) of a transposed register is block 4e + l. */
+    const __m512i lanes = _mm512_setr_epi32(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15);
+    const __m512i w0 = _mm512_set1_epi32((int)sm4_load_be32(counter));
+    const __m512i w1 = _mm512_set1_epi32((int)sm4_load_be32(counter + 4));
+    const __m512i w2 = _mm512_set1_epi32((int)sm4_load_be32(counter + 8));
+    uint32_t ctr = sm4_load_be32(counter + 12);
+    __m128i h[8];
+    for (int i = 0; i < 8; i++) {
+        h[i] = _mm_loadu_si128((const __m128i*)htable[i]);
+    }
+    __m128i x = _mm_loadu_si128((const __m128i*)xi);
+
+    for (size_t b = 0; b < batches; b++, ctr += 16, in += 256, out += 256) {
+        const uint8_t* hash = decrypt ? in : b ? out - 256 : NULL;
+        __m512i s[4] = { w0, w1, w2, _mm512_add_epi32(_mm512_set1_epi32((int)ctr), lanes) };
+        __m128i lo = _mm_setzero_si128(), mid = _mm_setzero_si128(), hi = _mm_setzero_si128();
+        for (int i = 0; i < 32; i += 4) {
+            SM4_GFNI_ROUND(s[0], s[1], s[2], s[3], _mm512_set1_epi32((int)rk[i]));
+            SM4_GFNI_ROUND(s[1], s[2], s[3], s[0], _mm512_set1_epi32((int)rk[i + 1]));
+            if (hash) {
+                int j = (i / 4) % 4 * 2;
+                const uint8_t* d = hash + 8 * i;
+                __m128i d0 = sm4_ghash_reverse(_mm_loadu_si128((const __m128i*)d));
+                __m128i d1 = sm4_ghash_reverse(_mm_loadu_si128((const __m128i*)(d + 16)));
+                if (j == 0) {
+                    d0 = _mm_xor_si128(d0, x);
+                }
+                sm4_ghash_mul_acc(d0, h[7 - j], &lo, &mid, &hi);
+                sm4_ghash_mul_acc(d1, h[6 - j], &lo, &mid, &hi);
+                if (j == 6) {
+                    x = sm4_ghash_reduce(lo, mid, hi);
+                    lo = mid = hi = _mm_setzero_si128();
+                }
+            }
+            SM4_GFNI_ROUND(s[2], s[3], s[0], s[1], _mm512_set1_epi32((int)rk[i + 2]));
+            SM4_GFNI_ROUND(s[3], s[0], s[1], s[2], _mm512_set1_epi32((int)rk[i + 3]));
+        }
+        __m512i y[4] = { s[3], s[2], s[1], s[0] };
+        sm4_gfni_transpose(y);
+        for (int j = 0; j < 4; j++) {
+            __m512i keystream = _mm512_shuffle_epi8(y[j], bswap);
+            _mm512_storeu_si512(out + 64 * j, _mm512_xor_si512(keystream, _mm512_loadu_si512(in + 64 * j)));
+        }
+    }
+    if (!decrypt && batches) {
+        x = sm4_ghash_8(x, h, out - 256);
+        x = sm4_ghash_8(x, h, out - 128);
+    }
+    _mm_storeu_si128((__m128i*)xi, x);
+    sm4_store_be32(counter + 12, ctr);
+}
+
+#undef SM4_GFNI_ROUND
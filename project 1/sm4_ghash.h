@@ -0,0 +1,63 @@
+#ifndef SM4_GHASH_H
+#define SM4_GHASH_H
+
+#include <immintrin.h>
+
+/* GHASH with PCLMULQDQ in the byte-reversed domain of Intel's carry-less
+   multiplication white paper: blocks and H are loaded with their 16 bytes
+   reversed, products come out reversed as well, and the one-bit shift that the
+   reflected bit order needs is folded into the reduction. Products are kept
+   unreduced as (lo, mid, hi) so that several of them can be summed and reduced
+   once. */
+
+#define SM4_GHASH_INLINE __attribute__((target("ssse3,pclmul"), always_inline)) static inline
+
+SM4_GHASH_INLINE __m128i sm4_ghash_reverse(__m128i x) {
+    return _mm_shuffle_epi8(x, _mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0));
+}
+
+SM4_GHASH_INLINE void sm4_ghash_mul_acc(__m128i a, __m128i b, __m128i* lo, __m128i* mid, __m128i* hi) {
+    *lo = _mm_xor_si128(*lo, _mm_clmulepi64_si128(a, b, 0x00));
+    *hi = _mm_xor_si128(*hi, _mm_clmulepi64_si128(a, b, 0x11));
+    *mid = _mm_xor_si128(*mid, _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x01), _mm_clmulepi64_si128(a, b, 0x10)));
+}
+
+/* Folds mid into the 256-bit product, shifts it left by one and reduces it
+   modulo x^128 + x^7 + x^2 + x + 1. */
+SM4_GHASH_INLINE __m128i sm4_ghash_reduce(__m128i lo, __m128i mid, __m128i hi) {
+    lo = _mm_xor_si128(lo, _mm_slli_si128(mid, 8));
+    hi = _mm_xor_si128(hi, _mm_srli_si128(mid, 8));
+
+    __m128i carry_lo = _mm_srli_epi32(lo, 31);
+    __m128i carry_hi = _mm_srli_epi32(hi, 31);
+    lo = _mm_slli_epi32(lo, 1);
+    hi = _mm_slli_epi32(hi, 1);
+    __m128i cross = _mm_srli_si128(carry_lo, 12);
+    carry_hi = _mm_slli_si128(carry_hi, 4);
+    carry_lo = _mm_slli_si128(carry_lo, 4);
+    lo = _mm_or_si128(lo, carry_lo);
+    hi = _mm_or_si128(_mm_or_si128(hi, carry_hi), cross);
+
+    __m128i a = _mm_xor_si128(_mm_xor_si128(_mm_slli_epi32(lo, 31), _mm_slli_epi32(lo, 30)), _mm_slli_epi32(lo, 25));
+    __m128i b = _mm_srli_si128(a, 4);
+    lo = _mm_xor_si128(lo, _mm_slli_si128(a, 12));
+    __m128i c = _mm_xor_si128(_mm_xor_si128(_mm_srli_epi32(lo, 1), _mm_srli_epi32(lo, 2)), _mm_srli_epi32(lo, 7));
+    c = _mm_xor_si128(c, b);
+    return _mm_xor_si128(hi, _mm_xor_si128(lo, c));
+}
+
+/* xi = (xi ^ d0) * H^8 ^ d1 * H^7 ^ ... ^ d7 * H, with one reduction. h[i] is
+   H^(i + 1), reversed. */
+SM4_GHASH_INLINE __m128i sm4_ghash_8(__m128i xi, const __m128i* h, const uint8_t* data) {
+    __m128i lo = _mm_setzero_si128(), mid = _mm_setzero_si128(), hi = _mm_setzero_si128();
+    for (int i = 0; i < 8; i++) {
+        __m128i d = sm4_ghash_reverse(_mm_loadu_si128((const __m128i*)(data + 16 * i)));
+        if (i == 0) {
+            d = _mm_xor_si128(d, xi);
+        }
+        sm4_ghash_mul_acc(d, h[7 - i], &lo, &mid, &hi);
+    }
+    return sm4_ghash_reduce(lo, mid, hi);
+}
+
+#endif
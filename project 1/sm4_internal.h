@@ -0,0 +1,60 @@
+#ifndef SM4_INTERNAL_H
+#define SM4_INTERNAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "sm4.h"
+
+static inline uint32_t sm4_load_be32(const uint8_t* p) {
+    uint32_t x; memcpy(&x, p, 4); return __builtin_bswap32(x);
+}
+
+static inline void sm4_store_be32(uint8_t* p, uint32_t x) {
+    x = __builtin_bswap32(x); memcpy(p, &x, 4);
+}
+
+/* Modes hand the block kernel this many blocks at a time: a full pass of the
+   widest bitsliced kernel. */
+#define SM4_BATCH_BLOCKS 128
+
+/* Bulk block kernels. Each one runs the 32 rounds with the given round keys
+   (ks->rk to encrypt, ks->drk to decrypt) over `blocks` independent blocks;
+   in and out may alias. Only call a kernel the CPU supports. */
+void sm4_aesni_crypt_blocks(const uint32_t rk[32], const uint8_t* in, uint8_t* out, size_t blocks);
+void sm4_gfni_crypt_blocks(const uint32_t rk[32], const uint8_t* in, uint8_t* out, size_t blocks);
+void sm4_bitslice_crypt_blocks(const uint32_t rk[32], const uint8_t* in, uint8_t* out, size_t blocks);
+void sm4_table1k_crypt_blocks(const uint32_t rk[32], const uint8_t* in, uint8_t* out, size_t blocks);
+void sm4_sbox_crypt_blocks(const uint32_t rk[32], const uint8_t* in, uint8_t* out, size_t blocks);
+
+/* Constant tables (sm4.c): the S-box, and sm4_T[k][b] = L(S(b) << 24) rotated
+   right by 8k. */
+extern const uint8_t sm4_sbox[256];
+extern const uint32_t sm4_T[4][256];
+
+/* ECB where block i runs with round keys rks[i] (sm4_gfni.c); in and out may
+   alias. sm4_run_multikey (sm4.c) picks it when the CPU has GFNI and otherwise
+   hands each run of blocks sharing a key to the best single-key kernel. */
+void sm4_gfni_crypt_blocks_multikey(const uint32_t* const* rks, const uint8_t* in, uint8_t* out, size_t blocks);
+void sm4_run_multikey(const uint32_t* const* rks, const uint8_t* in, uint8_t* out, size_t blocks);
+
+/* Key-cache internals for batches that hold several schedules at once
+   (sm4_key_cache.c). A lookup given a nonzero `since`, the cache clock + 1 at
+   the start of the batch, evicts no schedule used since then and returns NULL
+   when the key's set holds nothing else, so the batch can end early and keep
+   every pointer it took. The prefetch pulls in the set a key maps to. */
+const sm4_key_t* sm4_key_cache_lookup(sm4_key_cache_t* cache, const uint8_t key[16], uint32_t since);
+void sm4_key_cache_prefetch(const sm4_key_cache_t* cache, const uint8_t key[16]);
+
+/* CTR over whole 256-byte batches with a 128-bit counter (sm4_gfni.c);
+   counter is advanced past the last block used. */
+void sm4_gfni_ctr_blocks(const uint32_t rk[32], uint8_t counter[16], const uint8_t* in, uint8_t* out,
+                         size_t batches);
+
+/* SM4-GCM over whole 256-byte batches with GHASH stitched in (sm4_gfni.c).
+   counter is the next counter block and xi the GHASH state in the reversed
+   domain of sm4_ghash.h; both are advanced. Needs GFNI, AVX-512 and PCLMULQDQ. */
+void sm4_gfni_gcm_blocks(const uint32_t rk[32], const uint8_t htable[8][16], uint8_t counter[16], uint8_t xi[16],
+                         const uint8_t* in, uint8_t* out, size_t batches, int decrypt);
+
+#endif
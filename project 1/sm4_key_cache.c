@@ -0,0 +1,111 @@
+/* Set-associative cache of SM4 key schedules. A key hashes to two sets and
+   may sit in either (two-choice hashing), which keeps sets from overflowing at
+   half load where a single set per key would thrash a few percent of keys.
+   The keys of a set fill one 64-byte line, so a hit reads at most two lines
+   and the schedule; the schedules sit behind the keys in the same set.
+   Recency is the value of a per-cache clock at the last use of each way. */
+
+#include <stdlib.h>
+#include <string.h>
+#include "sm4.h"
+#include "sm4_internal.h"
+
+struct sm4_key_cache_set {
+    uint8_t key[SM4_KEY_CACHE_WAYS][16];
+    uint32_t used[SM4_KEY_CACHE_WAYS]; /* clock at the last use, 0 if empty */
+    sm4_key_t ks[SM4_KEY_CACHE_WAYS];
+} __attribute__((aligned(64)));
+
+int sm4_key_cache_init(sm4_key_cache_t* cache, size_t capacity) {
+    size_t sets = 1;
+    /* Half full on average, so capacity keys stay resident. */
+    while (sets * SM4_KEY_CACHE_WAYS < 2 * capacity) {
+        sets *= 2;
+    }
+    memset(cache, 0, sizeof(*cache));
+    cache->sets = (sm4_key_cache_set_t*)aligned_alloc(64, sets * sizeof(sm4_key_cache_set_t));
+    if (!cache->sets) {
+        return -1;
+    }
+    memset(cache->sets, 0, sets * sizeof(sm4_key_cache_set_t));
+    cache->set_mask = sets - 1;
+    return 0;
+}
+
+void sm4_key_cache_free(sm4_key_cache_t* cache) {
+    if (cache->sets) {
+        explicit_bzero(cache->sets, (cache->set_mask + 1) * sizeof(sm4_key_cache_set_t));
+        free(cache->sets);
+    }
+    memset(cache, 0, sizeof(*cache));
+}
+
+/* The two sets a key may live in. */
+static void sm4_key_cache_sets(const sm4_key_cache_t* cache, const uint8_t key[16], sm4_key_cache_set_t* sets[2]) {
+    uint64_t lo, hi;
+    memcpy(&lo, key, 8);
+    memcpy(&hi, key + 8, 8);
+    uint64_t h = (lo ^ (hi * 0x9E3779B97F4A7C15ull)) * 0xC2B2AE3D27D4EB4Full;
+    sets[0] = &cache->sets[(h ^ (h >> 32)) & cache->set_mask];
+    sets[1] = &cache->sets[(h >> 32) & cache->set_mask];
+}
+
+void sm4_key_cache_prefetch(const sm4_key_cache_t* cache, const uint8_t key[16]) {
+    sm4_key_cache_set_t* sets[2];
+    sm4_key_cache_sets(cache, key, sets);
+    for (int i = 0; i < 2; i++) {
+        __builtin_prefetch(sets[i]->key);
+        __builtin_prefetch(sets[i]->used);
+    }
+}
+
+const sm4_key_t* sm4_key_cache_lookup(sm4_key_cache_t* cache, const uint8_t key[16], uint32_t since) {
+    sm4_key_cache_set_t* sets[2];
+    sm4_key_cache_sets(cache, key, sets);
+    if (++cache->clock == 0) {
+        cache->clock = 1;
+    }
+
+    for (int i = 0; i < 2; i++) {
+        sm4_key_cache_set_t* set = sets[i];
+        for (int w = 0; w < SM4_KEY_CACHE_WAYS; w++) {
+            if (set->used[w] && memcmp(set->key[w], key, 16) == 0) {
+                set->used[w] = cache->clock;
+                cache->hits++;
+                return &set->ks[w];
+            }
+        }
+    }
+    /* An empty way of either set, else the oldest not used since `since`.
+       Ages are unsigned distances from the clock, so the order survives its
+       wrap. */
+    sm4_key_cache_set_t* set = NULL;
+    int victim = 0;
+    uint32_t oldest = 0;
+    for (int i = 0; i < 2; i++) {
+        for (int w = 0; w < SM4_KEY_CACHE_WAYS; w++) {
+            uint32_t used = sets[i]->used[w];
+            uint32_t age = used ? cache->clock - used : UINT32_MAX;
+            if (since && used && age <= cache->clock - since) {
+                continue;
+            }
+            if (!set || age > oldest) {
+                set = sets[i];
+                victim = w;
+                oldest = age;
+            }
+        }
+    }
+    if (!set) {
+        return NULL;
+    }
+    cache->misses++;
+    memcpy(set->key[victim], key, 16);
+    set->used[victim] = cache->clock;
+    sm4_key_schedule(&set->ks[victim], key);
+    return &set->ks[victim];
+}
+
+const sm4_key_t* sm4_key_cache_get(sm4_key_cache_t* cache, const uint8_t key[16]) {
+    return sm4_key_cache_lookup(cache, key, 0);
+}
@@ -0,0 +1,150 @@
+/* Counters behind sm4_stats.h. The perf counters are per thread: a group of
+   two hardware events led by the cache-miss counter, read with one syscall at
+   each end of a phase, so they are for diagnosis rather than for production. */
+
+#include <string.h>
+#include <unistd.h>
+#include <x86intrin.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "sm4_stats.h"
+
+static const char* const sm4_phase_names[SM4_PHASE_COUNT] = { "key_schedule", "kernel", "mode", "ghash" };
+
+const char* sm4_phase_name(sm4_phase_t phase) {
+    return (unsigned)phase < SM4_PHASE_COUNT ? sm4_phase_names[phase] : "unknown";
+}
+
+#ifdef SM4_INSTRUMENT
+
+static sm4_stats_t sm4_stats;
+static __thread int sm4_perf_fd = -1;
+
+int sm4_stats_enabled(void) {
+    return 1;
+}
+
+void sm4_stats_snapshot(sm4_stats_t* stats) {
+    const uint64_t* from = (const uint64_t*)&sm4_stats;
+    uint64_t* to = (uint64_t*)stats;
+    for (size_t i = 0; i < sizeof(sm4_stats) / sizeof(uint64_t); i++) {
+        to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+    }
+}
+
+void sm4_stats_reset(void) {
+    uint64_t* counters = (uint64_t*)&sm4_stats;
+    for (size_t i = 0; i < sizeof(sm4_stats) / sizeof(uint64_t); i++) {
+        __atomic_store_n(&counters[i], 0, __ATOMIC_RELAXED);
+    }
+}
+
+static int sm4_perf_open(uint64_t config, int group) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.read_format = PERF_FORMAT_GROUP;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+int sm4_stats_perf_enable(void) {
+    if (sm4_perf_fd >= 0) {
+        return 0;
+    }
+    int leader = sm4_perf_open(PERF_COUNT_HW_CACHE_MISSES, -1);
+    if (leader < 0) {
+        return -1;
+    }
+    if (sm4_perf_open(PERF_COUNT_HW_BRANCH_MISSES, leader) < 0) {
+        close(leader);
+        return -1;
+    }
+    ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    sm4_perf_fd = leader;
+    return 0;
+}
+
+static void sm4_perf_read(uint64_t values[2]) {
+    uint64_t group[3] = { 0, 0, 0 };
+    if (read(sm4_perf_fd, group, sizeof(group)) == (ssize_t)sizeof(group)) {
+        values[0] = group[1];
+        values[1] = group[2];
+    }
+}
+
+void sm4_stats_begin(sm4_stats_mark_t* mark) {
+    mark->perf[0] = mark->perf[1] = 0;
+    if (sm4_perf_fd >= 0) {
+        sm4_perf_read(mark->perf);
+    }
+    mark->tsc = __rdtsc();
+}
+
+void sm4_stats_end(const sm4_stats_mark_t* mark, sm4_phase_t phase) {
+    uint64_t tsc = __rdtsc();
+    sm4_phase_stats_t* p = &sm4_stats.phase[phase];
+    __atomic_fetch_add(&p->calls, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&p->cycles, tsc - mark->tsc, __ATOMIC_RELAXED);
+    if (sm4_perf_fd >= 0) {
+        uint64_t now[2] = { mark->perf[0], mark->perf[1] };
+        sm4_perf_read(now);
+        __atomic_fetch_add(&p->cache_misses, now[0] - mark->perf[0], __ATOMIC_RELAXED);
+        __atomic_fetch_add(&p->branch_misses, now[1] - mark->perf[1], __ATOMIC_RELAXED);
+    }
+}
+
+void sm4_stats_count(sm4_impl_t impl, uint64_t blocks) {
+    __atomic_fetch_add(&sm4_stats.blocks[impl], blocks, __ATOMIC_RELAXED);
+}
+
+#else
+
+int sm4_stats_enabled(void) {
+    return 0;
+}
+
+void sm4_stats_snapshot(sm4_stats_t* stats) {
+    memset(stats, 0, sizeof(*stats));
+}
+
+void sm4_stats_reset(void) {
+}
+
+int sm4_stats_perf_enable(void) {
+    return -1;
+}
+
+void sm4_stats_begin(sm4_stats_mark_t* mark) {
+    (void)mark;
+}
+
+void sm4_stats_end(const sm4_stats_mark_t* mark, sm4_phase_t phase) {
+    (void)mark; (void)phase;
+}
+
+void sm4_stats_count(sm4_impl_t impl, uint64_t blocks) {
+    (void)impl; (void)blocks;
+}
+
+#endif
+
+void sm4_stats_write_json(const sm4_stats_t* stats, FILE* out) {
+    fprintf(out, "{\"enabled\":%s,\"phases\":{", sm4_stats_enabled() ? "true" : "false");
+    for (int i = 0; i < SM4_PHASE_COUNT; i++) {
+        const sm4_phase_stats_t* p = &stats->phase[i];
+        fprintf(out, "%s\"%s\":{\"calls\":%llu,\"cycles\":%llu,\"cache_misses\":%llu,\"branch_misses\":%llu}",
+                i ? "," : "", sm4_phase_names[i], (unsigned long long)p->calls, (unsigned long long)p->cycles,
+                (unsigned long long)p->cache_misses, (unsigned long long)p->branch_misses);
+    }
+    fprintf(out, "},\"blocks\":{");
+    for (int i = SM4_IMPL_TABLE; i < SM4_IMPL_COUNT; i++) {
+        fprintf(out, "%s\"%s\":%llu", i > SM4_IMPL_TABLE ? "," : "", sm4_impl_name((sm4_impl_t)i),
+                (unsigned long long)stats->blocks[i]);
+    }
+    fprintf(out, "}}");
+}
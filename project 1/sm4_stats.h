@@ -0,0 +1,77 @@
+#ifndef SM4_STATS_H
+#define SM4_STATS_H
+
+/* Opt-in instrumentation of the SM4 hot paths. Built with SM4_INSTRUMENT
+   defined (cmake -DSM_INSTRUMENT=ON), the library counts blocks per kernel and
+   TSC cycles per phase, and, after sm4_stats_perf_enable(), cache misses and
+   branch mispredicts per phase from perf_event_open. Without it the hooks
+   below expand to nothing and every snapshot reads zero. Counters are global
+   and updated with relaxed atomics once per kernel call, not per block. */
+
+#include <stdint.h>
+#include <stdio.h>
+#include "sm4.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+    SM4_PHASE_KEY_SCHEDULE = 0,
+    SM4_PHASE_KERNEL,       /* block kernels, including the fused GFNI CTR/GCM */
+    SM4_PHASE_MODE,         /* counter and tweak generation, XOR with the data */
+    SM4_PHASE_GHASH,
+    SM4_PHASE_COUNT
+} sm4_phase_t;
+
+#define SM4_IMPL_COUNT (SM4_IMPL_SBOX + 1)
+
+typedef struct {
+    uint64_t calls;
+    uint64_t cycles;
+    uint64_t cache_misses;
+    uint64_t branch_misses;
+} sm4_phase_stats_t;
+
+typedef struct {
+    sm4_phase_stats_t phase[SM4_PHASE_COUNT];
+    uint64_t blocks[SM4_IMPL_COUNT]; /* indexed by sm4_impl_t; AUTO stays 0 */
+} sm4_stats_t;
+
+/* 1 if the library was built with SM4_INSTRUMENT. */
+int sm4_stats_enabled(void);
+void sm4_stats_snapshot(sm4_stats_t* stats);
+void sm4_stats_reset(void);
+/* Opens cache-miss and branch-miss counters for the calling thread; phases it
+   runs from then on also record them. 0 on success, -1 if instrumentation is
+   off or the kernel refuses (see /proc/sys/kernel/perf_event_paranoid). */
+int sm4_stats_perf_enable(void);
+const char* sm4_phase_name(sm4_phase_t phase);
+/* One JSON object, no trailing newline. */
+void sm4_stats_write_json(const sm4_stats_t* stats, FILE* out);
+
+/* Hooks for the library's own sources. */
+typedef struct {
+    uint64_t tsc;
+    uint64_t perf[2];
+} sm4_stats_mark_t;
+
+void sm4_stats_begin(sm4_stats_mark_t* mark);
+void sm4_stats_end(const sm4_stats_mark_t* mark, sm4_phase_t phase);
+void sm4_stats_count(sm4_impl_t impl, uint64_t blocks);
+
+#ifdef SM4_INSTRUMENT
+#define SM4_STATS_BEGIN(mark) sm4_stats_mark_t mark; sm4_stats_begin(&mark)
+#define SM4_STATS_END(mark, phase) sm4_stats_end(&mark, phase)
+#define SM4_STATS_COUNT(impl, blocks) sm4_stats_count(impl, blocks)
+#else
+#define SM4_STATS_BEGIN(mark) do { } while (0)
+#define SM4_STATS_END(mark, phase) do { } while (0)
+#define SM4_STATS_COUNT(impl, blocks) do { } while (0)
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,136 @@
+/* SM4-XTS (IEEE 1619 construction) for sector encryption. Per data unit the
+   tweak T = E_K2(iv) is doubled in GF(2^128) once per block; a batch of
+   tweaks is laid out next to the data, XORed in, run through the best block
+   kernel in one call, and XORed out again, so a 4 KB sector is two wide kernel
+   calls. A trailing partial block uses ciphertext stealing. */
+
+#include <string.h>
+#include <immintrin.h>
+#include "sm4.h"
+#include "sm4_internal.h"
+#include "sm4_stats.h"
+
+/* T * alpha, with the 128-bit tweak little-endian as in IEEE 1619: every
+   dword shifts left by one, takes the carry of the dword below, and the carry
+   out of the top folds back into the bottom as 0x87. */
+static inline __m128i sm4_xts_double(__m128i t) {
+    __m128i carry = _mm_shuffle_epi32(_mm_srai_epi32(t, 31), 0x93);
+    carry = _mm_and_si128(carry, _mm_set_epi32(1, 1, 1, 0x87));
+    return _mm_xor_si128(_mm_slli_epi32(t, 1), carry);
+}
+
+/* Whole blocks with consecutive tweaks starting at *t, which is advanced.
+   The tweaks stay in a register while the input is whitened, and are read
+   back for the output. */
+static void sm4_xts_blocks(const sm4_key_t* ks, int decrypt, __m128i* t, const uint8_t* in, uint8_t* out,
+                           size_t blocks) {
+    uint8_t tweaks[16 * SM4_BATCH_BLOCKS];
+    uint8_t buffer[16 * SM4_BATCH_BLOCKS];
+    __m128i tweak = *t;
+    while (blocks) {
+        size_t n = blocks < SM4_BATCH_BLOCKS ? blocks : SM4_BATCH_BLOCKS;
+        SM4_STATS_BEGIN(whiten);
+        for (size_t b = 0; b < n; b++) {
+            __m128i x = _mm_loadu_si128((const __m128i*)(in + 16 * b));
+            _mm_storeu_si128((__m128i*)(buffer + 16 * b), _mm_xor_si128(x, tweak));
+            _mm_storeu_si128((__m128i*)(tweaks + 16 * b), tweak);
+            tweak = sm4_xts_double(tweak);
+        }
+        SM4_STATS_END(whiten, SM4_PHASE_MODE);
+        sm4_crypt_blocks(ks, buffer, buffer, n, decrypt, SM4_IMPL_AUTO);
+        SM4_STATS_BEGIN(unwhiten);
+        for (size_t b = 0; b < n; b++) {
+            __m128i x = _mm_loadu_si128((const __m128i*)(buffer + 16 * b));
+            __m128i k = _mm_loadu_si128((const __m128i*)(tweaks + 16 * b));
+            _mm_storeu_si128((__m128i*)(out + 16 * b), _mm_xor_si128(x, k));
+        }
+        SM4_STATS_END(unwhiten, SM4_PHASE_MODE);
+        in += 16 * n; out += 16 * n; blocks -= n;
+    }
+    *t = tweak;
+}
+
+/* One data unit, given its already encrypted tweak. */
+static void sm4_xts_unit(const sm4_xts_key_t* xk, int decrypt, const uint8_t tweak[16], const uint8_t* in,
+                         uint8_t* out, size_t len) {
+    __m128i t = _mm_loadu_si128((const __m128i*)tweak);
+    uint8_t block[16];
+
+    size_t tail = len % 16;
+    size_t blocks = len / 16 - (tail ? 1 : 0);
+    sm4_xts_blocks(&xk->data, decrypt, &t, in, out, blocks);
+    if (!tail) {
+        return;
+    }
+    in += 16 * blocks; out += 16 * blocks;
+
+    /* Ciphertext stealing over the last full block m-1 and the partial block
+       m. Encryption uses T(m-1) first, decryption T(m) first. */
+    __m128i first = decrypt ? sm4_xts_double(t) : t;
+    __m128i second = decrypt ? t : sm4_xts_double(t);
+    sm4_xts_blocks(&xk->data, decrypt, &first, in, block, 1);
+    uint8_t last[16];
+    memcpy(last, block, 16);
+    memcpy(last, in + 16, tail);
+    memcpy(out + 16, block, tail);
+    sm4_xts_blocks(&xk->data, decrypt, &second, last, out, 1);
+}
+
+void sm4_xts_init(sm4_xts_key_t* xk, const uint8_t key[32]) {
+    sm4_key_schedule(&xk->data, key);
+    sm4_key_schedule(&xk->tweak, key + 16);
+}
+
+int sm4_xts_encrypt(const sm4_xts_key_t* xk, const uint8_t iv[16], const uint8_t* in, uint8_t* out, size_t len) {
+    if (len < 16) {
+        return -1;
+    }
+    uint8_t tweak[16];
+    sm4_crypt_blocks(&xk->tweak, iv, tweak, 1, 0, SM4_IMPL_AUTO);
+    sm4_xts_unit(xk, 0, tweak, in, out, len);
+    return 0;
+}
+
+int sm4_xts_decrypt(const sm4_xts_key_t* xk, const uint8_t iv[16], const uint8_t* in, uint8_t* out, size_t len) {
+    if (len < 16) {
+        return -1;
+    }
+    uint8_t tweak[16];
+    sm4_crypt_blocks(&xk->tweak, iv, tweak, 1, 0, SM4_IMPL_AUTO);
+    sm4_xts_unit(xk, 1, tweak, in, out, len);
+    return 0;
+}
+
+/* The tweak of a sector is its number as a 16-byte little-endian value. The
+   tweaks of a run of sectors are encrypted together in one kernel call. */
+static int sm4_xts_sectors(const sm4_xts_key_t* xk, int decrypt, uint64_t sector, size_t sector_size,
+                           const uint8_t* in, uint8_t* out, size_t sectors) {
+    if (sector_size < 16) {
+        return -1;
+    }
+    uint8_t tweaks[16 * SM4_BATCH_BLOCKS];
+    while (sectors) {
+        size_t n = sectors < SM4_BATCH_BLOCKS ? sectors : SM4_BATCH_BLOCKS;
+        memset(tweaks, 0, 16 * n);
+        for (size_t s = 0; s < n; s++) {
+            uint64_t number = sector + s;
+            memcpy(tweaks + 16 * s, &number, 8);
+        }
+        sm4_crypt_blocks(&xk->tweak, tweaks, tweaks, n, 0, SM4_IMPL_AUTO);
+        for (size_t s = 0; s < n; s++, in += sector_size, out += sector_size) {
+            sm4_xts_unit(xk, decrypt, tweaks + 16 * s, in, out, sector_size);
+        }
+        sector += n; sectors -= n;
+    }
+    return 0;
+}
+
+int sm4_xts_encrypt_sectors(const sm4_xts_key_t* xk, uint64_t sector, size_t sector_size, const uint8_t* in,
+                            uint8_t* out, size_t sectors) {
+    return sm4_xts_sectors(xk, 0, sector, sector_size, in, out, sectors);
+}
+
+int sm4_xts_decrypt_sectors(const sm4_xts_key_t* xk, uint64_t sector, size_t sector_size, const uint8_t* in,
+                            uint8_t* out, size_t sectors) {
+    return sm4_xts_sectors(xk, 1, sector, sector_size, in, out, sectors);
+}
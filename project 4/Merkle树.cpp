@@ -0,0 +1,220 @@
+#include <iostream>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <memory>
+#include "sm3_merkle.h"
+#include "sm3_merkle_log.h"
+
+int main()
+{
+    const size_t leafCount = 100000;
+    std::vector<std::string> leaves;
+    for (size_t i = 0; i < leafCount; ++i) {
+        leaves.push_back("leaf-" + std::to_string(i));
+    }
+
+    SM3_MerkleTree tree;
+    auto start = std::chrono::steady_clock::now();
+    tree.Build(leaves, true);
+    auto stop = std::chrono::steady_clock::now();
+    SM3_Digest root = tree.Root();
+    std::cout << "Merkle tree:" << std::endl;
+    std::cout << "  Leaves: " << tree.Size() << ", threads: " << ThreadPool::Shared().Size() << std::endl;
+    std::cout << "  Root: " << SM3_Algorithm::ToHex(root) << std::endl;
+    std::cout << "  Build_Time: "
+              << std::chrono::duration<double, std::milli>(stop - start).count() << " ms" << std::endl;
+
+    size_t index = 31337;
+    SM3_MerkleTree::InclusionProof inclusion = tree.ProveInclusion(index);
+    std::cout << "Inclusion proof test:" << std::endl;
+    std::cout << "  Leaf_Index: " << index << ", path length: " << inclusion.auditPath.size() << std::endl;
+    std::cout << "  Verified: " << std::boolalpha
+              << SM3_MerkleTree::VerifyInclusion(tree.Leaf(index), inclusion, root) << std::endl;
+
+    std::string absent = "leaf-" + std::to_string(leafCount);
+    SM3_MerkleTree::NonInclusionProof nonInclusion;
+    bool absentFromTree = tree.ProveNonInclusion(absent, nonInclusion);
+    std::cout << "Non-inclusion proof test:" << std::endl;
+    std::cout << "  Key: " << absent << ", neighbours: " << nonInclusion.left.leafIndex << ", "
+              << nonInclusion.right.leafIndex << std::endl;
+    std::cout << "  Verified: "
+              << (absentFromTree && SM3_MerkleTree::VerifyNonInclusion(absent, nonInclusion, root, tree.Size()))
+              << std::endl;
+
+    SM3_MerkleTree::NonInclusionProof present;
+    std::cout << "  Present leaf rejected: " << !tree.ProveNonInclusion(leaves[index], present) << std::endl;
+
+    // Neighbour lookups at a size where the leaves no longer fit in cache: binary
+    // search over the digests against the B-tree index, one key and a batch at a time.
+    const size_t bigCount = size_t(1) << 22;
+    std::vector<SM3_Digest> bigLeaves(bigCount);
+    for (size_t i = 0; i < bigCount; ++i) {
+        uint64_t words[4] = {i * 0x9e3779b97f4a7c15ull, i * 0xc2b2ae3d27d4eb4full, i, ~i};
+        std::memcpy(bigLeaves[i].data(), words, 32);
+    }
+    SM3_MerkleTree big;
+    big.BuildFromLeafHashes(bigLeaves, true);
+    const size_t lookups = 100000;
+    std::vector<SM3_Digest> probes(lookups);
+    for (size_t i = 0; i < lookups; ++i) {
+        probes[i] = SM3_MerkleTree::LeafHash("absent-" + std::to_string(i));
+    }
+    const std::vector<SM3_Digest>& sortedLeaves = big.Level(0);
+    size_t checksum = 0;
+    start = std::chrono::steady_clock::now();
+    for (const SM3_Digest& key : probes) {
+        checksum += std::lower_bound(sortedLeaves.begin(), sortedLeaves.end(), key) - sortedLeaves.begin();
+    }
+    double binaryTime = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    std::vector<size_t> located(lookups);
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < lookups; ++i) {
+        big.Locate(&probes[i], 1, &located[i]);
+    }
+    double indexTime = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    start = std::chrono::steady_clock::now();
+    big.Locate(probes.data(), lookups, located.data());
+    double batchIndexTime = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    std::vector<SM3_MerkleTree::NonInclusionProof> proofs(lookups);
+    std::unique_ptr<bool[]> absentKeys(new bool[lookups]);
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < lookups; ++i) {
+        big.ProveNonInclusion(&probes[i], 1, &proofs[i], &absentKeys[i]);
+    }
+    double singleProofTime = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    start = std::chrono::steady_clock::now();
+    big.ProveNonInclusion(probes.data(), lookups, proofs.data(), absentKeys.get());
+    double batchProofTime = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    bool proofsOk = true;
+    for (size_t i = 0; i < lookups; i += 997) {
+        proofsOk &= absentKeys[i] && checksum != 0 &&
+                    SM3_MerkleTree::VerifyNonInclusion("absent-" + std::to_string(i), proofs[i], big.Root(), big.Size());
+    }
+    std::cout << "Sorted leaf index test:" << std::endl;
+    std::cout << "  Leaves: " << big.Size() << ", sampled proofs verified: " << proofsOk << std::endl;
+    std::cout << "  Lookup per key: binary search " << binaryTime / lookups << " ns, index " << indexTime / lookups
+              << " ns, batched " << batchIndexTime / lookups << " ns" << std::endl;
+    std::cout << "  Both neighbour proofs per key: " << singleProofTime / lookups << " ns, batched "
+              << batchProofTime / lookups << " ns" << std::endl;
+
+    // 10k leaves proven at once: one deduplicated multi-proof against 10k audit paths.
+    std::vector<size_t> batch;
+    for (size_t i = 0; i < 10000; ++i) {
+        batch.push_back((i * 2654435761u) % leafCount);
+    }
+    SM3_MerkleTree::MultiProof multi = tree.ProveMultiInclusion(batch);
+    std::vector<SM3_Digest> batchHashes;
+    size_t pathNodes = 0;
+    std::vector<SM3_MerkleTree::InclusionProof> paths;
+    for (size_t i : multi.leafIndices) {
+        batchHashes.push_back(tree.Leaf(i));
+        paths.push_back(tree.ProveInclusion(i));
+        pathNodes += paths.back().auditPath.size();
+    }
+    start = std::chrono::steady_clock::now();
+    bool singleOk = true;
+    for (size_t i = 0; i < paths.size(); ++i) {
+        singleOk &= SM3_MerkleTree::VerifyInclusion(batchHashes[i], paths[i], root);
+    }
+    double singleTime = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    start = std::chrono::steady_clock::now();
+    bool multiOk = SM3_MerkleTree::VerifyMultiInclusion(batchHashes, multi, root);
+    double multiTime = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Multi-proof test:" << std::endl;
+    std::cout << "  Leaves: " << multi.leafIndices.size() << ", nodes: " << multi.nodes.size()
+              << " (separate audit paths: " << pathNodes << ")" << std::endl;
+    std::cout << "  Verified: " << (singleOk && multiOk) << ", time " << multiTime << " ms (separately "
+              << singleTime << " ms)" << std::endl;
+
+    // The same leaves in arrival order, appended to an on-disk log: the first half
+    // one at a time, the rest as one batch. After reopening, the root and proofs
+    // come straight from the mapped file.
+    std::string path = (std::filesystem::temp_directory_path() / "sm3_merkle_demo.log").string();
+    std::remove(path.c_str());
+    SM3_MerkleTree arrival;
+    arrival.Build(leaves);
+    {
+        SM3_MerkleLog log(path);
+        for (size_t i = 0; i < leafCount / 2; ++i) {
+            log.Append(leaves[i]);
+        }
+        std::vector<SM3_Message> rest;
+        for (size_t i = leafCount / 2; i < leafCount; ++i) {
+            rest.push_back({reinterpret_cast<const uint8_t*>(leaves[i].data()), leaves[i].size()});
+        }
+        log.Append(rest.data(), rest.size());
+        log.Sync();
+    }
+    size_t syncedSize = 0;
+    bool secondWriterRefused = false;
+    {
+        SM3_MerkleLog log(path);
+        SM3_Digest logRoot = log.Root();
+        SM3_MerkleTree::InclusionProof logProof = log.ProveInclusion(index);
+        SM3_MerkleTree older;
+        older.Build(std::vector<std::string>(leaves.begin(), leaves.begin() + 40000));
+        std::cout << "Merkle log test:" << std::endl;
+        std::cout << "  Reopened_Size: " << log.Size() << ", root matches in-memory tree: "
+                  << (logRoot == arrival.Root()) << std::endl;
+        std::cout << "  Inclusion verified: " << SM3_MerkleTree::VerifyInclusion(log.Leaf(index), logProof, logRoot)
+                  << ", at tree size 40000: "
+                  << SM3_MerkleTree::VerifyInclusion(log.Leaf(index), log.ProveInclusion(index, 40000), older.Root())
+                  << std::endl;
+        SM3_MerkleTree::ConsistencyProof consistency = log.ProveConsistency(40000, log.Size());
+        std::cout << "  Consistency 40000 -> " << log.Size() << " verified: "
+                  << SM3_MerkleTree::VerifyConsistency(consistency, older.Root(), logRoot) << ", matches tree proof: "
+                  << (consistency.path == arrival.ProveConsistency(40000).path) << ", path length: "
+                  << consistency.path.size() << std::endl;
+
+        const size_t appendCount = 1000000;
+        std::vector<SM3_Digest> leafHashes(appendCount);
+        for (size_t i = 0; i < appendCount; ++i) {
+            leafHashes[i] = SM3_MerkleTree::LeafHash("entry-" + std::to_string(i));
+        }
+        start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < appendCount / 2; ++i) {
+            log.AppendLeafHash(leafHashes[i]);
+        }
+        stop = std::chrono::steady_clock::now();
+        double single = appendCount / 2 / std::chrono::duration<double>(stop - start).count() / 1e6;
+        start = std::chrono::steady_clock::now();
+        for (size_t i = appendCount / 2; i < appendCount; i += 65536) {
+            log.AppendLeafHashes(leafHashes.data() + i, std::min<size_t>(65536, appendCount - i));
+        }
+        stop = std::chrono::steady_clock::now();
+        double batched = appendCount / 2 / std::chrono::duration<double>(stop - start).count() / 1e6;
+        std::cout << "  Append rate (M leaves/s): single " << single << ", batches of 65536 " << batched << std::endl;
+
+        // Sync() flushes only what was appended since the last one; an append that
+        // is never synced is gone when the file is reopened.
+        start = std::chrono::steady_clock::now();
+        log.Sync();
+        stop = std::chrono::steady_clock::now();
+        double bulkSync = std::chrono::duration<double, std::milli>(stop - start).count();
+        for (size_t i = 0; i < 10; ++i) {
+            log.AppendLeafHash(leafHashes[i]);
+        }
+        start = std::chrono::steady_clock::now();
+        log.Sync();
+        stop = std::chrono::steady_clock::now();
+        double smallSync = std::chrono::duration<double, std::milli>(stop - start).count();
+        std::cout << "  Sync (ms): after " << appendCount << " appends " << bulkSync << ", after 10 more "
+                  << smallSync << std::endl;
+        syncedSize = log.Size();
+        // One writer per file: a second log on the same path is refused while
+        // this one is open.
+        try {
+            SM3_MerkleLog second(path);
+        } catch (const std::system_error&) {
+            secondWriterRefused = true;
+        }
+        log.Append("never synced");
+    }
+    SM3_MerkleLog reopened(path);
+    std::cout << "  Second writer refused: " << (secondWriterRefused ? "yes" : "no") << std::endl;
+    std::cout << "  Reopened after an unsynced append: size " << reopened.Size() << " (expected " << syncedSize << ")"
+              << std::endl;
+    std::remove(path.c_str());
+    return 0;
+}
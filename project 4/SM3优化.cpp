@@ -1,227 +1,186 @@
 #include <iostream>
-#include <vector>
-#include <iomanip>
-#include <immintrin.h>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include "sm3.h"
+#include "sm3_kdf.h"
+#include "sm3_mb.h"
+#include "sm3_service.h"
 
-class SM3_Algorithm {
-private:
-    static const uint32_t initialVector[8];
-    uint32_t state[8];
-    uint64_t bitCount;
-    std::vector<uint8_t> messageBuffer;
-
-    static inline uint32_t   rotateLeft(uint32_t x, int n) {
-        return (x << n) | (x >> (32 - n));
-    }
-
-    static inline uint32_t CalculateF(uint32_t x, uint32_t y, uint32_t z, int j) {
-        return (j < 16) ? (x ^ y ^ z) : ((x & y) | (x & z) | (y & z));
-    }
-
-    static inline uint32_t CalculateG(uint32_t x, uint32_t y, uint32_t z, int j) {
-        return (j< 16) ? (x ^ y ^ z) : ((x & y) | (~x & z));
-    }
-
-    static inline uint32_t FunctionP0(uint32_t x) {
-        return x ^   rotateLeft(x, 9) ^   rotateLeft(x, 17);
-    }
-
-    static inline uint32_t FunctionP1(uint32_t x) {
-        return x ^   rotateLeft(x, 15) ^   rotateLeft(x, 23);
-    }
+int main() 
+{
+    std::cout << "Test:" << std::endl;
+    std::string hashEmpty = SM3_Algorithm::ComputeHash("");
+    std::string expectedEmpty = "1ab21d8355cfa17f8e61194831e81a8f22bec8c728fefb747ed035eb5082aa2b";
+    std::cout << "Empty string Test:" << std::endl;
+    std::cout << "  SM3_Result: " << hashEmpty << std::endl;
+    std::cout << "  Expected_Result: " << expectedEmpty << std::endl;
+    
+    std::string hashAbc = SM3_Algorithm::ComputeHash("abcd");
+    std::string expectedAbc = "82ec580fe6d36ae4f81cae3c73f4a5b3b5a09c943172dc9053c69fd8e18dca1e";
+    std::cout << "String test:" << std::endl;
+    std::cout << "  SM3_Result: " << hashAbc << std::endl;
+    std::cout << "  Expected_Result: " << expectedAbc << std::endl;
 
-    static inline uint32_t GetConstant(int index) {
-        return (index < 16) ? 0x79cc4519 : 0x7a879d8a;
+    std::vector<std::string> batch;
+    for (size_t len = 0; len < 200; ++len) {
+        batch.push_back(std::string(len, static_cast<char>('a' + len % 26)));
     }
-
-    void ProcessMessageBlockSIMD(const uint8_t* input, uint32_t* W) {
-        for (int i = 0; i < 16; i += 4) {
-            __m128i vector = _mm_loadu_si128(reinterpret_cast<const __m128i*>(input + i * 4));
-            __m128i mask = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
-            __m128i shuffled = _mm_shuffle_epi8(vector, mask);
-            _mm_storeu_si128(reinterpret_cast<__m128i*>(W + i), shuffled);
-        }
+    std::vector<SM3_Message> messages;
+    for (const auto& m : batch) {
+        messages.push_back({reinterpret_cast<const uint8_t*>(m.data()), m.size()});
     }
-
-    void ExpandW1SIMD(const uint32_t* W, uint32_t* W1) {
-        for (int i = 0; i < 64; i += 4) {
-            __m128i wVec = _mm_loadu_si128(reinterpret_cast<const __m128i*>(W + i));
-            __m128i w4Vec = _mm_loadu_si128(reinterpret_cast<const __m128i*>(W + i + 4));
-            __m128i result = _mm_xor_si128(wVec, w4Vec);
-            _mm_storeu_si128(reinterpret_cast<__m128i*>(W1 + i), result);
+    std::vector<uint8_t> digests = SM3_MultiBuffer::HashBatch(messages);
+    size_t mismatches = 0;
+    for (size_t i = 0; i < batch.size(); ++i) {
+        SM3_Algorithm hasher;
+        hasher.Update(batch[i]);
+        if (!std::equal(digests.begin() + 32 * i, digests.begin() + 32 * (i + 1), hasher.Finalize().begin())) {
+            ++mismatches;
         }
     }
-
-    void ExecuteBlock(const uint8_t* input) {
-        uint32_t W[68];
-        ProcessMessageBlockSIMD(input, W);
-        
-        for (int i = 16; i < 68; ++i) {
-            if (i < 29) {
-                W[i] = FunctionP1(W[i - 16] ^ W[i - 9] ^   rotateLeft(W[i - 3], 15)) ^ 
-                      rotateLeft(W[i - 13], 7) ^ W[i - 6];
-            } else {
-                W[i] = FunctionP1(W[i - 16] ^ W[i - 9] ^   rotateLeft(W[i - 3], 15)) ^ 
-                      rotateLeft(W[i - 13], 7) ^ W[i - 6];
-            }
-        }
-
-        uint32_t W1[64];
-        ExpandW1SIMD(W, W1);
-
-        uint32_t A = state[0], B = state[1], C = state[2], D = state[3];
-        uint32_t E = state[4], F = state[5], G = state[6], H = state[7];
-
-        for (int j = 0; j < 16; j += 4) {
-            for (int k = 0; k < 4; ++k) {
-                uint32_t SS1 =   rotateLeft(  rotateLeft(A, 12) + E +   rotateLeft(GetConstant(j + k), (j + k) % 32), 7);
-                uint32_t SS2 = SS1 ^   rotateLeft(A, 12);
-                uint32_t TT1 = CalculateF(A, B, C, j + k) + D + SS2 + W1[j + k];
-                uint32_t TT2 = CalculateG(E, F, G, j + k) + H + SS1 + W[j + k];
-
-                D = C; 
-		C =   rotateLeft(B, 9); 
-		B = A; 
-		A = TT1;
-                H = G; 
-		G =   rotateLeft(F, 19); 
-		F = E; 
-		E = FunctionP0(TT2);
-            }
-        }
-
-        for (int j = 16; j < 32; j += 4) {
-            for (int k = 0; k < 4; ++k) {
-                uint32_t SS1 =   rotateLeft(  rotateLeft(A, 12) + E +   rotateLeft(GetConstant(j + k), (j + k) % 32), 7);
-                uint32_t SS2 = SS1 ^   rotateLeft(A, 12);
-                uint32_t TT1 = CalculateF(A, B, C, j + k) + D + SS2 + W1[j + k];
-                uint32_t TT2 = CalculateG(E, F, G, j + k) + H + SS1 + W[j + k];
-
-                D = C; 
-		C =   rotateLeft(B, 9); 
-		B = A; 
-		A = TT1;
-                H = G; 
-		G =   rotateLeft(F, 19); 
-		F = E; 
-		E = FunctionP0(TT2);
-            }
+    std::cout << "Multi-buffer test (" << SM3_MultiBuffer::Lanes() << " lanes):" << std::endl;
+    std::cout << "  Messages: " << batch.size() << ", mismatches: " << mismatches << std::endl;
+
+    // Checkpoint a running hash mid-block, restore it, and finish from there.
+    std::string log(100000, '\0');
+    for (size_t i = 0; i < log.size(); ++i) {
+        log[i] = static_cast<char>(i * 31 + 7);
+    }
+    SM3_Algorithm writer;
+    writer.Update(reinterpret_cast<const uint8_t*>(log.data()), 60001);
+    auto checkpoint = writer.Serialize();
+    SM3_Algorithm resumed = SM3_Algorithm::Deserialize(checkpoint.data(), checkpoint.size());
+    resumed.Update(reinterpret_cast<const uint8_t*>(log.data()) + 60001, log.size() - 60001);
+    SM3_Algorithm whole;
+    whole.Update(log);
+    std::cout << "Midstate checkpoint test:" << std::endl;
+    std::cout << "  Resumed after " << checkpoint.size() << "-byte checkpoint matches: "
+              << (resumed.Finalize() == whole.Finalize() ? "yes" : "no") << std::endl;
+
+    // Many threads hashing 64-byte messages, each keeping a window of requests in
+    // flight: one SM3_Algorithm per message, then the same load through the service.
+    const size_t producers = 8, perProducer = 20000, window = 32;
+    auto message = [](size_t t, size_t i) {
+        std::string m(64, '\0');
+        for (size_t k = 0; k < m.size(); ++k) {
+            m[k] = static_cast<char>(t * 131 + i * 7 + k);
         }
-
-        for (int j = 32; j < 64; j += 4) {
-            for (int k = 0; k < 4; ++k) {
-                uint32_t SS1 =   rotateLeft(  rotateLeft(A, 12) + E +   rotateLeft(GetConstant(j + k), (j + k) % 32), 7);
-                uint32_t SS2 = SS1 ^   rotateLeft(A, 12);
-                uint32_t TT1 = CalculateF(A, B, C, j + k) + D + SS2 + W1[j + k];
-                uint32_t TT2 = CalculateG(E, F, G, j + k) + H + SS1 + W[j + k];
-
-                D = C; 
-		C =   rotateLeft(B, 9); 
-		B = A; 
-		A = TT1;
-                H = G; 
-		G =   rotateLeft(F, 19); 
-		F = E; 
-		E = FunctionP0(TT2);
-            }
+        return m;
+    };
+    auto run = [&](auto&& hashWindow) {
+        std::vector<std::vector<double>> latencies(producers);
+        std::vector<std::thread> threads;
+        auto start = std::chrono::steady_clock::now();
+        for (size_t t = 0; t < producers; ++t) {
+            threads.emplace_back([&, t] {
+                for (size_t i = 0; i < perProducer; i += window) {
+                    auto t0 = std::chrono::steady_clock::now();
+                    hashWindow(t, i);
+                    double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - t0).count();
+                    latencies[t].push_back(us);
+                }
+            });
         }
-
-        for (int i = 0; i < 8; ++i) {
-            state[i] ^= (i == 0 ? A : (i == 1 ? B : (i == 2 ? C : (i == 3 ? D : (i == 4 ? E : (i == 5 ? F : (i == 6 ? G : H)))))));
+        for (auto& thread : threads) {
+            thread.join();
         }
-    }
-
-    void PadMessage() {
-        size_t index = messageBuffer.size();
-        size_t paddingLength = 56 - (index + 1) % 64;
-        if (paddingLength > 56) {
-            paddingLength += 64;
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::vector<double> all;
+        for (const auto& l : latencies) {
+            all.insert(all.end(), l.begin(), l.end());
         }
-        messageBuffer.push_back(0x80);
-        for (size_t i = 0; i < paddingLength; ++i) {
-            messageBuffer.push_back(0x00);
+        std::sort(all.begin(), all.end());
+        return std::make_pair(producers * perProducer / seconds, all[all.size() * 99 / 100]);
+    };
+    std::vector<size_t> serviceMismatches(producers);
+    auto direct = run([&](size_t t, size_t i) {
+        for (size_t k = i; k < i + window; ++k) {
+            SM3_Algorithm hasher;
+            hasher.Update(message(t, k));
+            hasher.Finalize();
         }
-        for (int i = 7; i >= 0; --i) {
-            messageBuffer.push_back((bitCount >> (i * 8)) & 0xFF);
+    });
+    SM3_HashService service;
+    auto batched = run([&](size_t t, size_t i) {
+        std::vector<SM3_HashService::Future> pending;
+        for (size_t k = i; k < i + window; ++k) {
+            pending.push_back(service.Submit(message(t, k)));
         }
-    }
-
-public:
-    SM3_Algorithm() {
-        Reset();
-    }
-
-    void Reset() {
-        for (int i = 0; i < 8; ++i) {
-            state[i] = initialVector[i];
-        }
-        bitCount = 0;
-        messageBuffer.clear();
-    }
-
-    void Update(const uint8_t* input, size_t length) {
-        bitCount += length * 8;
-        messageBuffer.insert(messageBuffer.end(), input, input + length);
-
-        while (messageBuffer.size() >= 64) {
-            ExecuteBlock(messageBuffer.data());
-            messageBuffer.erase(messageBuffer.begin(), messageBuffer.begin() + 64);
+        for (size_t k = i; k < i + window; ++k) {
+            const SM3_Digest& digest = pending[k - i].Get();
+            // Spot-check one digest per window against a direct hash.
+            if (k == i) {
+                SM3_Algorithm hasher;
+                hasher.Update(message(t, k));
+                serviceMismatches[t] += hasher.Finalize() != digest;
+            }
         }
-    }
-
-    void Update(const std::string& str) {
-        Update(reinterpret_cast<const uint8_t*>(str.data()), str.size());
-    }
-
-    std::vector<uint8_t> Finalize() {
-        PadMessage();
-        while (messageBuffer.size() >= 64) {
-            ExecuteBlock(messageBuffer.data());
-            messageBuffer.erase(messageBuffer.begin(), messageBuffer.begin() + 64);
+    });
+    // A request with no company waits out maxWait before its bucket is hashed.
+    std::vector<double> lone;
+    for (size_t i = 0; i < 21; ++i) {
+        auto t0 = std::chrono::steady_clock::now();
+        service.Submit(message(0, i)).Get();
+        lone.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - t0).count());
+    }
+    std::sort(lone.begin(), lone.end());
+    SM3_HashService::Counters counters = service.Stats();
+    size_t mismatchCount = 0;
+    for (size_t m : serviceMismatches) {
+        mismatchCount += m;
+    }
+    std::cout << "Hash service test (" << producers << " threads, 64-byte messages, window " << window << "):"
+              << std::endl;
+    std::cout << "  Per-call: " << direct.first / 1e6 << " M hashes/s, p99 window " << direct.second << " us"
+              << std::endl;
+    std::cout << "  Service:  " << batched.first / 1e6 << " M hashes/s, p99 window " << batched.second << " us"
+              << std::endl;
+    std::cout << "  Batches: " << counters.batches << " (" << counters.partialBatches << " partial), "
+              << "mean size " << static_cast<double>(counters.requests) / counters.batches
+              << ", mismatches: " << mismatchCount << std::endl;
+    std::cout << "  Lone request median: " << lone[lone.size() / 2] << " us (max wait " << SM3_HashService::Options().maxWait.count()
+              << " us)" << std::endl;
+
+    // KDF as GB/T 32918 defines it, one SM3(Z || ct) at a time, against SM3_KDF.
+    auto naiveKdf = [](const std::string& z, size_t length) {
+        std::vector<uint8_t> key;
+        for (uint32_t ct = 1; key.size() < length; ++ct) {
+            SM3_Algorithm hasher;
+            hasher.Update(z);
+            const uint8_t counter[4] = {static_cast<uint8_t>(ct >> 24), static_cast<uint8_t>(ct >> 16),
+                                        static_cast<uint8_t>(ct >> 8), static_cast<uint8_t>(ct)};
+            hasher.Update(counter, 4);
+            SM3_Digest digest = hasher.Finalize();
+            key.insert(key.end(), digest.begin(), digest.end());
         }
-
-        std::vector<uint8_t> hash(32);
-        for (int i = 0; i < 8; ++i) {
-            hash[4 * i] = (state[i] >> 24) & 0xFF;
-            hash[4 * i + 1] = (state[i] >> 16) & 0xFF;
-            hash[4 * i + 2] = (state[i] >> 8) & 0xFF;
-            hash[4 * i + 3] = state[i] & 0xFF;
+        key.resize(length);
+        return key;
+    };
+    size_t kdfMismatches = 0, kdfCases = 0;
+    for (size_t zLength : {0, 33, 60, 64, 65, 130}) {
+        std::string z(zLength, '\0');
+        for (size_t i = 0; i < zLength; ++i) {
+            z[i] = static_cast<char>(i * 29 + zLength);
         }
-        return hash;
-    }
-
-    static std::string ComputeHash(const std::string& input) {
-        SM3_Algorithm hasher;
-        hasher.Update(input);
-        auto result = hasher.Finalize();
-
-        std::stringstream hexStream;
-        hexStream << std::hex << std::setfill('0');
-        for (const auto& byte : result) {
-            hexStream << std::setw(2) << static_cast<int>(byte);
+        for (size_t length : {1, 16, 32, 57, 1000, 10000}) {
+            kdfMismatches += SM3_KDF(z).Derive(length) != naiveKdf(z, length);
+            ++kdfCases;
         }
-        return hexStream.str();
     }
-};
-
-const uint32_t SM3_Algorithm::initialVector[8] = {
-    0x7380166f, 0x4914b2b9, 0x172442d7, 0xda8a0600,
-    0xa96f30bc, 0x163138aa, 0xe38dee4d, 0xb0fb0e4e
-};
-
-int main() 
-{
-    std::cout << "Test:" << std::endl;
-    std::string hashEmpty = SM3_Algorithm::hash("");
-    std::string expectedEmpty = "1ab21d8355cfa17f8e61194831e81a8f22bec8c728fefb747ed035eb5082aa2b";
-    std::cout << "Empty string Test:" << std::endl;
-    std::cout << "  SM3_Result: " << hashEmpty << std::endl;
-    std::cout << "  Expected_Result: " << expectedEmpty << std::endl;
-    
-    std::string hashAbc = SM3_Algorithm::hash("abcd");
-    std::string expectedAbc = "82ec580fe6d36ae4f81cae3c73f4a5b3b5a09c943172dc9053c69fd8e18dca1e";
-    std::cout << "String test:" << std::endl;
-    std::cout << "  SM3_Result: " << hashAbc << std::endl;
-    std::cout << "  Expected_Result: " << expectedAbc << std::endl;
+    // Z = x2 || y2 of SM2 encryption is one whole block, so only the counter is
+    // left to hash per 32 bytes of key.
+    std::string z(64, '\x5a');
+    std::vector<uint8_t> stream(1 << 20);
+    auto kdf0 = std::chrono::steady_clock::now();
+    std::vector<uint8_t> naiveStream = naiveKdf(z, stream.size());
+    auto kdf1 = std::chrono::steady_clock::now();
+    SM3_KDF(z).Derive(stream.data(), stream.size());
+    auto kdf2 = std::chrono::steady_clock::now();
+    std::cout << "KDF test:" << std::endl;
+    std::cout << "  Cases: " << kdfCases << ", mismatches: " << kdfMismatches << std::endl;
+    std::cout << "  1 MB key stream: per counter " << std::chrono::duration<double, std::milli>(kdf1 - kdf0).count()
+              << " ms, lanes " << std::chrono::duration<double, std::milli>(kdf2 - kdf1).count()
+              << " ms, matches: " << (stream == naiveStream ? "yes" : "no") << std::endl;
     return 0;
 }
@@ -1,6 +1,8 @@
 #include <iostream>
-#include <vector>
-#include <iomanip>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <string>
 
 
 class SM3_Algorithm {
@@ -8,7 +10,8 @@ private:
     static const uint32_t initialVector[8];
     uint32_t state[8];
     uint64_t bitCount;
-    std::vector<uint8_t> messageBuffer;
+    uint8_t buffer[64];
+    size_t bufferLength;
     static inline uint32_t rotateLeft(uint32_t x, int n) {
         return (x << n) | (x >> (32 - n));
     }
@@ -76,21 +79,6 @@ private:
         state[4] ^= E; state[5] ^= F; state[6] ^= G; state[7] ^= H;
     }
     
-    void padMessage() {
-        size_t index = messageBuffer.size();
-        size_t padLength = 56 - (index + 1) % 64;
-        if (padLength > 56) {
-            padLength += 64;
-        }
-        
-        messageBuffer.push_back(0x80);
-        messageBuffer.insert(messageBuffer.end(), padLength, 0x00);
-        
-        for (int i = 7; i >= 0; --i) {
-            messageBuffer.push_back((bitCount >> (i * 8)) & 0xFF);
-        }
-    }
-
 public:
     SM3_Algorithm() { 
         reset(); 
@@ -101,16 +89,35 @@ public:
             state[i] = initialVector[i];
         }
         bitCount = 0;
-        messageBuffer.clear();
+        bufferLength = 0;
     }
     
     void update(const uint8_t* data, size_t len) {
-        bitCount += len * 8;
-        messageBuffer.insert(messageBuffer.end(), data, data + len);
+        // Empty updates may pass a null pointer, which memcpy must not see.
+        if (!len) {
+            return;
+        }
+        bitCount += static_cast<uint64_t>(len) * 8;
+        if (bufferLength) {
+            size_t take = (len < 64 - bufferLength) ? len : 64 - bufferLength;
+            std::memcpy(buffer + bufferLength, data, take);
+            bufferLength += take;
+            data += take;
+            len -= take;
+            if (bufferLength < 64) {
+                return;
+            }
+            processBlock(buffer);
+            bufferLength = 0;
+        }
+        
+        for (; len >= 64; data += 64, len -= 64) {
+            processBlock(data);
+        }
         
-        while (messageBuffer.size() >= 64) {
-            processBlock(messageBuffer.data());
-            messageBuffer.erase(messageBuffer.begin(), messageBuffer.begin() + 64);
+        if (len) {
+            std::memcpy(buffer, data, len);
+            bufferLength = len;
         }
     }
     
@@ -118,15 +125,21 @@ public:
         update(reinterpret_cast<const uint8_t*>(str.data()), str.size());
     }
     
-    std::vector<uint8_t> finalize() {
-        padMessage();
-        
-        while (messageBuffer.size() >= 64) {
-            processBlock(messageBuffer.data());
-            messageBuffer.erase(messageBuffer.begin(), messageBuffer.begin() + 64);
+    std::array<uint8_t, 32> finalize() {
+        buffer[bufferLength++] = 0x80;
+        if (bufferLength > 56) {
+            std::memset(buffer + bufferLength, 0, 64 - bufferLength);
+            processBlock(buffer);
+            bufferLength = 0;
+        }
+        std::memset(buffer + bufferLength, 0, 56 - bufferLength);
+        for (int i = 0; i < 8; ++i) {
+            buffer[56 + i] = (bitCount >> (56 - 8 * i)) & 0xFF;
         }
+        processBlock(buffer);
+        bufferLength = 0;
         
-        std::vector<uint8_t> hash(32);
+        std::array<uint8_t, 32> hash;
         for (int i = 0; i < 8; ++i) {
             hash[4*i] = (state[i] >> 24) & 0xFF;
             hash[4*i+1] = (state[i] >> 16) & 0xFF;
@@ -137,15 +150,17 @@ public:
     }
     
     static std::string hash(const std::string& input) {
+        static const char digits[] = "0123456789abcdef";
         SM3_Algorithm hashAlg;
         hashAlg.update(input);
         auto hashResult = hashAlg.finalize();
         
-        std::stringstream ss;
-        for (auto b : hashResult) {
-            ss << std::hex << std::setw(2) << std::setfill('0') << static_cast<int>(b);
+        std::string hex(64, '0');
+        for (size_t i = 0; i < hashResult.size(); ++i) {
+            hex[2*i] = digits[hashResult[i] >> 4];
+            hex[2*i+1] = digits[hashResult[i] & 0x0F];
         }
-        return ss.str();
+        return hex;
     }
 };
 
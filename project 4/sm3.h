@@ -0,0 +1,652 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <immintrin.h>
+#include "sm3_stats.h"
+
+using SM3_Digest = std::array<uint8_t, 32>;
+
+// T_j <<< (j mod 32) for every round, so no round rotates its constant at run time.
+constexpr std::array<uint32_t, 64> SM3_MakeRoundConstants() {
+    std::array<uint32_t, 64> t{};
+    for (int j = 0; j < 64; ++j) {
+        uint32_t c = (j < 16) ? 0x79cc4519 : 0x7a879d8a;
+        int n = j % 32;
+        t[j] = n ? ((c << n) | (c >> (32 - n))) : c;
+    }
+    return t;
+}
+
+inline constexpr std::array<uint32_t, 64> SM3_RoundConstants = SM3_MakeRoundConstants();
+
+// A running hash captured between Update() calls: the chaining value after
+// every whole block absorbed so far, the total number of bytes absorbed, and the
+// block still being filled (its first length % 64 bytes).
+struct SM3_Midstate {
+    uint32_t chain[8];
+    uint64_t length;
+    uint8_t tail[64];
+};
+
+// Compression function used by SM3_Algorithm. Reference is the original
+// ExecuteBlock; AVX512 needs AVX-512VL (SM3_Algorithm::Supported); Auto is
+// Interleaved, which runs on every x86-64 CPU this builds for.
+enum class SM3_Backend { Auto, Reference, Unrolled, Interleaved, AVX512 };
+
+class SM3_Algorithm {
+private:
+    friend class SM3_MultiBuffer;
+    friend class SM3_HMAC;
+
+    static constexpr uint32_t initialVector[8] = {
+        0x7380166f, 0x4914b2b9, 0x172442d7, 0xda8a0600,
+        0xa96f30bc, 0x163138aa, 0xe38dee4d, 0xb0fb0e4e
+    };
+    uint32_t state[8];
+    uint64_t bitCount;
+    uint8_t buffer[64];
+    size_t bufferLength;
+    SM3_Backend backend;
+
+    static inline uint32_t   rotateLeft(uint32_t x, int n) {
+        return (x << n) | (x >> (32 - n));
+    }
+
+    static inline uint32_t CalculateF(uint32_t x, uint32_t y, uint32_t z, int j) {
+        return (j < 16) ? (x ^ y ^ z) : ((x & y) | (x & z) | (y & z));
+    }
+
+    static inline uint32_t CalculateG(uint32_t x, uint32_t y, uint32_t z, int j) {
+        return (j< 16) ? (x ^ y ^ z) : ((x & y) | (~x & z));
+    }
+
+    static inline uint32_t FunctionP0(uint32_t x) {
+        return x ^   rotateLeft(x, 9) ^   rotateLeft(x, 17);
+    }
+
+    static inline uint32_t FunctionP1(uint32_t x) {
+        return x ^   rotateLeft(x, 15) ^   rotateLeft(x, 23);
+    }
+
+    static inline uint32_t GetConstant(int index) {
+        return (index < 16) ? 0x79cc4519 : 0x7a879d8a;
+    }
+
+    void ProcessMessageBlockSIMD(const uint8_t* input, uint32_t* W) {
+        for (int i = 0; i < 16; i += 4) {
+            __m128i vector = _mm_loadu_si128(reinterpret_cast<const __m128i*>(input + i * 4));
+            __m128i mask = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+            __m128i shuffled = _mm_shuffle_epi8(vector, mask);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(W + i), shuffled);
+        }
+    }
+
+    void ExpandW1SIMD(const uint32_t* W, uint32_t* W1) {
+        for (int i = 0; i < 64; i += 4) {
+            __m128i wVec = _mm_loadu_si128(reinterpret_cast<const __m128i*>(W + i));
+            __m128i w4Vec = _mm_loadu_si128(reinterpret_cast<const __m128i*>(W + i + 4));
+            __m128i result = _mm_xor_si128(wVec, w4Vec);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(W1 + i), result);
+        }
+    }
+
+    void ExecuteBlock(const uint8_t* input) {
+        uint32_t W[68];
+        uint32_t W1[64];
+        {
+            SM3_STATS_SCOPE(Expand);
+            ProcessMessageBlockSIMD(input, W);
+
+            for (int i = 16; i < 68; ++i) {
+                W[i] = FunctionP1(W[i - 16] ^ W[i - 9] ^   rotateLeft(W[i - 3], 15)) ^ 
+                      rotateLeft(W[i - 13], 7) ^ W[i - 6];
+            }
+
+            ExpandW1SIMD(W, W1);
+        }
+
+        SM3_STATS_SCOPE(Rounds);
+        uint32_t A = state[0], B = state[1], C = state[2], D = state[3];
+        uint32_t E = state[4], F = state[5], G = state[6], H = state[7];
+
+        for (int j = 0; j < 16; j += 4) {
+            for (int k = 0; k < 4; ++k) {
+                uint32_t SS1 =   rotateLeft(  rotateLeft(A, 12) + E +   rotateLeft(GetConstant(j + k), (j + k) % 32), 7);
+                uint32_t SS2 = SS1 ^   rotateLeft(A, 12);
+                uint32_t TT1 = CalculateF(A, B, C, j + k) + D + SS2 + W1[j + k];
+                uint32_t TT2 = CalculateG(E, F, G, j + k) + H + SS1 + W[j + k];
+
+                D = C; 
+		C =   rotateLeft(B, 9); 
+		B = A; 
+		A = TT1;
+                H = G; 
+		G =   rotateLeft(F, 19); 
+		F = E; 
+		E = FunctionP0(TT2);
+            }
+        }
+
+        for (int j = 16; j < 32; j += 4) {
+            for (int k = 0; k < 4; ++k) {
+                uint32_t SS1 =   rotateLeft(  rotateLeft(A, 12) + E +   rotateLeft(GetConstant(j + k), (j + k) % 32), 7);
+                uint32_t SS2 = SS1 ^   rotateLeft(A, 12);
+                uint32_t TT1 = CalculateF(A, B, C, j + k) + D + SS2 + W1[j + k];
+                uint32_t TT2 = CalculateG(E, F, G, j + k) + H + SS1 + W[j + k];
+
+                D = C; 
+		C =   rotateLeft(B, 9); 
+		B = A; 
+		A = TT1;
+                H = G; 
+		G =   rotateLeft(F, 19); 
+		F = E; 
+		E = FunctionP0(TT2);
+            }
+        }
+
+        for (int j = 32; j < 64; j += 4) {
+            for (int k = 0; k < 4; ++k) {
+                uint32_t SS1 =   rotateLeft(  rotateLeft(A, 12) + E +   rotateLeft(GetConstant(j + k), (j + k) % 32), 7);
+                uint32_t SS2 = SS1 ^   rotateLeft(A, 12);
+                uint32_t TT1 = CalculateF(A, B, C, j + k) + D + SS2 + W1[j + k];
+                uint32_t TT2 = CalculateG(E, F, G, j + k) + H + SS1 + W[j + k];
+
+                D = C; 
+		C =   rotateLeft(B, 9); 
+		B = A; 
+		A = TT1;
+                H = G; 
+		G =   rotateLeft(F, 19); 
+		F = E; 
+		E = FunctionP0(TT2);
+            }
+        }
+
+        for (int i = 0; i < 8; ++i) {
+            state[i] ^= (i == 0 ? A : (i == 1 ? B : (i == 2 ? C : (i == 3 ? D : (i == 4 ? E : (i == 5 ? F : (i == 6 ? G : H)))))));
+        }
+    }
+
+    static inline uint32_t LoadWord(const uint8_t* p) {
+        uint32_t x;
+        std::memcpy(&x, p, 4);
+        return __builtin_bswap32(x);
+    }
+
+    static inline void StoreWord(uint8_t* p, uint32_t x) {
+        x = __builtin_bswap32(x);
+        std::memcpy(p, &x, 4);
+    }
+
+    static std::array<uint32_t, 8> ChainWords(const SM3_Digest& digest) {
+        std::array<uint32_t, 8> chain;
+        for (int i = 0; i < 8; ++i) {
+            chain[i] = LoadWord(digest.data() + 4 * i);
+        }
+        return chain;
+    }
+
+    static constexpr char serializedMagic[4] = {'S', 'M', '3', 'M'};
+
+    // One round of the unrolled kernel. Instead of shifting A..H down one slot, the
+    // round writes its four new values over B, D, F and H, and the caller renames
+    // the registers for the next round: (A,B,C,D,E,F,G,H) -> (D,A,B,C,H,E,F,G).
+    // FF/GG and T_j are chosen by the template argument, not at run time.
+    template <int j>
+    static inline __attribute__((always_inline)) void UnrolledRound(
+        uint32_t A, uint32_t& B, uint32_t C, uint32_t& D,
+        uint32_t E, uint32_t& F, uint32_t G, uint32_t& H, uint32_t Wj, uint32_t W1j) {
+        uint32_t A12 = rotateLeft(A, 12);
+        uint32_t SS1 = rotateLeft(A12 + E + SM3_RoundConstants[j], 7);
+        uint32_t SS2 = SS1 ^ A12;
+        uint32_t TT1, TT2;
+        if constexpr (j < 16) {
+            TT1 = (A ^ B ^ C) + D + SS2 + W1j;
+            TT2 = (E ^ F ^ G) + H + SS1 + Wj;
+        } else {
+            TT1 = ((A & (B | C)) | (B & C)) + D + SS2 + W1j;
+            TT2 = (G ^ (E & (F ^ G))) + H + SS1 + Wj;
+        }
+        B = rotateLeft(B, 9);
+        D = TT1;
+        F = rotateLeft(F, 19);
+        H = FunctionP0(TT2);
+    }
+
+    // Four renamed rounds bring the register names back to where they started.
+    // Each group also expands W[j+16..j+19], which the rounds do not need until
+    // twelve groups later, so the out-of-order core runs the expansion beside
+    // the serial chain through A and E instead of ahead of it.
+    template <int j>
+    static inline __attribute__((always_inline)) void UnrolledRounds4(
+        uint32_t& A, uint32_t& B, uint32_t& C, uint32_t& D,
+        uint32_t& E, uint32_t& F, uint32_t& G, uint32_t& H, uint32_t* W) {
+        if constexpr (j + 16 < 68) {
+            for (int i = j + 16; i < j + 20; ++i) {
+                W[i] = FunctionP1(W[i - 16] ^ W[i - 9] ^ rotateLeft(W[i - 3], 15)) ^
+                       rotateLeft(W[i - 13], 7) ^ W[i - 6];
+            }
+        }
+        UnrolledRound<j>(A, B, C, D, E, F, G, H, W[j], W[j] ^ W[j + 4]);
+        UnrolledRound<j + 1>(D, A, B, C, H, E, F, G, W[j + 1], W[j + 1] ^ W[j + 5]);
+        UnrolledRound<j + 2>(C, D, A, B, G, H, E, F, W[j + 2], W[j + 2] ^ W[j + 6]);
+        UnrolledRound<j + 3>(B, C, D, A, F, G, H, E, W[j + 3], W[j + 3] ^ W[j + 7]);
+    }
+
+    template <int... groups>
+    static inline __attribute__((always_inline)) void UnrolledRounds(
+        std::integer_sequence<int, groups...>,
+        uint32_t& A, uint32_t& B, uint32_t& C, uint32_t& D,
+        uint32_t& E, uint32_t& F, uint32_t& G, uint32_t& H, uint32_t* W) {
+        (UnrolledRounds4<4 * groups>(A, B, C, D, E, F, G, H, W), ...);
+    }
+
+    static void CompressUnrolled(uint32_t* digest, const uint8_t* input, size_t blocks) {
+        uint32_t A = digest[0], B = digest[1], C = digest[2], D = digest[3];
+        uint32_t E = digest[4], F = digest[5], G = digest[6], H = digest[7];
+        for (; blocks; --blocks, input += 64) {
+            uint32_t W[68];
+            for (int i = 0; i < 16; ++i) {
+                W[i] = LoadWord(input + 4 * i);
+            }
+
+            uint32_t a = A, b = B, c = C, d = D, e = E, f = F, g = G, h = H;
+            UnrolledRounds(std::make_integer_sequence<int, 16>(), a, b, c, d, e, f, g, h, W);
+            A ^= a; B ^= b; C ^= c; D ^= d;
+            E ^= e; F ^= f; G ^= g; H ^= h;
+        }
+        digest[0] = A; digest[1] = B; digest[2] = C; digest[3] = D;
+        digest[4] = E; digest[5] = F; digest[6] = G; digest[7] = H;
+    }
+
+    template <int n>
+    static inline __m128i RotateWords(__m128i x) {
+        return _mm_or_si128(_mm_slli_epi32(x, n), _mm_srli_epi32(x, 32 - n));
+    }
+
+    static inline __m128i WordsP1(__m128i x) {
+        return _mm_xor_si128(x, _mm_xor_si128(RotateWords<15>(x), RotateWords<23>(x)));
+    }
+
+    // W[j..j+3] from the 16 words before them, held as X0 = W[j-16..j-13] .. X3 =
+    // W[j-4..j-1]. Lanes 0-2 only depend on earlier words. Lane 3 needs W[j] from
+    // lane 0 under P1, and since P1 is linear over XOR it is patched in afterwards.
+    static inline __m128i ExpandWords(__m128i X0, __m128i X1, __m128i X2, __m128i X3) {
+        __m128i w13 = _mm_alignr_epi8(X1, X0, 12);
+        __m128i w9 = _mm_alignr_epi8(X2, X1, 12);
+        __m128i w6 = _mm_alignr_epi8(X3, X2, 8);
+        __m128i w3 = _mm_srli_si128(X3, 4);
+        __m128i t = _mm_xor_si128(_mm_xor_si128(X0, w9), RotateWords<15>(w3));
+        __m128i w = _mm_xor_si128(_mm_xor_si128(WordsP1(t), RotateWords<7>(w13)), w6);
+        __m128i r = RotateWords<15>(_mm_slli_si128(w, 12));
+        return _mm_xor_si128(w, WordsP1(r));
+    }
+
+    // Rounds 4g..4g+3 read W and W' from X[g] and X[g+1]; meanwhile X[g+4] is
+    // expanded into the slot X[g] leaves free, so only 16 words of the schedule
+    // are live at any time and their latency hides behind the round chain.
+    template <int group>
+    static inline __attribute__((always_inline)) void InterleavedRounds4(
+        uint32_t& A, uint32_t& B, uint32_t& C, uint32_t& D,
+        uint32_t& E, uint32_t& F, uint32_t& G, uint32_t& H, __m128i* X) {
+        constexpr int j = 4 * group;
+        alignas(16) uint32_t w[4];
+        alignas(16) uint32_t w1[4];
+        _mm_store_si128(reinterpret_cast<__m128i*>(w), X[group & 3]);
+        _mm_store_si128(reinterpret_cast<__m128i*>(w1), _mm_xor_si128(X[group & 3], X[(group + 1) & 3]));
+        if constexpr (group < 13) {
+            X[group & 3] = ExpandWords(X[group & 3], X[(group + 1) & 3], X[(group + 2) & 3], X[(group + 3) & 3]);
+        }
+        UnrolledRound<j>(A, B, C, D, E, F, G, H, w[0], w1[0]);
+        UnrolledRound<j + 1>(D, A, B, C, H, E, F, G, w[1], w1[1]);
+        UnrolledRound<j + 2>(C, D, A, B, G, H, E, F, w[2], w1[2]);
+        UnrolledRound<j + 3>(B, C, D, A, F, G, H, E, w[3], w1[3]);
+    }
+
+    template <int... groups>
+    static inline __attribute__((always_inline)) void InterleavedRounds(
+        std::integer_sequence<int, groups...>,
+        uint32_t& A, uint32_t& B, uint32_t& C, uint32_t& D,
+        uint32_t& E, uint32_t& F, uint32_t& G, uint32_t& H, __m128i* X) {
+        (InterleavedRounds4<groups>(A, B, C, D, E, F, G, H, X), ...);
+    }
+
+    static void CompressInterleaved(uint32_t* digest, const uint8_t* input, size_t blocks) {
+        const __m128i swap = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+        uint32_t A = digest[0], B = digest[1], C = digest[2], D = digest[3];
+        uint32_t E = digest[4], F = digest[5], G = digest[6], H = digest[7];
+        for (; blocks; --blocks, input += 64) {
+            __m128i X[4];
+            for (int i = 0; i < 4; ++i) {
+                X[i] = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(input + 16 * i)), swap);
+            }
+
+            uint32_t a = A, b = B, c = C, d = D, e = E, f = F, g = G, h = H;
+            InterleavedRounds(std::make_integer_sequence<int, 16>(), a, b, c, d, e, f, g, h, X);
+            A ^= a; B ^= b; C ^= c; D ^= d;
+            E ^= e; F ^= f; G ^= g; H ^= h;
+        }
+        digest[0] = A; digest[1] = B; digest[2] = C; digest[3] = D;
+        digest[4] = E; digest[5] = F; digest[6] = G; digest[7] = H;
+    }
+
+#define SM3_AVX512_TARGET __attribute__((always_inline, target("avx512f,avx512vl"))) static inline
+
+    // The single-stream AVX-512VL kernel: the renamed rounds of UnrolledRound with
+    // A..H held in XMM registers (every lane equal), so that FF, GG and P0 are one
+    // VPTERNLOGD each and every rotate one VPROLD. That takes a cycle off P0 and
+    // off the majority function on the round's critical path. The schedule is
+    // ExpandWords with the same two instructions.
+    template <int j>
+    SM3_AVX512_TARGET void TernaryRound(__m128i A, __m128i& B, __m128i C, __m128i& D,
+                                        __m128i E, __m128i& F, __m128i G, __m128i& H, __m128i Wj, __m128i W1j) {
+        __m128i A12 = _mm_rol_epi32(A, 12);
+        __m128i SS1 = _mm_rol_epi32(_mm_add_epi32(_mm_add_epi32(A12, _mm_set1_epi32(SM3_RoundConstants[j])), E), 7);
+        __m128i SS2 = _mm_xor_si128(SS1, A12);
+        __m128i ff, gg;
+        if constexpr (j < 16) {
+            ff = _mm_ternarylogic_epi32(A, B, C, 0x96);
+            gg = _mm_ternarylogic_epi32(E, F, G, 0x96);
+        } else {
+            ff = _mm_ternarylogic_epi32(A, B, C, 0xe8);
+            gg = _mm_ternarylogic_epi32(E, F, G, 0xca);
+        }
+        __m128i TT1 = _mm_add_epi32(_mm_add_epi32(_mm_add_epi32(D, W1j), ff), SS2);
+        __m128i TT2 = _mm_add_epi32(_mm_add_epi32(_mm_add_epi32(H, Wj), gg), SS1);
+        B = _mm_rol_epi32(B, 9);
+        D = TT1;
+        F = _mm_rol_epi32(F, 19);
+        H = _mm_ternarylogic_epi32(TT2, _mm_rol_epi32(TT2, 9), _mm_rol_epi32(TT2, 17), 0x96);
+    }
+
+    SM3_AVX512_TARGET __m128i TernaryP1(__m128i x) {
+        return _mm_ternarylogic_epi32(x, _mm_rol_epi32(x, 15), _mm_rol_epi32(x, 23), 0x96);
+    }
+
+    SM3_AVX512_TARGET __m128i TernaryExpandWords(__m128i X0, __m128i X1, __m128i X2, __m128i X3) {
+        __m128i w13 = _mm_alignr_epi8(X1, X0, 12);
+        __m128i w9 = _mm_alignr_epi8(X2, X1, 12);
+        __m128i w6 = _mm_alignr_epi8(X3, X2, 8);
+        __m128i w3 = _mm_srli_si128(X3, 4);
+        __m128i t = _mm_ternarylogic_epi32(X0, w9, _mm_rol_epi32(w3, 15), 0x96);
+        __m128i w = _mm_ternarylogic_epi32(TernaryP1(t), _mm_rol_epi32(w13, 7), w6, 0x96);
+        __m128i r = _mm_rol_epi32(_mm_slli_si128(w, 12), 15);
+        return _mm_xor_si128(w, TernaryP1(r));
+    }
+
+    template <int group>
+    SM3_AVX512_TARGET void TernaryRounds4(__m128i& A, __m128i& B, __m128i& C, __m128i& D,
+                                          __m128i& E, __m128i& F, __m128i& G, __m128i& H, __m128i* X) {
+        constexpr int j = 4 * group;
+        __m128i w = X[group & 3];
+        __m128i w1 = _mm_xor_si128(w, X[(group + 1) & 3]);
+        if constexpr (group < 13) {
+            X[group & 3] = TernaryExpandWords(X[group & 3], X[(group + 1) & 3], X[(group + 2) & 3], X[(group + 3) & 3]);
+        }
+        TernaryRound<j>(A, B, C, D, E, F, G, H, _mm_shuffle_epi32(w, 0x00), _mm_shuffle_epi32(w1, 0x00));
+        TernaryRound<j + 1>(D, A, B, C, H, E, F, G, _mm_shuffle_epi32(w, 0x55), _mm_shuffle_epi32(w1, 0x55));
+        TernaryRound<j + 2>(C, D, A, B, G, H, E, F, _mm_shuffle_epi32(w, 0xaa), _mm_shuffle_epi32(w1, 0xaa));
+        TernaryRound<j + 3>(B, C, D, A, F, G, H, E, _mm_shuffle_epi32(w, 0xff), _mm_shuffle_epi32(w1, 0xff));
+    }
+
+    template <int... groups>
+    SM3_AVX512_TARGET void TernaryRounds(std::integer_sequence<int, groups...>,
+                                         __m128i& A, __m128i& B, __m128i& C, __m128i& D,
+                                         __m128i& E, __m128i& F, __m128i& G, __m128i& H, __m128i* X) {
+        (TernaryRounds4<groups>(A, B, C, D, E, F, G, H, X), ...);
+    }
+
+    __attribute__((target("avx512f,avx512vl")))
+    static void CompressAVX512(uint32_t* digest, const uint8_t* input, size_t blocks) {
+        const __m128i swap = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+        __m128i V[8];
+        for (int i = 0; i < 8; ++i) {
+            V[i] = _mm_set1_epi32(static_cast<int>(digest[i]));
+        }
+        for (; blocks; --blocks, input += 64) {
+            __m128i X[4];
+            for (int i = 0; i < 4; ++i) {
+                X[i] = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(input + 16 * i)), swap);
+            }
+
+            __m128i a = V[0], b = V[1], c = V[2], d = V[3], e = V[4], f = V[5], g = V[6], h = V[7];
+            TernaryRounds(std::make_integer_sequence<int, 16>(), a, b, c, d, e, f, g, h, X);
+            V[0] = _mm_xor_si128(V[0], a); V[1] = _mm_xor_si128(V[1], b);
+            V[2] = _mm_xor_si128(V[2], c); V[3] = _mm_xor_si128(V[3], d);
+            V[4] = _mm_xor_si128(V[4], e); V[5] = _mm_xor_si128(V[5], f);
+            V[6] = _mm_xor_si128(V[6], g); V[7] = _mm_xor_si128(V[7], h);
+        }
+        for (int i = 0; i < 8; ++i) {
+            digest[i] = static_cast<uint32_t>(_mm_cvtsi128_si32(V[i]));
+        }
+    }
+
+#undef SM3_AVX512_TARGET
+
+    // Out of line: it runs once per Update, and inlining every engine into each
+    // caller only bloats them.
+    __attribute__((noinline)) void ExecuteBlocks(const uint8_t* input, size_t blocks) {
+        switch (backend) {
+        case SM3_Backend::Reference:
+            SM3_STATS_COUNT(SM3_Engine::Reference, 64 * blocks, blocks);
+            for (size_t i = 0; i < blocks; ++i) {
+                ExecuteBlock(input + 64 * i);
+            }
+            break;
+        case SM3_Backend::Unrolled: {
+            SM3_STATS_COUNT(SM3_Engine::Unrolled, 64 * blocks, blocks);
+            SM3_STATS_SCOPE(Compress);
+            CompressUnrolled(state, input, blocks);
+            break;
+        }
+        case SM3_Backend::AVX512: {
+            SM3_STATS_COUNT(SM3_Engine::AVX512, 64 * blocks, blocks);
+            SM3_STATS_SCOPE(Compress);
+            CompressAVX512(state, input, blocks);
+            break;
+        }
+        default: {
+            SM3_STATS_COUNT(SM3_Engine::Interleaved, 64 * blocks, blocks);
+            SM3_STATS_SCOPE(Compress);
+            CompressInterleaved(state, input, blocks);
+            break;
+        }
+        }
+    }
+
+public:
+    explicit SM3_Algorithm(SM3_Backend backend = SM3_Backend::Auto)
+        : backend(backend == SM3_Backend::Auto ? DefaultBackend() : backend) {
+        if (!Supported(this->backend)) {
+            throw std::invalid_argument("SM3_Algorithm: backend not supported by this CPU");
+        }
+        Reset();
+    }
+
+    // Resumes from a chaining value reached after `length` bytes, which must be a
+    // whole number of blocks. With a digest as the chaining value and the padded
+    // length of its message, this continues that message past its padding.
+    SM3_Algorithm(const uint32_t chain[8], uint64_t length, SM3_Backend backend = SM3_Backend::Auto)
+        : SM3_Algorithm(backend) {
+        if (length % 64) {
+            throw std::invalid_argument("SM3_Algorithm: chaining value length is not a multiple of 64");
+        }
+        std::copy(chain, chain + 8, state);
+        bitCount = length * 8;
+    }
+
+    SM3_Algorithm(const SM3_Digest& chain, uint64_t length, SM3_Backend backend = SM3_Backend::Auto)
+        : SM3_Algorithm(ChainWords(chain).data(), length, backend) {}
+
+    explicit SM3_Algorithm(const SM3_Midstate& midstate, SM3_Backend backend = SM3_Backend::Auto)
+        : SM3_Algorithm(backend) {
+        std::copy(midstate.chain, midstate.chain + 8, state);
+        bitCount = midstate.length * 8;
+        bufferLength = midstate.length % 64;
+        std::memcpy(buffer, midstate.tail, bufferLength);
+    }
+
+    SM3_Midstate Export() const {
+        SM3_Midstate midstate{};
+        std::copy(state, state + 8, midstate.chain);
+        midstate.length = bitCount / 8;
+        std::memcpy(midstate.tail, buffer, bufferLength);
+        return midstate;
+    }
+
+    // Fixed-size, endian-independent form of Export() for checkpoint files:
+    // "SM3M", the chaining value and the length big-endian, then the 64-byte tail
+    // with its unused bytes zero.
+    static constexpr size_t serializedSize = 4 + 32 + 8 + 64;
+
+    std::array<uint8_t, serializedSize> Serialize() const {
+        std::array<uint8_t, serializedSize> out{};
+        SM3_Midstate midstate = Export();
+        std::memcpy(out.data(), serializedMagic, 4);
+        for (int i = 0; i < 8; ++i) {
+            StoreWord(out.data() + 4 + 4 * i, midstate.chain[i]);
+        }
+        StoreWord(out.data() + 36, static_cast<uint32_t>(midstate.length >> 32));
+        StoreWord(out.data() + 40, static_cast<uint32_t>(midstate.length));
+        std::memcpy(out.data() + 44, midstate.tail, 64);
+        return out;
+    }
+
+    static SM3_Algorithm Deserialize(const uint8_t* data, size_t length, SM3_Backend backend = SM3_Backend::Auto) {
+        if (length != serializedSize || std::memcmp(data, serializedMagic, 4) != 0) {
+            throw std::invalid_argument("SM3_Algorithm::Deserialize: not a serialized SM3 midstate");
+        }
+        SM3_Midstate midstate;
+        for (int i = 0; i < 8; ++i) {
+            midstate.chain[i] = LoadWord(data + 4 + 4 * i);
+        }
+        midstate.length = static_cast<uint64_t>(LoadWord(data + 36)) << 32 | LoadWord(data + 40);
+        std::memcpy(midstate.tail, data + 44, 64);
+        for (size_t i = midstate.length % 64; i < 64; ++i) {
+            if (midstate.tail[i]) {
+                throw std::invalid_argument("SM3_Algorithm::Deserialize: bytes past the pending tail are not zero");
+            }
+        }
+        return SM3_Algorithm(midstate, backend);
+    }
+
+    static bool Supported(SM3_Backend backend) {
+        if (backend == SM3_Backend::AVX512) {
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vl");
+        }
+        return true;
+    }
+
+    // AVX512 stays opt-in: sm_bench puts it level with Interleaved on some
+    // AVX-512 machines and ahead on others, with no win that reproduces.
+    static SM3_Backend DefaultBackend() {
+        return SM3_Backend::Interleaved;
+    }
+
+    SM3_Backend Backend() const {
+        return backend;
+    }
+
+    void Reset() {
+        for (int i = 0; i < 8; ++i) {
+            state[i] = initialVector[i];
+        }
+        bitCount = 0;
+        bufferLength = 0;
+    }
+
+    // Only a partial block is ever copied: it tops up the 64-byte tail first, then
+    // every whole block is compressed straight from the caller's buffer.
+    void Update(const uint8_t* input, size_t length) {
+        // Empty updates may pass a null pointer, which memcpy must not see.
+        if (!length) {
+            return;
+        }
+        bitCount += static_cast<uint64_t>(length) * 8;
+        if (bufferLength) {
+            size_t take = std::min(length, 64 - bufferLength);
+            {
+                SM3_STATS_SCOPE(Buffer);
+                std::memcpy(buffer + bufferLength, input, take);
+            }
+            bufferLength += take;
+            input += take;
+            length -= take;
+            if (bufferLength < 64) {
+                return;
+            }
+            ExecuteBlocks(buffer, 1);
+            bufferLength = 0;
+        }
+
+        size_t blocks = length / 64;
+        ExecuteBlocks(input, blocks);
+        input += 64 * blocks;
+        length -= 64 * blocks;
+
+        if (length) {
+            SM3_STATS_SCOPE(Buffer);
+            std::memcpy(buffer, input, length);
+            bufferLength = length;
+        }
+    }
+
+    void Update(const std::string& str) {
+        Update(reinterpret_cast<const uint8_t*>(str.data()), str.size());
+    }
+
+    SM3_Digest Finalize() {
+        buffer[bufferLength++] = 0x80;
+        if (bufferLength > 56) {
+            std::memset(buffer + bufferLength, 0, 64 - bufferLength);
+            ExecuteBlocks(buffer, 1);
+            bufferLength = 0;
+        }
+        {
+            SM3_STATS_SCOPE(Pad);
+            std::memset(buffer + bufferLength, 0, 56 - bufferLength);
+            for (int i = 0; i < 8; ++i) {
+                buffer[56 + i] = static_cast<uint8_t>(bitCount >> (56 - 8 * i));
+            }
+        }
+        ExecuteBlocks(buffer, 1);
+        bufferLength = 0;
+
+        SM3_Digest hash;
+        for (int i = 0; i < 8; ++i) {
+            hash[4 * i] = (state[i] >> 24) & 0xFF;
+            hash[4 * i + 1] = (state[i] >> 16) & 0xFF;
+            hash[4 * i + 2] = (state[i] >> 8) & 0xFF;
+            hash[4 * i + 3] = state[i] & 0xFF;
+        }
+        return hash;
+    }
+
+    static std::string ToHex(const uint8_t* bytes, size_t length) {
+        static constexpr char digits[] = "0123456789abcdef";
+        std::string hex(2 * length, '0');
+        for (size_t i = 0; i < length; ++i) {
+            hex[2 * i] = digits[bytes[i] >> 4];
+            hex[2 * i + 1] = digits[bytes[i] & 0x0F];
+        }
+        return hex;
+    }
+
+    static std::string ToHex(const SM3_Digest& digest) {
+        return ToHex(digest.data(), digest.size());
+    }
+
+    static std::string ComputeHash(const std::string& input) {
+        SM3_Algorithm hasher;
+        hasher.Update(input);
+        return ToHex(hasher.Finalize());
+    }
+};
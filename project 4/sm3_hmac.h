@@ -0,0 +1,114 @@
+#pragma once
+
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "sm3.h"
+#include "sm3_mb.h"
+
+// HMAC-SM3 (RFC 2104 / GB/T 15852.2) for a long-lived key. The key is absorbed
+// once: the hashers that have taken (K ^ ipad) and (K ^ opad) are kept, and every
+// message starts from a copy of them, so a message costs only its own blocks plus
+// one block for the outer hash. Batches run the inner and outer hashes through
+// SM3_MultiBuffer, one message per lane, starting from the same two midstates.
+class SM3_HMAC {
+public:
+    explicit SM3_HMAC(const uint8_t* key, size_t keyLength, SM3_Backend backend = SM3_Backend::Auto)
+        : inner(backend), outer(backend) {
+        uint8_t block[64] = {};
+        if (keyLength > 64) {
+            SM3_Algorithm hasher(backend);
+            hasher.Update(key, keyLength);
+            SM3_Digest digest = hasher.Finalize();
+            std::memcpy(block, digest.data(), digest.size());
+        } else if (keyLength) {
+            std::memcpy(block, key, keyLength);
+        }
+        uint8_t pad[64];
+        for (int i = 0; i < 64; ++i) {
+            pad[i] = block[i] ^ 0x36;
+        }
+        inner.Update(pad, 64);
+        for (int i = 0; i < 64; ++i) {
+            pad[i] = block[i] ^ 0x5c;
+        }
+        outer.Update(pad, 64);
+    }
+
+    explicit SM3_HMAC(const std::string& key, SM3_Backend backend = SM3_Backend::Auto)
+        : SM3_HMAC(reinterpret_cast<const uint8_t*>(key.data()), key.size(), backend) {}
+
+    // Streaming: Begin() hands out a hasher already keyed with the inner pad;
+    // Update() it with the message, then Finish() it.
+    SM3_Algorithm Begin() const {
+        return inner;
+    }
+
+    SM3_Digest Finish(SM3_Algorithm& innerHasher) const {
+        SM3_Digest innerDigest = innerHasher.Finalize();
+        // The outer message is always the 32-byte inner digest: it goes straight
+        // into the tail buffer, and Finalize() pads it into the one block left.
+        SM3_Algorithm hasher = outer;
+        std::memcpy(hasher.buffer, innerDigest.data(), innerDigest.size());
+        hasher.bufferLength = innerDigest.size();
+        hasher.bitCount += 8 * innerDigest.size();
+        return hasher.Finalize();
+    }
+
+    SM3_Digest Sign(const uint8_t* data, size_t length) const {
+        SM3_Algorithm hasher = inner;
+        hasher.Update(data, length);
+        return Finish(hasher);
+    }
+
+    SM3_Digest Sign(const std::string& data) const {
+        return Sign(reinterpret_cast<const uint8_t*>(data.data()), data.size());
+    }
+
+    // Compares all 32 bytes whatever the first difference.
+    bool Verify(const uint8_t* data, size_t length, const uint8_t tag[32]) const {
+        return Equal(Sign(data, length).data(), tag);
+    }
+
+    // Writes the tag of messages[i] to tags + 32 * i.
+    void SignBatch(const SM3_Message* messages, size_t count, uint8_t* tags,
+                   SM3_MultiBuffer::Width width = SM3_MultiBuffer::Width::Auto) const {
+        std::vector<uint8_t> innerDigests(32 * count);
+        std::vector<SM3_Message> outerMessages(count);
+        SM3_MultiBuffer::HashBatch(inner.state, 64, messages, count, innerDigests.data(), width);
+        for (size_t i = 0; i < count; ++i) {
+            outerMessages[i] = {innerDigests.data() + 32 * i, 32};
+        }
+        SM3_MultiBuffer::HashBatch(outer.state, 64, outerMessages.data(), count, tags, width);
+    }
+
+    // Checks messages[i] against tags + 32 * i. valid[i], if given, receives each
+    // result; the return value says whether every tag matched.
+    bool VerifyBatch(const SM3_Message* messages, size_t count, const uint8_t* tags, bool* valid = nullptr,
+                     SM3_MultiBuffer::Width width = SM3_MultiBuffer::Width::Auto) const {
+        std::vector<uint8_t> expected(32 * count);
+        SignBatch(messages, count, expected.data(), width);
+        bool all = true;
+        for (size_t i = 0; i < count; ++i) {
+            bool ok = Equal(expected.data() + 32 * i, tags + 32 * i);
+            if (valid) {
+                valid[i] = ok;
+            }
+            all &= ok;
+        }
+        return all;
+    }
+
+    static bool Equal(const uint8_t* a, const uint8_t* b) {
+        uint8_t diff = 0;
+        for (int i = 0; i < 32; ++i) {
+            diff |= a[i] ^ b[i];
+        }
+        return diff == 0;
+    }
+
+private:
+    SM3_Algorithm inner;
+    SM3_Algorithm outer;
+};
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "sm3.h"
+#include "sm3_mb.h"
+
+// Key derivation function of GB/T 32918 (SM2): K = SM3(Z || ct) || SM3(Z || ct+1)
+// || ..., ct a 32-bit big-endian counter from 1, cut to the length asked for. Z is
+// absorbed once: its whole blocks stay behind as a chaining value, and only its
+// last length % 64 bytes are repeated in front of each counter. The counters are
+// independent messages, so they run through SM3_MultiBuffer one per lane, with the
+// digests written straight into the caller's buffer.
+class SM3_KDF {
+public:
+    explicit SM3_KDF(const uint8_t* z, size_t length, SM3_MultiBuffer::Width width = SM3_MultiBuffer::Width::Auto)
+        : width(width) {
+        if (!SM3_MultiBuffer::Supported(width)) {
+            throw std::invalid_argument("SM3_KDF: width not supported by this CPU");
+        }
+        SM3_Algorithm hasher;
+        hasher.Update(z, length);
+        midstate = hasher.Export();
+    }
+
+    explicit SM3_KDF(const std::string& z, SM3_MultiBuffer::Width width = SM3_MultiBuffer::Width::Auto)
+        : SM3_KDF(reinterpret_cast<const uint8_t*>(z.data()), z.size(), width) {}
+
+    // Writes `length` bytes of K to out, starting at counter `counter`: with
+    // counter n + 1 the output is K from byte 32 * n on, so a long stream can be
+    // derived in pieces.
+    void Derive(uint8_t* out, size_t length, uint32_t counter = 1) const {
+        uint64_t blocks = (static_cast<uint64_t>(length) + 31) / 32;
+        if (blocks > UINT32_MAX - static_cast<uint64_t>(counter) + 1) {
+            throw std::invalid_argument("SM3_KDF::Derive: output needs more than the 32-bit counter allows");
+        }
+        size_t tailLength = midstate.length % 64;
+        size_t stride = tailLength + 4;
+        size_t lanes = SM3_MultiBuffer::Lanes(width);
+        size_t group = std::min<uint64_t>(blocks, batch);
+        std::vector<uint8_t> inputs(stride * group);
+        std::vector<SM3_Message> messages(group);
+        for (size_t i = 0; i < group; ++i) {
+            std::memcpy(inputs.data() + i * stride, midstate.tail, tailLength);
+            messages[i] = {inputs.data() + i * stride, stride};
+        }
+        uint8_t last[32 * batch];
+        for (uint64_t done = 0; done < blocks; done += group) {
+            group = static_cast<size_t>(std::min<uint64_t>(blocks - done, batch));
+            for (size_t i = 0; i < group; ++i) {
+                StoreBE32(inputs.data() + i * stride + tailLength, static_cast<uint32_t>(counter + done + i));
+            }
+            // A short run would leave most lanes idle; one stream at a time is
+            // cheaper there. Only the batch holding a partial digest goes
+            // through scratch.
+            SM3_MultiBuffer::Width w = group * 8 <= lanes ? SM3_MultiBuffer::Width::Scalar : width;
+            uint64_t prefix = midstate.length - tailLength;
+            bool partial = 32 * (done + group) > length;
+            SM3_MultiBuffer::HashBatch(midstate.chain, prefix, messages.data(), group,
+                                       partial ? last : out + 32 * done, w);
+            if (partial) {
+                std::memcpy(out + 32 * done, last, length - 32 * done);
+            }
+        }
+    }
+
+    std::vector<uint8_t> Derive(size_t length, uint32_t counter = 1) const {
+        std::vector<uint8_t> key(length);
+        Derive(key.data(), length, counter);
+        return key;
+    }
+
+    static std::vector<uint8_t> Derive(const uint8_t* z, size_t zLength, size_t length) {
+        return SM3_KDF(z, zLength).Derive(length);
+    }
+
+private:
+    // Counters hashed per HashBatch call.
+    static constexpr size_t batch = 256;
+
+    SM3_Midstate midstate;
+    SM3_MultiBuffer::Width width;
+
+    static void StoreBE32(uint8_t* p, uint32_t x) {
+        x = __builtin_bswap32(x);
+        std::memcpy(p, &x, 4);
+    }
+};
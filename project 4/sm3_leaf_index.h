@@ -0,0 +1,250 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <vector>
+#include <sys/mman.h>
+#include "sm3.h"
+#include "sm3_mb.h"
+
+// Search index over a sorted array of leaf digests, for finding the neighbours of
+// an absent key. Binary search over 32-byte digests misses the cache at almost
+// every step once the array outgrows it; here the first 4 bytes of every digest
+// are copied into a static B-tree whose nodes are one 64-byte line of 16 keys, laid
+// out implicitly (children of node k are k * 17 + 1 .. k * 17 + 17). A lookup
+// reads one line per level, ranks the key against all 16 in one vector compare,
+// and reads the digest array only to step over leaves sharing its prefix. Batches
+// of lookups run interleaved, each prefetching its next node while the others are
+// ranked. No leaf index is stored per key: the keys are handed out in order, so a
+// key's leaf index is the number of key slots before it in the tree's in-order,
+// summed level by level on the way down. The nodes sit on transparent huge pages
+// where the kernel allows it, so the descent does not also miss the TLB at every
+// level.
+class SM3_LeafIndex {
+public:
+    // leaves must be in SM3_Digest order; the index keeps no pointer to them, the
+    // same array is passed back to every lookup.
+    void Build(const SM3_Digest* leaves, size_t count) {
+        leafCount = count;
+        blocks = (count + nodeKeys - 1) / nodeKeys;
+        levels = 0;
+        span[0] = 1;
+        full[0] = 0;
+        while (full[levels] < blocks) {
+            span[levels + 1] = span[levels] * (nodeKeys + 1);
+            full[levels + 1] = full[levels] + span[levels];
+            ++levels;
+        }
+        nodes.assign(blocks, Node{});
+        for (Node& node : nodes) {
+            for (int32_t& key : node.keys) {
+                key = INT32_MAX;
+            }
+        }
+        size_t next = 0;
+        Fill(leaves, 0, next);
+    }
+
+    size_t Size() const {
+        return leafCount;
+    }
+
+    // std::lower_bound(leaves, leaves + Size(), key) under SM3_Digest order.
+    size_t LowerBound(const SM3_Digest* leaves, const SM3_Digest& key) const {
+        size_t result;
+        LowerBound(leaves, &key, 1, &result);
+        return result;
+    }
+
+    void LowerBound(const SM3_Digest* leaves, const SM3_Digest* keys, size_t count, size_t* results) const {
+        static const SM3_MultiBuffer::Width width = SM3_MultiBuffer::Detect();
+        for (size_t done = 0; done < count; done += group) {
+            size_t n = count - done < group ? count - done : group;
+            int32_t prefixes[group];
+            size_t below[group];
+            bool tied[group];
+            for (size_t j = 0; j < n; ++j) {
+                prefixes[j] = Prefix(keys[done + j]);
+            }
+            switch (width) {
+            case SM3_MultiBuffer::Width::AVX512:
+                DescendAVX512(prefixes, n, below, tied);
+                break;
+            case SM3_MultiBuffer::Width::AVX2:
+                DescendAVX2(prefixes, n, below, tied);
+                break;
+            default:
+                DescendScalar(prefixes, n, below, tied);
+                break;
+            }
+            // The tree gives the first leaf whose prefix is not below the key's;
+            // only when that prefix is the key's own are digests compared.
+            for (size_t j = 0; j < n; ++j) {
+                size_t i = below[j];
+                while (tied[j] && i < leafCount && Prefix(leaves[i]) == prefixes[j] &&
+                       Less(leaves[i], keys[done + j])) {
+                    ++i;
+                }
+                results[done + j] = i;
+            }
+        }
+    }
+
+private:
+    static constexpr size_t nodeKeys = 16;
+    static constexpr size_t group = 16;
+    // 17^16 nodes would not fit in size_t.
+    static constexpr int maxLevels = 16;
+
+    struct alignas(64) Node {
+        int32_t keys[nodeKeys];
+    };
+
+    typedef int32_t KeyVec __attribute__((vector_size(64)));
+
+    // 2 MB aligned, and marked for huge pages once an array spans one.
+    template <typename T>
+    struct HugePageAllocator {
+        typedef T value_type;
+        static constexpr size_t hugePage = size_t(1) << 21;
+
+        HugePageAllocator() = default;
+        template <typename U>
+        HugePageAllocator(const HugePageAllocator<U>&) {}
+
+        T* allocate(size_t n) {
+            size_t bytes = n * sizeof(T);
+            void* p = nullptr;
+            if (posix_memalign(&p, bytes >= hugePage ? hugePage : 64, bytes) != 0) {
+                throw std::bad_alloc();
+            }
+            if (bytes >= hugePage) {
+                madvise(p, bytes, MADV_HUGEPAGE);
+            }
+            return static_cast<T*>(p);
+        }
+
+        void deallocate(T* p, size_t) {
+            std::free(p);
+        }
+
+        template <typename U>
+        bool operator==(const HugePageAllocator<U>&) const {
+            return true;
+        }
+        template <typename U>
+        bool operator!=(const HugePageAllocator<U>&) const {
+            return false;
+        }
+    };
+
+    std::vector<Node, HugePageAllocator<Node>> nodes;
+    size_t blocks = 0;
+    // Depth of the tree. Nodes of depth d are [full[d], full[d + 1]): every
+    // depth but the last is complete, holding span[d] = 17^d nodes.
+    int levels = 0;
+    size_t span[maxLevels + 1];
+    size_t full[maxLevels + 1];
+    size_t leafCount = 0;
+
+    // The first 4 digest bytes as a big-endian integer, sign bit flipped so that
+    // signed compares, which every vector width has, order them as unsigned.
+    static int32_t Prefix(const SM3_Digest& digest) {
+        uint32_t x;
+        std::memcpy(&x, digest.data(), 4);
+        return static_cast<int32_t>(__builtin_bswap32(x) ^ 0x80000000u);
+    }
+
+    static bool Less(const SM3_Digest& a, const SM3_Digest& b) {
+        return std::memcmp(a.data(), b.data(), 32) < 0;
+    }
+
+    // In-order walk of the implicit tree, handing out the sorted keys.
+    void Fill(const SM3_Digest* leaves, size_t k, size_t& next) {
+        if (k >= blocks) {
+            return;
+        }
+        for (size_t i = 0; i < nodeKeys; ++i) {
+            Fill(leaves, k * (nodeKeys + 1) + i + 1, next);
+            if (next < leafCount) {
+                nodes[k].keys[i] = Prefix(leaves[next++]);
+            }
+        }
+        Fill(leaves, k * (nodeKeys + 1) + nodeKeys + 1, next);
+    }
+
+    // Key slots that come before child `rank` of node k, at depth `depth`, in
+    // in-order: the rank keys of k and every slot under its children 0 .. rank -
+    // 1. Their subtrees are complete down to the last depth, where the
+    // descendants of consecutive siblings are one run of nodes, clipped where
+    // the tree ends.
+    size_t SlotsBefore(size_t k, int depth, size_t rank) const {
+        int below = levels - 2 - depth;
+        if (below < 0) {
+            return rank;
+        }
+        size_t first = (k * (nodeKeys + 1) + 1) * span[below] + full[below];
+        size_t width = rank * span[below];
+        size_t last = first >= blocks ? 0 : blocks - first < width ? blocks - first : width;
+        return (rank * full[below] + last) * nodeKeys + rank;
+    }
+
+    // Written once on a GCC vector type and only inlined into the target entry
+    // points below, which pick the instructions, as in SM3_MultiBuffer. below[j]
+    // receives the number of keys under prefixes[j], which is the leaf index of
+    // its lower bound: unused slots hold INT32_MAX and come last in in-order, so
+    // they are never counted. tied[j] says whether the key at that leaf has the
+    // same prefix.
+    inline __attribute__((always_inline)) void Descend(const int32_t* prefixes, size_t n, size_t* below,
+                                                       bool* tied) const {
+        size_t k[group];
+        for (size_t j = 0; j < n; ++j) {
+            k[j] = 0;
+            below[j] = 0;
+            tied[j] = false;
+        }
+        bool active = blocks > 0;
+        for (int depth = 0; active; ++depth) {
+            active = false;
+            for (size_t j = 0; j < n; ++j) {
+                if (k[j] >= blocks) {
+                    continue;
+                }
+                KeyVec keys;
+                std::memcpy(&keys, nodes[k[j]].keys, sizeof(keys));
+                KeyVec x = KeyVec{} + prefixes[j];
+                KeyVec less = keys < x;
+                size_t rank = 0;
+                for (size_t i = 0; i < nodeKeys; ++i) {
+                    rank -= less[i];
+                }
+                if (rank < nodeKeys) {
+                    tied[j] = nodes[k[j]].keys[rank] == prefixes[j];
+                }
+                below[j] += SlotsBefore(k[j], depth, rank);
+                k[j] = k[j] * (nodeKeys + 1) + rank + 1;
+                if (k[j] < blocks) {
+                    __builtin_prefetch(&nodes[k[j]]);
+                    active = true;
+                }
+            }
+        }
+    }
+
+    __attribute__((target("avx512f")))
+    void DescendAVX512(const int32_t* prefixes, size_t n, size_t* below, bool* tied) const {
+        Descend(prefixes, n, below, tied);
+    }
+
+    __attribute__((target("avx2")))
+    void DescendAVX2(const int32_t* prefixes, size_t n, size_t* below, bool* tied) const {
+        Descend(prefixes, n, below, tied);
+    }
+
+    void DescendScalar(const int32_t* prefixes, size_t n, size_t* below, bool* tied) const {
+        Descend(prefixes, n, below, tied);
+    }
+};
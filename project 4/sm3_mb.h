@@ -0,0 +1,374 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <stdexcept>
+#include <vector>
+#include "sm3.h"
+
+// One independent input of a SM3_MultiBuffer batch.
+struct SM3_Message {
+    const uint8_t* data;
+    size_t length;
+};
+
+// Multi-buffer SM3: the compression function runs transposed across the lanes of
+// one vector register, lane k hashing its own message. Every lane pads its message
+// on its own and is refilled with the next pending message as soon as it finishes,
+// so a batch of mixed lengths keeps all lanes busy until the queue drains.
+class SM3_MultiBuffer {
+public:
+    enum class Width { Auto, Scalar, AVX2, AVX512 };
+
+    static Width Detect() {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f")) {
+            return Width::AVX512;
+        }
+        if (__builtin_cpu_supports("avx2")) {
+            return Width::AVX2;
+        }
+        return Width::Scalar;
+    }
+
+    // Whether this CPU can run the width. Every entry point given an explicit
+    // width it cannot run throws std::invalid_argument, as SM3_Algorithm does
+    // for a backend.
+    static bool Supported(Width width) {
+        __builtin_cpu_init();
+        switch (width) {
+        case Width::AVX512: return __builtin_cpu_supports("avx512f");
+        case Width::AVX2: return __builtin_cpu_supports("avx2");
+        default: return true;
+        }
+    }
+
+    static size_t Lanes(Width width = Width::Auto) {
+        switch (Resolve(width)) {
+        case Width::AVX512: return 16;
+        case Width::AVX2: return 8;
+        default: return 1;
+        }
+    }
+
+    // Writes the digest of messages[i] to digests + 32 * i. Output is identical to
+    // SM3_Algorithm for every width.
+    static void HashBatch(const SM3_Message* messages, size_t count, uint8_t* digests,
+                          Width width = Width::Auto) {
+        HashBatch(SM3_Algorithm::initialVector, 0, messages, count, digests, width);
+    }
+
+    static std::vector<uint8_t> HashBatch(const std::vector<SM3_Message>& messages,
+                                          Width width = Width::Auto) {
+        std::vector<uint8_t> digests(32 * messages.size());
+        HashBatch(messages.data(), messages.size(), digests.data(), width);
+        return digests;
+    }
+
+    // Every message continues a hash that has already absorbed prefixLength bytes
+    // (a multiple of 64) and reached chaining value chain, e.g. the keyed inner and
+    // outer hashes of HMAC. Any other prefixLength throws std::invalid_argument.
+    static void HashBatch(const uint32_t chain[8], uint64_t prefixLength, const SM3_Message* messages,
+                          size_t count, uint8_t* digests, Width width = Width::Auto) {
+        CheckPrefix(prefixLength);
+        switch (Resolve(width)) {
+        case Width::AVX512:
+            HashBatchAVX512(chain, nullptr, prefixLength, messages, count, digests);
+            break;
+        case Width::AVX2:
+            HashBatchAVX2(chain, nullptr, prefixLength, messages, count, digests);
+            break;
+        default:
+            HashBatchScalar(chain, nullptr, prefixLength, messages, count, digests);
+            break;
+        }
+    }
+
+    // As above, but message i resumes after prefixLengths[i] bytes: one chaining
+    // value claimed at several lengths, as when length-extension candidates guess
+    // the size of a secret prefix. Only the length field of each padding differs.
+    static void HashBatchResume(const uint32_t chain[8], const uint64_t* prefixLengths,
+                                const SM3_Message* messages, size_t count, uint8_t* digests,
+                                Width width = Width::Auto) {
+        for (size_t i = 0; i < count; ++i) {
+            CheckPrefix(prefixLengths[i]);
+        }
+        switch (Resolve(width)) {
+        case Width::AVX512:
+            HashBatchAVX512(chain, prefixLengths, 0, messages, count, digests);
+            break;
+        case Width::AVX2:
+            HashBatchAVX2(chain, prefixLengths, 0, messages, count, digests);
+            break;
+        default:
+            HashBatchScalar(chain, prefixLengths, 0, messages, count, digests);
+            break;
+        }
+    }
+
+private:
+    typedef uint32_t Vec8 __attribute__((vector_size(32)));
+    typedef uint32_t Vec16 __attribute__((vector_size(64)));
+    typedef uint8_t Bytes32 __attribute__((vector_size(32)));
+
+    static constexpr size_t noMessage = static_cast<size_t>(-1);
+
+    static Width Resolve(Width width) {
+        if (width != Width::Auto) {
+            if (!Supported(width)) {
+                throw std::invalid_argument("SM3_MultiBuffer: width not supported by this CPU");
+            }
+            return width;
+        }
+        static const Width detected = Detect();
+        return detected;
+    }
+
+    // The lane kernels would hash from a misplaced length field; the scalar path
+    // would throw from SM3_Algorithm. Either way the caller should hear it here.
+    static void CheckPrefix(uint64_t prefixLength) {
+        if (prefixLength % 64) {
+            throw std::invalid_argument("SM3_MultiBuffer::HashBatch: prefix length is not a multiple of 64");
+        }
+    }
+
+    static inline void StoreBE32(uint8_t* p, uint32_t x) {
+        x = __builtin_bswap32(x);
+        std::memcpy(p, &x, 4);
+    }
+
+    // The lane kernels below are written once on GCC vector types and only ever
+    // inlined into the target("avx2") / target("avx512f") entry points, which decide
+    // the instruction set they compile to. Vectors never cross a call boundary.
+#define SM3_LANES_ROTL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+#define SM3_LANES_P0(x) ((x) ^ SM3_LANES_ROTL(x, 9) ^ SM3_LANES_ROTL(x, 17))
+#define SM3_LANES_P1(x) ((x) ^ SM3_LANES_ROTL(x, 15) ^ SM3_LANES_ROTL(x, 23))
+
+    // Word i of every lane's current block into block[i]. Each lane's 64 bytes
+    // are read as whole vectors and byte-swapped, then every N x N square is
+    // transposed in registers. With 8 lanes the shuffles are the in-lane unpacks
+    // and a 128-bit permute; with 16, four rounds of interleaving row k with row
+    // k + 8, each one vpermt2d.
+    template <typename V, int N>
+    static inline __attribute__((always_inline)) void LoadBlocks(V* block, const uint8_t* const* p) {
+        for (int part = 0; part < 16 / N; ++part) {
+            V r[N];
+            for (int k = 0; k < N; ++k) {
+                std::memcpy(&r[k], p[k] + part * 4 * N, sizeof(V));
+                if constexpr (N == 8) {
+                    // One vpshufb.
+                    Bytes32 bytes = reinterpret_cast<Bytes32>(r[k]);
+                    r[k] = reinterpret_cast<V>(__builtin_shuffle(
+                        bytes, Bytes32{3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+                                       19, 18, 17, 16, 23, 22, 21, 20, 27, 26, 25, 24, 31, 30, 29, 28}));
+                } else {
+                    // AVX-512F has no byte shuffle; two vprold and a vpternlogd.
+                    r[k] = (SM3_LANES_ROTL(r[k], 8) & 0x00FF00FF) | (SM3_LANES_ROTL(r[k], 24) & 0xFF00FF00);
+                }
+            }
+            if constexpr (N == 8) {
+                V t[8], u[8];
+                for (int k = 0; k < 8; k += 2) {
+                    t[k] = __builtin_shuffle(r[k], r[k + 1], V{0, 8, 1, 9, 4, 12, 5, 13});
+                    t[k + 1] = __builtin_shuffle(r[k], r[k + 1], V{2, 10, 3, 11, 6, 14, 7, 15});
+                }
+                for (int k = 0; k < 8; k += 4) {
+                    u[k] = __builtin_shuffle(t[k], t[k + 2], V{0, 1, 8, 9, 4, 5, 12, 13});
+                    u[k + 1] = __builtin_shuffle(t[k], t[k + 2], V{2, 3, 10, 11, 6, 7, 14, 15});
+                    u[k + 2] = __builtin_shuffle(t[k + 1], t[k + 3], V{0, 1, 8, 9, 4, 5, 12, 13});
+                    u[k + 3] = __builtin_shuffle(t[k + 1], t[k + 3], V{2, 3, 10, 11, 6, 7, 14, 15});
+                }
+                for (int m = 0; m < 4; ++m) {
+                    block[8 * part + m] = __builtin_shuffle(u[m], u[m + 4], V{0, 1, 2, 3, 8, 9, 10, 11});
+                    block[8 * part + m + 4] = __builtin_shuffle(u[m], u[m + 4], V{4, 5, 6, 7, 12, 13, 14, 15});
+                }
+            } else {
+                for (int round = 0; round < 4; ++round) {
+                    V t[16];
+                    for (int k = 0; k < 8; ++k) {
+                        t[2 * k] = __builtin_shuffle(r[k], r[k + 8],
+                                                     V{0, 16, 1, 17, 2, 18, 3, 19, 4, 20, 5, 21, 6, 22, 7, 23});
+                        t[2 * k + 1] = __builtin_shuffle(r[k], r[k + 8],
+                                                         V{8, 24, 9, 25, 10, 26, 11, 27, 12, 28, 13, 29, 14, 30, 15, 31});
+                    }
+                    for (int k = 0; k < 16; ++k) {
+                        r[k] = t[k];
+                    }
+                }
+                for (int i = 0; i < 16; ++i) {
+                    block[i] = r[i];
+                }
+            }
+        }
+    }
+
+    template <typename V>
+    static inline __attribute__((always_inline)) void CompressLanes(V* state, const V* block) {
+        V W[68];
+        for (int i = 0; i < 16; ++i) {
+            W[i] = block[i];
+        }
+        for (int i = 16; i < 68; ++i) {
+            W[i] = SM3_LANES_P1(W[i - 16] ^ W[i - 9] ^ SM3_LANES_ROTL(W[i - 3], 15)) ^
+                   SM3_LANES_ROTL(W[i - 13], 7) ^ W[i - 6];
+        }
+
+        V A = state[0], B = state[1], C = state[2], D = state[3];
+        V E = state[4], F = state[5], G = state[6], H = state[7];
+
+        for (int j = 0; j < 16; ++j) {
+            V A12 = SM3_LANES_ROTL(A, 12);
+            V SS1 = SM3_LANES_ROTL(A12 + E + SM3_RoundConstants[j], 7);
+            V SS2 = SS1 ^ A12;
+            V TT1 = (A ^ B ^ C) + D + SS2 + (W[j] ^ W[j + 4]);
+            V TT2 = (E ^ F ^ G) + H + SS1 + W[j];
+            D = C; C = SM3_LANES_ROTL(B, 9); B = A; A = TT1;
+            H = G; G = SM3_LANES_ROTL(F, 19); F = E; E = SM3_LANES_P0(TT2);
+        }
+        for (int j = 16; j < 64; ++j) {
+            V A12 = SM3_LANES_ROTL(A, 12);
+            V SS1 = SM3_LANES_ROTL(A12 + E + SM3_RoundConstants[j], 7);
+            V SS2 = SS1 ^ A12;
+            V TT1 = ((A & B) | (A & C) | (B & C)) + D + SS2 + (W[j] ^ W[j + 4]);
+            V TT2 = ((E & F) | (~E & G)) + H + SS1 + W[j];
+            D = C; C = SM3_LANES_ROTL(B, 9); B = A; A = TT1;
+            H = G; G = SM3_LANES_ROTL(F, 19); F = E; E = SM3_LANES_P0(TT2);
+        }
+
+        state[0] ^= A; state[1] ^= B; state[2] ^= C; state[3] ^= D;
+        state[4] ^= E; state[5] ^= F; state[6] ^= G; state[7] ^= H;
+    }
+
+    // Per-lane bookkeeping: whole blocks are read in place from the caller's
+    // buffer, the padded tail (one or two blocks) from the lane's own copy.
+    template <int N>
+    struct LaneJobs {
+        size_t message[N];
+        const uint8_t* next[N];
+        size_t fullBlocks[N];
+        size_t blocks[N];
+        alignas(64) uint8_t tail[N][128];
+    };
+
+    template <int N>
+    static inline void LoadLane(LaneJobs<N>& jobs, int lane, const SM3_Message* messages, size_t index,
+                                const uint64_t* prefixLengths, uint64_t prefixLength) {
+        const SM3_Message& m = messages[index];
+        if (prefixLengths) {
+            prefixLength = prefixLengths[index];
+        }
+        size_t full = m.length / 64;
+        size_t rest = m.length % 64;
+        uint8_t* tail = jobs.tail[lane];
+        std::memset(tail, 0, 128);
+        if (rest) {
+            std::memcpy(tail, m.data + full * 64, rest);
+        }
+        tail[rest] = 0x80;
+        size_t tailBlocks = (rest + 9 <= 64) ? 1 : 2;
+        uint64_t bits = (prefixLength + m.length) * 8;
+        for (int i = 0; i < 8; ++i) {
+            tail[tailBlocks * 64 - 1 - i] = static_cast<uint8_t>(bits >> (i * 8));
+        }
+        jobs.message[lane] = index;
+        jobs.next[lane] = full ? m.data : tail;
+        jobs.fullBlocks[lane] = full;
+        jobs.blocks[lane] = full + tailBlocks;
+        SM3_STATS_COUNT(N == 16 ? SM3_Engine::LanesAVX512 : SM3_Engine::LanesAVX2, m.length, full + tailBlocks);
+    }
+
+    template <typename V, int N>
+    static inline __attribute__((always_inline)) void HashLanes(const uint32_t* chain,
+                                                                const uint64_t* prefixLengths,
+                                                                uint64_t prefixLength,
+                                                                const SM3_Message* messages, size_t count,
+                                                                uint8_t* digests) {
+        LaneJobs<N> jobs;
+        V state[8];
+        size_t pending = 0;
+        int active = 0;
+
+        for (int lane = 0; lane < N; ++lane) {
+            if (pending < count) {
+                LoadLane(jobs, lane, messages, pending++, prefixLengths, prefixLength);
+                for (int k = 0; k < 8; ++k) {
+                    state[k][lane] = chain[k];
+                }
+                ++active;
+            } else {
+                jobs.message[lane] = noMessage;
+                std::memset(jobs.tail[lane], 0, sizeof(jobs.tail[lane]));
+                for (int k = 0; k < 8; ++k) {
+                    state[k][lane] = 0;
+                }
+            }
+        }
+
+        const uint8_t* next[N];
+        V block[16];
+        while (active > 0) {
+            for (int lane = 0; lane < N; ++lane) {
+                next[lane] = jobs.message[lane] == noMessage ? jobs.tail[lane] : jobs.next[lane];
+            }
+            LoadBlocks<V, N>(block, next);
+
+            CompressLanes(state, block);
+
+            for (int lane = 0; lane < N; ++lane) {
+                if (jobs.message[lane] == noMessage) {
+                    continue;
+                }
+                if (--jobs.blocks[lane]) {
+                    if (jobs.fullBlocks[lane]) {
+                        --jobs.fullBlocks[lane];
+                        jobs.next[lane] = jobs.fullBlocks[lane] ? jobs.next[lane] + 64 : jobs.tail[lane];
+                    } else {
+                        jobs.next[lane] += 64;
+                    }
+                    continue;
+                }
+                uint8_t* out = digests + 32 * jobs.message[lane];
+                for (int k = 0; k < 8; ++k) {
+                    StoreBE32(out + 4 * k, state[k][lane]);
+                }
+                if (pending < count) {
+                    LoadLane(jobs, lane, messages, pending++, prefixLengths, prefixLength);
+                    for (int k = 0; k < 8; ++k) {
+                        state[k][lane] = chain[k];
+                    }
+                } else {
+                    jobs.message[lane] = noMessage;
+                    --active;
+                }
+            }
+        }
+    }
+
+#undef SM3_LANES_P1
+#undef SM3_LANES_P0
+#undef SM3_LANES_ROTL
+
+    __attribute__((target("avx512f")))
+    static void HashBatchAVX512(const uint32_t* chain, const uint64_t* prefixLengths, uint64_t prefixLength,
+                                const SM3_Message* messages, size_t count, uint8_t* digests) {
+        SM3_STATS_SCOPE(Lanes);
+        HashLanes<Vec16, 16>(chain, prefixLengths, prefixLength, messages, count, digests);
+    }
+
+    __attribute__((target("avx2")))
+    static void HashBatchAVX2(const uint32_t* chain, const uint64_t* prefixLengths, uint64_t prefixLength,
+                              const SM3_Message* messages, size_t count, uint8_t* digests) {
+        SM3_STATS_SCOPE(Lanes);
+        HashLanes<Vec8, 8>(chain, prefixLengths, prefixLength, messages, count, digests);
+    }
+
+    static void HashBatchScalar(const uint32_t* chain, const uint64_t* prefixLengths, uint64_t prefixLength,
+                                const SM3_Message* messages, size_t count, uint8_t* digests) {
+        for (size_t i = 0; i < count; ++i) {
+            SM3_Algorithm hasher(chain, prefixLengths ? prefixLengths[i] : prefixLength);
+            hasher.Update(messages[i].data, messages[i].length);
+            SM3_Digest digest = hasher.Finalize();
+            std::memcpy(digests + 32 * i, digest.data(), 32);
+        }
+    }
+};
@@ -0,0 +1,586 @@
+#pragma once
+
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+#include "sm3.h"
+#include "sm3_leaf_index.h"
+#include "sm3_mb.h"
+#include "thread_pool.h"
+
+// RFC 6962 Merkle tree on SM3. Leaves hash as SM3(0x00 || d), interior nodes as
+// SM3(0x01 || left || right). Every level is kept as one contiguous array; an
+// unpaired last node is carried up unchanged, which gives exactly the RFC 6962
+// split at the largest power of two below n. Proofs are read from the stored
+// levels, the tree is never rebuilt to answer one.
+class SM3_MerkleTree {
+public:
+    struct InclusionProof {
+        size_t leafIndex = 0;
+        size_t treeSize = 0;
+        std::vector<SM3_Digest> auditPath;
+    };
+
+    // Non-inclusion needs a tree built with sortLeaves: the absent key's leaf hash
+    // falls strictly between two adjacent leaves, both proven by inclusion. At the
+    // ends of the tree only one neighbour exists. The neighbours are found through
+    // a SM3_LeafIndex built with the sorted leaves.
+    struct NonInclusionProof {
+        bool hasLeft = false;
+        bool hasRight = false;
+        SM3_Digest leftHash{};
+        SM3_Digest rightHash{};
+        InclusionProof left;
+        InclusionProof right;
+    };
+
+    // RFC 6962 PROOF(m, D[n]): the first oldSize leaves of the newSize tree are
+    // the whole of the older tree.
+    struct ConsistencyProof {
+        size_t oldSize = 0;
+        size_t newSize = 0;
+        std::vector<SM3_Digest> path;
+    };
+
+    // Inclusion of several leaves in one tree. Siblings that lie on more than one
+    // audit path, or that are themselves computed from proven leaves, appear at
+    // most once: nodes holds only what the verifier cannot derive, in the order a
+    // bottom-up, left-to-right walk over the proven leaves asks for them.
+    struct MultiProof {
+        size_t treeSize = 0;
+        std::vector<size_t> leafIndices;
+        std::vector<SM3_Digest> nodes;
+    };
+
+    static SM3_Digest LeafHash(const uint8_t* data, size_t length) {
+        const uint8_t prefix = 0x00;
+        SM3_Algorithm hasher;
+        hasher.Update(&prefix, 1);
+        hasher.Update(data, length);
+        return hasher.Finalize();
+    }
+
+    static SM3_Digest LeafHash(const std::string& data) {
+        return LeafHash(reinterpret_cast<const uint8_t*>(data.data()), data.size());
+    }
+
+    static SM3_Digest NodeHash(const SM3_Digest& left, const SM3_Digest& right) {
+        uint8_t node[65];
+        node[0] = 0x01;
+        std::memcpy(node + 1, left.data(), 32);
+        std::memcpy(node + 33, right.data(), 32);
+        SM3_Algorithm hasher;
+        hasher.Update(node, sizeof(node));
+        return hasher.Finalize();
+    }
+
+    // Leaf hashes of a chunk of messages through the multi-buffer engine: prefix
+    // each leaf into one scratch buffer, then hash the whole chunk in one batch.
+    static void HashLeaves(const SM3_Message* leaves, size_t count, SM3_Digest* out) {
+        size_t total = 0;
+        for (size_t i = 0; i < count; ++i) {
+            total += leaves[i].length + 1;
+        }
+        std::vector<uint8_t> scratch(total);
+        std::vector<SM3_Message> messages(count);
+        uint8_t* p = scratch.data();
+        for (size_t i = 0; i < count; ++i) {
+            p[0] = 0x00;
+            if (leaves[i].length) {
+                std::memcpy(p + 1, leaves[i].data, leaves[i].length);
+            }
+            messages[i] = {p, leaves[i].length + 1};
+            p += leaves[i].length + 1;
+        }
+        SM3_MultiBuffer::HashBatch(messages.data(), count, out->data());
+    }
+
+    void Build(const SM3_Message* leaves, size_t count, bool sortLeaves = false,
+               ThreadPool& pool = ThreadPool::Shared()) {
+        std::vector<SM3_Digest> hashes(count);
+        pool.ParallelFor(count, leafGrain, [&](size_t begin, size_t end) {
+            HashLeaves(leaves + begin, end - begin, hashes.data() + begin);
+        });
+        BuildFromLeafHashes(std::move(hashes), sortLeaves, pool);
+    }
+
+    void Build(const std::vector<std::string>& leaves, bool sortLeaves = false,
+               ThreadPool& pool = ThreadPool::Shared()) {
+        std::vector<SM3_Message> messages(leaves.size());
+        for (size_t i = 0; i < leaves.size(); ++i) {
+            messages[i] = {reinterpret_cast<const uint8_t*>(leaves[i].data()), leaves[i].size()};
+        }
+        Build(messages.data(), messages.size(), sortLeaves, pool);
+    }
+
+    void BuildFromLeafHashes(std::vector<SM3_Digest> leafHashes, bool sortLeaves = false,
+                             ThreadPool& pool = ThreadPool::Shared()) {
+        if (sortLeaves) {
+            std::sort(leafHashes.begin(), leafHashes.end(), DigestLess);
+        }
+        sorted = sortLeaves;
+        levels.clear();
+        levels.push_back(std::move(leafHashes));
+        leafIndex.Build(levels[0].data(), sortLeaves ? levels[0].size() : 0);
+        while (levels.back().size() > 1) {
+            const std::vector<SM3_Digest>& below = levels.back();
+            std::vector<SM3_Digest> level((below.size() + 1) / 2);
+            size_t pairs = below.size() / 2;
+            pool.ParallelFor(pairs, nodeGrain, [&](size_t begin, size_t end) {
+                HashNodes(below.data() + 2 * begin, end - begin, level.data() + begin);
+            });
+            if (below.size() % 2) {
+                level.back() = below.back();
+            }
+            levels.push_back(std::move(level));
+        }
+    }
+
+    size_t Size() const {
+        return levels.empty() ? 0 : levels[0].size();
+    }
+
+    // MTH of the empty tree is SM3 of the empty string.
+    SM3_Digest Root() const {
+        if (Size() == 0) {
+            return SM3_Algorithm().Finalize();
+        }
+        return levels.back()[0];
+    }
+
+    const SM3_Digest& Leaf(size_t index) const {
+        return levels.at(0).at(index);
+    }
+
+    const std::vector<SM3_Digest>& Level(size_t depth) const {
+        return levels.at(depth);
+    }
+
+    size_t Depth() const {
+        return levels.size();
+    }
+
+    // RFC 6962 PATH(m, D[n]), ordered from the leaf's sibling up to the root.
+    std::vector<SM3_Digest> AuditPath(size_t index) const {
+        if (index >= Size()) {
+            throw std::out_of_range("SM3_MerkleTree::AuditPath: leaf index out of range");
+        }
+        std::vector<SM3_Digest> path;
+        for (size_t depth = 0; depth + 1 < levels.size(); ++depth, index /= 2) {
+            size_t sibling = index ^ 1;
+            if (sibling < levels[depth].size()) {
+                path.push_back(levels[depth][sibling]);
+            }
+        }
+        return path;
+    }
+
+    InclusionProof ProveInclusion(size_t index) const {
+        InclusionProof proof;
+        proof.leafIndex = index;
+        proof.treeSize = Size();
+        proof.auditPath = AuditPath(index);
+        return proof;
+    }
+
+    // Returns false if the key is a leaf of the tree, i.e. there is nothing to prove.
+    bool ProveNonInclusion(const uint8_t* data, size_t length, NonInclusionProof& proof) const {
+        if (!sorted) {
+            throw std::logic_error("SM3_MerkleTree::ProveNonInclusion: tree was not built with sorted leaves");
+        }
+        SM3_Digest key = LeafHash(data, length);
+        bool absent;
+        ProveNonInclusion(&key, 1, &proof, &absent);
+        return absent;
+    }
+
+    bool ProveNonInclusion(const std::string& data, NonInclusionProof& proof) const {
+        return ProveNonInclusion(reinterpret_cast<const uint8_t*>(data.data()), data.size(), proof);
+    }
+
+    // Where each key's leaf hash would sit among the sorted leaves: the index of
+    // the first leaf not below it, whose left neighbour is the one before.
+    void Locate(const SM3_Digest* keyHashes, size_t count, size_t* indices) const {
+        if (!sorted) {
+            throw std::logic_error("SM3_MerkleTree::Locate: tree was not built with sorted leaves");
+        }
+        leafIndex.LowerBound(levels.empty() ? nullptr : levels[0].data(), keyHashes, count, indices);
+    }
+
+    // Many keys, given as leaf hashes: the index lookups run interleaved, then
+    // absent[i] and proofs[i] are filled as for a single key.
+    void ProveNonInclusion(const SM3_Digest* keyHashes, size_t count, NonInclusionProof* proofs,
+                           bool* absent) const {
+        if (!sorted) {
+            throw std::logic_error("SM3_MerkleTree::ProveNonInclusion: tree was not built with sorted leaves");
+        }
+        const std::vector<SM3_Digest>& leaves = levels.empty() ? noLeaves : levels[0];
+        std::vector<size_t> indices(count);
+        Locate(keyHashes, count, indices.data());
+        for (size_t i = 0; i < count; ++i) {
+            size_t index = indices[i];
+            absent[i] = !(index < leaves.size() && leaves[index] == keyHashes[i]);
+            if (!absent[i]) {
+                continue;
+            }
+            NonInclusionProof& proof = proofs[i];
+            proof = NonInclusionProof();
+            if (index > 0) {
+                proof.hasLeft = true;
+                proof.leftHash = leaves[index - 1];
+            }
+            if (index < leaves.size()) {
+                proof.hasRight = true;
+                proof.rightHash = leaves[index];
+            }
+            if (proof.hasLeft && proof.hasRight) {
+                AdjacentProofs(index - 1, proof.left, proof.right);
+            } else if (proof.hasLeft) {
+                proof.left = ProveInclusion(index - 1);
+            } else if (proof.hasRight) {
+                proof.right = ProveInclusion(index);
+            }
+        }
+    }
+
+    // RFC 9162 section 2.1.3.2 verification of an audit path.
+    static bool VerifyInclusion(const SM3_Digest& leafHash, const InclusionProof& proof,
+                                const SM3_Digest& root) {
+        if (proof.leafIndex >= proof.treeSize) {
+            return false;
+        }
+        size_t fn = proof.leafIndex;
+        size_t sn = proof.treeSize - 1;
+        SM3_Digest r = leafHash;
+        for (const SM3_Digest& p : proof.auditPath) {
+            if (sn == 0) {
+                return false;
+            }
+            if ((fn & 1) || fn == sn) {
+                r = NodeHash(p, r);
+                while (!(fn & 1) && fn != 0) {
+                    fn >>= 1;
+                    sn >>= 1;
+                }
+            } else {
+                r = NodeHash(r, p);
+            }
+            fn >>= 1;
+            sn >>= 1;
+        }
+        return sn == 0 && r == root;
+    }
+
+    static bool VerifyNonInclusion(const uint8_t* data, size_t length, const NonInclusionProof& proof,
+                                   const SM3_Digest& root, size_t treeSize) {
+        SM3_Digest key = LeafHash(data, length);
+        if (!proof.hasLeft && !proof.hasRight) {
+            return treeSize == 0;
+        }
+        if (proof.hasLeft && !(proof.leftHash < key && proof.left.treeSize == treeSize &&
+                               VerifyInclusion(proof.leftHash, proof.left, root))) {
+            return false;
+        }
+        if (proof.hasRight && !(key < proof.rightHash && proof.right.treeSize == treeSize &&
+                                VerifyInclusion(proof.rightHash, proof.right, root))) {
+            return false;
+        }
+        if (proof.hasLeft && proof.hasRight) {
+            return proof.right.leafIndex == proof.left.leafIndex + 1;
+        }
+        return proof.hasLeft ? proof.left.leafIndex == treeSize - 1 : proof.right.leafIndex == 0;
+    }
+
+    static bool VerifyNonInclusion(const std::string& data, const NonInclusionProof& proof,
+                                   const SM3_Digest& root, size_t treeSize) {
+        return VerifyNonInclusion(reinterpret_cast<const uint8_t*>(data.data()), data.size(), proof,
+                                  root, treeSize);
+    }
+
+    // PROOF(oldSize, D[Size()]); both sizes may be equal, and oldSize may be 0.
+    ConsistencyProof ProveConsistency(size_t oldSize) const {
+        if (oldSize > Size()) {
+            throw std::out_of_range("SM3_MerkleTree::ProveConsistency: old size beyond the tree");
+        }
+        return ConsistencyFrom(oldSize, Size(), [this](size_t start, size_t size) {
+            return SubtreeHash(start, size);
+        });
+    }
+
+    // RFC 9162 section 2.1.4.2 verification of a consistency proof.
+    static bool VerifyConsistency(const ConsistencyProof& proof, const SM3_Digest& oldRoot,
+                                  const SM3_Digest& newRoot) {
+        if (proof.oldSize > proof.newSize) {
+            return false;
+        }
+        if (proof.oldSize == proof.newSize) {
+            return proof.path.empty() && oldRoot == newRoot;
+        }
+        if (proof.oldSize == 0) {
+            return proof.path.empty();
+        }
+        if (proof.path.empty()) {
+            return false;
+        }
+        std::vector<SM3_Digest> path;
+        if ((proof.oldSize & (proof.oldSize - 1)) == 0) {
+            path.push_back(oldRoot);
+        }
+        path.insert(path.end(), proof.path.begin(), proof.path.end());
+        size_t fn = proof.oldSize - 1;
+        size_t sn = proof.newSize - 1;
+        while (fn & 1) {
+            fn >>= 1;
+            sn >>= 1;
+        }
+        SM3_Digest fr = path[0];
+        SM3_Digest sr = path[0];
+        for (size_t i = 1; i < path.size(); ++i) {
+            if (sn == 0) {
+                return false;
+            }
+            if ((fn & 1) || fn == sn) {
+                fr = NodeHash(path[i], fr);
+                sr = NodeHash(path[i], sr);
+                while (!(fn & 1) && fn != 0) {
+                    fn >>= 1;
+                    sn >>= 1;
+                }
+            } else {
+                sr = NodeHash(sr, path[i]);
+            }
+            fn >>= 1;
+            sn >>= 1;
+        }
+        return sn == 0 && fr == oldRoot && sr == newRoot;
+    }
+
+    // One proof for all of `indices` (any order, duplicates dropped).
+    MultiProof ProveMultiInclusion(std::vector<size_t> indices) const {
+        return MultiProofFrom(std::move(indices), Size(), [this](size_t start, size_t size) {
+            return SubtreeHash(start, size);
+        });
+    }
+
+    // leafHashes[i] is the hash of leaf proof.leafIndices[i]. The walk goes up a
+    // level at a time, so every internal node on the union of the audit paths is
+    // hashed once, and each level's nodes go through SM3_MultiBuffer together.
+    static bool VerifyMultiInclusion(const std::vector<SM3_Digest>& leafHashes, const MultiProof& proof,
+                                     const SM3_Digest& root) {
+        const std::vector<size_t>& indices = proof.leafIndices;
+        if (indices.empty() || leafHashes.size() != indices.size() || indices.back() >= proof.treeSize) {
+            return false;
+        }
+        for (size_t i = 1; i < indices.size(); ++i) {
+            if (indices[i - 1] >= indices[i]) {
+                return false;
+            }
+        }
+        std::vector<size_t> position(indices);
+        std::vector<SM3_Digest> known(leafHashes);
+        std::vector<uint8_t> scratch;
+        std::vector<SM3_Message> messages;
+        size_t used = 0;
+        for (size_t width = proof.treeSize; width > 1; width = (width + 1) / 2) {
+            // Parents first as 65-byte messages (or carried nodes), hashed in one batch.
+            std::vector<size_t> parents;
+            std::vector<SM3_Digest> carried;
+            std::vector<ptrdiff_t> slot;
+            scratch.resize(65 * known.size());
+            messages.clear();
+            for (size_t j = 0; j < position.size(); ++j) {
+                size_t i = position[j];
+                parents.push_back(i / 2);
+                if (!(i & 1) && i + 1 == width) {
+                    slot.push_back(-1 - static_cast<ptrdiff_t>(carried.size()));
+                    carried.push_back(known[j]);
+                    continue;
+                }
+                const SM3_Digest* left;
+                const SM3_Digest* right;
+                if (!(i & 1) && j + 1 < position.size() && position[j + 1] == i + 1) {
+                    left = &known[j];
+                    right = &known[++j];
+                } else if (used < proof.nodes.size()) {
+                    left = (i & 1) ? &proof.nodes[used] : &known[j];
+                    right = (i & 1) ? &known[j] : &proof.nodes[used];
+                    ++used;
+                } else {
+                    return false;
+                }
+                uint8_t* p = scratch.data() + 65 * messages.size();
+                p[0] = 0x01;
+                std::memcpy(p + 1, left->data(), 32);
+                std::memcpy(p + 33, right->data(), 32);
+                slot.push_back(static_cast<ptrdiff_t>(messages.size()));
+                messages.push_back({p, 65});
+            }
+            std::vector<SM3_Digest> hashed(messages.size());
+            if (!messages.empty()) {
+                SM3_MultiBuffer::HashBatch(messages.data(), messages.size(), hashed[0].data());
+            }
+            known.resize(parents.size());
+            for (size_t j = 0; j < parents.size(); ++j) {
+                known[j] = slot[j] >= 0 ? hashed[slot[j]] : carried[-1 - slot[j]];
+            }
+            position = std::move(parents);
+        }
+        return used == proof.nodes.size() && known[0] == root;
+    }
+
+private:
+    friend class SM3_MerkleLog;
+
+    static constexpr size_t leafGrain = 4096;
+    static constexpr size_t nodeGrain = 4096;
+
+    inline static const std::vector<SM3_Digest> noLeaves;
+
+    std::vector<std::vector<SM3_Digest>> levels;
+    bool sorted = false;
+    SM3_LeafIndex leafIndex;
+
+    // Audit paths of leaves left and left + 1 in one walk up the levels: below the
+    // level where the two meet each has its own sibling, above it they share them.
+    void AdjacentProofs(size_t left, InclusionProof& a, InclusionProof& b) const {
+        a = InclusionProof();
+        b = InclusionProof();
+        a.leafIndex = left;
+        b.leafIndex = left + 1;
+        a.treeSize = b.treeSize = Size();
+        a.auditPath.reserve(levels.size());
+        b.auditPath.reserve(levels.size());
+        // Every sibling's address is known up front: start all the loads at once.
+        for (size_t depth = 0; depth + 1 < levels.size(); ++depth) {
+            __builtin_prefetch(levels[depth].data() + ((left >> depth) ^ 1));
+            __builtin_prefetch(levels[depth].data() + (((left + 1) >> depth) ^ 1));
+        }
+        size_t l = left;
+        size_t r = left + 1;
+        for (size_t depth = 0; depth + 1 < levels.size(); ++depth, l /= 2, r /= 2) {
+            const std::vector<SM3_Digest>& level = levels[depth];
+            if ((l ^ 1) < level.size()) {
+                a.auditPath.push_back(level[l ^ 1]);
+            }
+            if (l == r) {
+                if ((l ^ 1) < level.size()) {
+                    b.auditPath.push_back(level[l ^ 1]);
+                }
+            } else if ((r ^ 1) < level.size()) {
+                b.auditPath.push_back(level[r ^ 1]);
+            }
+        }
+    }
+
+    // MTH(D[start : start + size]) from the stored levels: node i of level L covers
+    // leaves [i * 2^L, min((i + 1) * 2^L, n)), so an aligned range that is either
+    // whole or runs to the end of the tree is read directly, anything else splits
+    // at the RFC 6962 point. Proofs against a smaller tree size need the split.
+    SM3_Digest SubtreeHash(size_t start, size_t size) const {
+        int level = size > 1 ? 64 - __builtin_clzll(size - 1) : 0;
+        if ((start & ((size_t(1) << level) - 1)) == 0 &&
+            (size == (size_t(1) << level) || start + size == Size())) {
+            return levels[level][start >> level];
+        }
+        size_t k = size_t(1) << (level - 1);
+        return NodeHash(SubtreeHash(start, k), SubtreeHash(start + k, size - k));
+    }
+
+    // RFC 6962 SUBPROOF(m, D[n], true), given MTH of any range the recursion
+    // reaches. Shared with SM3_MerkleLog, which stores the same tree differently.
+    template <typename Subtree>
+    static ConsistencyProof ConsistencyFrom(size_t oldSize, size_t newSize, Subtree&& subtree) {
+        ConsistencyProof proof;
+        proof.oldSize = oldSize;
+        proof.newSize = newSize;
+        if (oldSize == 0 || oldSize == newSize) {
+            return proof;
+        }
+        // Walk down recording the siblings, then emit them bottom-up.
+        std::vector<SM3_Digest> siblings;
+        size_t start = 0;
+        size_t size = newSize;
+        size_t m = oldSize;
+        bool whole = true;
+        while (m != size) {
+            size_t k = size_t(1) << (63 - __builtin_clzll(size - 1));
+            if (m <= k) {
+                siblings.push_back(subtree(start + k, size - k));
+                size = k;
+            } else {
+                siblings.push_back(subtree(start, k));
+                start += k;
+                size -= k;
+                m -= k;
+                whole = false;
+            }
+        }
+        if (!whole) {
+            proof.path.push_back(subtree(start, size));
+        }
+        proof.path.insert(proof.path.end(), siblings.rbegin(), siblings.rend());
+        return proof;
+    }
+
+    // The siblings a VerifyMultiInclusion walk will ask for, in that order. Node i
+    // of a level spans the same leaves as in SubtreeHash.
+    template <typename Subtree>
+    static MultiProof MultiProofFrom(std::vector<size_t> indices, size_t treeSize, Subtree&& subtree) {
+        std::sort(indices.begin(), indices.end());
+        indices.erase(std::unique(indices.begin(), indices.end()), indices.end());
+        if (indices.empty() || indices.back() >= treeSize) {
+            throw std::out_of_range("SM3_MerkleTree::ProveMultiInclusion: leaf index out of range");
+        }
+        MultiProof proof;
+        proof.treeSize = treeSize;
+        proof.leafIndices = indices;
+        std::vector<size_t> position = std::move(indices);
+        int level = 0;
+        for (size_t width = treeSize; width > 1; width = (width + 1) / 2, ++level) {
+            std::vector<size_t> parents;
+            for (size_t j = 0; j < position.size(); ++j) {
+                size_t i = position[j];
+                parents.push_back(i / 2);
+                if (!(i & 1) && i + 1 == width) {
+                    continue;
+                }
+                if (!(i & 1) && j + 1 < position.size() && position[j + 1] == i + 1) {
+                    ++j;
+                    continue;
+                }
+                size_t sibling = i ^ 1;
+                size_t start = sibling << level;
+                proof.nodes.push_back(subtree(start, std::min(size_t(1) << level, treeSize - start)));
+            }
+            position = std::move(parents);
+        }
+        return proof;
+    }
+
+    // Same order as SM3_Digest::operator<, but decided on the first 64-bit word
+    // almost every time instead of byte by byte.
+    static bool DigestLess(const SM3_Digest& a, const SM3_Digest& b) {
+        uint64_t x, y;
+        std::memcpy(&x, a.data(), 8);
+        std::memcpy(&y, b.data(), 8);
+        if (x != y) {
+            return __builtin_bswap64(x) < __builtin_bswap64(y);
+        }
+        return std::memcmp(a.data() + 8, b.data() + 8, 24) < 0;
+    }
+
+    // Nodes go through the multi-buffer engine like leaves: prefix each input into
+    // one scratch buffer, then hash the whole chunk in a single batch.
+    static void HashNodes(const SM3_Digest* children, size_t pairs, SM3_Digest* out) {
+        std::vector<uint8_t> scratch(65 * pairs);
+        std::vector<SM3_Message> messages(pairs);
+        for (size_t i = 0; i < pairs; ++i) {
+            uint8_t* p = scratch.data() + 65 * i;
+            p[0] = 0x01;
+            std::memcpy(p + 1, children[2 * i].data(), 32);
+            std::memcpy(p + 33, children[2 * i + 1].data(), 32);
+            messages[i] = {p, 65};
+        }
+        SM3_MultiBuffer::HashBatch(messages.data(), pairs, out->data());
+    }
+};
@@ -0,0 +1,363 @@
+#pragma once
+
+#include <cerrno>
+#include <string>
+#include <system_error>
+#include <vector>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "sm3_merkle.h"
+
+// Append-only RFC 6962 Merkle log kept in a memory-mapped file, hashes identical
+// to SM3_MerkleTree over the same leaves in arrival order.
+//
+// Nodes are stored in post-order: each leaf is followed by the roots of the
+// subtrees it completes, so the file only ever grows at its end and the node for
+// level L, index k sits at a fixed position computed from (L, k). An append
+// writes the leaf and at most log2(n) parents, each hashed from two nodes already
+// on disk; the root and any audit path are read from the stored perfect subtrees
+// plus at most one combine per set bit of the tree size. Reopening maps the file
+// and serves proofs at once, nothing is rehashed.
+//
+// Sync() is the commit point: it flushes the nodes appended since the last one,
+// then records the leaf count in the header, so a crash leaves the log at its last
+// synced size. Appends not synced before the log is destroyed are dropped the
+// same way. A log has one writer: the file stays locked while it is open, and a
+// second SM3_MerkleLog on it, in this process or another, fails to construct.
+class SM3_MerkleLog {
+public:
+    explicit SM3_MerkleLog(const std::string& path) {
+        fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            throw std::system_error(errno, std::generic_category(), "SM3_MerkleLog: open " + path);
+        }
+        if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+            Fail("SM3_MerkleLog: lock " + path);
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            Fail("SM3_MerkleLog: fstat " + path);
+        }
+        size_t fileSize = static_cast<size_t>(st.st_size);
+        if (fileSize == 0) {
+            Header initial{};
+            std::memcpy(initial.magic, headerMagic, sizeof(initial.magic));
+            if (pwrite(fd, &initial, sizeof(initial), 0) != static_cast<ssize_t>(sizeof(initial))) {
+                Fail("SM3_MerkleLog: initialise " + path);
+            }
+            fileSize = sizeof(Header);
+        }
+        if (fileSize < sizeof(Header) || (fileSize - sizeof(Header)) % 32 != 0) {
+            Close();
+            throw std::invalid_argument("SM3_MerkleLog: " + path + " is not a Merkle log");
+        }
+        Map(fileSize);
+        if (std::memcmp(header->magic, headerMagic, sizeof(header->magic)) != 0 ||
+            NodeCount(header->leafCount) > capacity) {
+            Close();
+            throw std::invalid_argument("SM3_MerkleLog: " + path + " is not a Merkle log");
+        }
+        leafCount = header->leafCount;
+        syncedLeaves = leafCount;
+    }
+
+    ~SM3_MerkleLog() {
+        Close();
+    }
+
+    SM3_MerkleLog(const SM3_MerkleLog&) = delete;
+    SM3_MerkleLog& operator=(const SM3_MerkleLog&) = delete;
+
+    size_t Size() const {
+        return leafCount;
+    }
+
+    void Append(const uint8_t* data, size_t length) {
+        AppendLeafHash(SM3_MerkleTree::LeafHash(data, length));
+    }
+
+    void Append(const std::string& data) {
+        Append(reinterpret_cast<const uint8_t*>(data.data()), data.size());
+    }
+
+    // One leaf: store it, then walk up through the subtrees it completes. The
+    // left child of each new parent is the subtree root 2^L - 1 slots back.
+    void AppendLeafHash(const SM3_Digest& leafHash) {
+        Reserve(NodeCount(leafCount + 1));
+        size_t p = LeafPosition(leafCount);
+        nodes[p] = leafHash;
+        size_t parents = __builtin_ctzll(leafCount + 1);
+        for (size_t level = 1; level <= parents; ++level) {
+            nodes[p + 1] = SM3_MerkleTree::NodeHash(nodes[p - ((size_t(1) << level) - 1)], nodes[p]);
+            ++p;
+        }
+        ++leafCount;
+    }
+
+    // Many leaves at once: leaf hashes and then each level of completed parents
+    // go through the multi-buffer engine on the pool, level by level.
+    void Append(const SM3_Message* leaves, size_t count, ThreadPool& pool = ThreadPool::Shared()) {
+        std::vector<SM3_Digest> hashes(count);
+        pool.ParallelFor(count, batchGrain, [&](size_t begin, size_t end) {
+            SM3_MerkleTree::HashLeaves(leaves + begin, end - begin, hashes.data() + begin);
+        });
+        AppendLeafHashes(hashes.data(), count, pool);
+    }
+
+    void AppendLeafHashes(const SM3_Digest* leafHashes, size_t count, ThreadPool& pool = ThreadPool::Shared()) {
+        if (count < batchThreshold) {
+            for (size_t i = 0; i < count; ++i) {
+                AppendLeafHash(leafHashes[i]);
+            }
+            return;
+        }
+        size_t first = leafCount;
+        size_t last = leafCount + count;
+        Reserve(NodeCount(last));
+        for (size_t i = 0; i < count; ++i) {
+            nodes[LeafPosition(first + i)] = leafHashes[i];
+        }
+        // Level L gains the subtrees whose last leaf is new: k in [first >> L, last >> L).
+        for (int level = 1; (last >> level) > (first >> level); ++level) {
+            size_t begin = first >> level;
+            pool.ParallelFor((last >> level) - begin, batchGrain, [&](size_t from, size_t to) {
+                HashParents(level, begin + from, begin + to);
+            });
+        }
+        leafCount = last;
+    }
+
+    const SM3_Digest& Leaf(size_t index) const {
+        if (index >= leafCount) {
+            throw std::out_of_range("SM3_MerkleLog::Leaf: leaf index out of range");
+        }
+        return nodes[LeafPosition(index)];
+    }
+
+    // MTH of the first treeSize leaves; any size up to Size() can be asked for,
+    // since the log keeps every node it ever wrote.
+    SM3_Digest Root(size_t treeSize) const {
+        if (treeSize > leafCount) {
+            throw std::out_of_range("SM3_MerkleLog::Root: tree size beyond the log");
+        }
+        if (treeSize == 0) {
+            return SM3_Algorithm().Finalize();
+        }
+        return SubtreeHash(0, treeSize);
+    }
+
+    SM3_Digest Root() const {
+        return Root(leafCount);
+    }
+
+    // RFC 6962 PATH(m, D[n]) against any earlier tree size, in the same form as
+    // SM3_MerkleTree proofs so SM3_MerkleTree::VerifyInclusion checks it. The
+    // recursion is walked from the top: the sibling of the half holding m is
+    // either a stored perfect subtree or a suffix folded from them.
+    SM3_MerkleTree::InclusionProof ProveInclusion(size_t index, size_t treeSize) const {
+        if (treeSize > leafCount || index >= treeSize) {
+            throw std::out_of_range("SM3_MerkleLog::ProveInclusion: leaf index out of range");
+        }
+        SM3_MerkleTree::InclusionProof proof;
+        proof.leafIndex = index;
+        proof.treeSize = treeSize;
+        size_t start = 0;
+        size_t size = treeSize;
+        while (size > 1) {
+            size_t k = LargestPowerBelow(size);
+            if (index - start < k) {
+                proof.auditPath.push_back(SubtreeHash(start + k, size - k));
+                size = k;
+            } else {
+                proof.auditPath.push_back(SubtreeHash(start, k));
+                start += k;
+                size -= k;
+            }
+        }
+        std::reverse(proof.auditPath.begin(), proof.auditPath.end());
+        return proof;
+    }
+
+    SM3_MerkleTree::InclusionProof ProveInclusion(size_t index) const {
+        return ProveInclusion(index, leafCount);
+    }
+
+    // PROOF(oldSize, D[newSize]) between two sizes the log has passed through.
+    SM3_MerkleTree::ConsistencyProof ProveConsistency(size_t oldSize, size_t newSize) const {
+        if (oldSize > newSize || newSize > leafCount) {
+            throw std::out_of_range("SM3_MerkleLog::ProveConsistency: tree size beyond the log");
+        }
+        return SM3_MerkleTree::ConsistencyFrom(oldSize, newSize, [this](size_t start, size_t size) {
+            return SubtreeHash(start, size);
+        });
+    }
+
+    SM3_MerkleTree::MultiProof ProveMultiInclusion(std::vector<size_t> indices, size_t treeSize) const {
+        if (treeSize > leafCount) {
+            throw std::out_of_range("SM3_MerkleLog::ProveMultiInclusion: tree size beyond the log");
+        }
+        return SM3_MerkleTree::MultiProofFrom(std::move(indices), treeSize, [this](size_t start, size_t size) {
+            return SubtreeHash(start, size);
+        });
+    }
+
+    SM3_MerkleTree::MultiProof ProveMultiInclusion(std::vector<size_t> indices) const {
+        return ProveMultiInclusion(std::move(indices), leafCount);
+    }
+
+    // Makes every append so far durable and visible to the next open. Only the
+    // pages written since the last Sync() are flushed, and a grown file length
+    // is made durable, before the header that counts the new nodes.
+    void Sync() {
+        if (leafCount == syncedLeaves) {
+            return;
+        }
+        size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        size_t begin = (sizeof(Header) + 32 * NodeCount(syncedLeaves)) / page * page;
+        size_t end = sizeof(Header) + 32 * NodeCount(leafCount);
+        if (msync(map + begin, end - begin, MS_SYNC) != 0) {
+            throw std::system_error(errno, std::generic_category(), "SM3_MerkleLog::Sync: msync");
+        }
+        if (grown && fdatasync(fd) != 0) {
+            throw std::system_error(errno, std::generic_category(), "SM3_MerkleLog::Sync: fdatasync");
+        }
+        grown = false;
+        header->leafCount = leafCount;
+        if (msync(map, sizeof(Header), MS_SYNC) != 0) {
+            throw std::system_error(errno, std::generic_category(), "SM3_MerkleLog::Sync: msync");
+        }
+        syncedLeaves = leafCount;
+    }
+
+private:
+    struct Header {
+        char magic[8];
+        uint64_t leafCount;
+        uint8_t reserved[48];
+    };
+    static_assert(sizeof(Header) == 64, "nodes start 32-byte aligned after the header");
+
+    static constexpr char headerMagic[8] = {'S', 'M', '3', 'M', 'L', 'O', 'G', '1'};
+    static constexpr size_t batchThreshold = 64;
+    static constexpr size_t batchGrain = 4096;
+    static constexpr size_t initialCapacity = size_t(1) << 15;
+
+    int fd = -1;
+    uint8_t* map = nullptr;
+    size_t mapSize = 0;
+    Header* header = nullptr;
+    SM3_Digest* nodes = nullptr;
+    size_t capacity = 0;
+    size_t leafCount = 0;
+    // Leaf count in the header, as of the last Sync().
+    size_t syncedLeaves = 0;
+    // The file was extended since the last Sync() and its length is not yet
+    // known to be on disk.
+    bool grown = false;
+
+    static size_t NodeCount(size_t leaves) {
+        return 2 * leaves - __builtin_popcountll(leaves);
+    }
+
+    static size_t LeafPosition(size_t index) {
+        return 2 * index - __builtin_popcountll(index);
+    }
+
+    // The root of the perfect subtree over leaves [k * 2^level, (k + 1) * 2^level)
+    // follows its last leaf and the `level - 1` parents completed below it.
+    static size_t NodePosition(int level, size_t k) {
+        return LeafPosition(((k + 1) << level) - 1) + level;
+    }
+
+    // The largest power of two strictly below n > 1: the RFC 6962 split point.
+    static size_t LargestPowerBelow(size_t n) {
+        return size_t(1) << (63 - __builtin_clzll(n - 1));
+    }
+
+    // MTH(D[start : start + size]) for the ranges the RFC 6962 recursion yields:
+    // power-of-two ranges are aligned and stored, the rest split once more.
+    SM3_Digest SubtreeHash(size_t start, size_t size) const {
+        if ((size & (size - 1)) == 0) {
+            int level = __builtin_ctzll(size);
+            return nodes[NodePosition(level, start >> level)];
+        }
+        size_t k = LargestPowerBelow(size);
+        return SM3_MerkleTree::NodeHash(SubtreeHash(start, k), SubtreeHash(start + k, size - k));
+    }
+
+    // Parents k in [begin, end) of one level, in one multi-buffer batch. The right
+    // child sits just before its parent, the left one a whole subtree further back.
+    void HashParents(int level, size_t begin, size_t end) {
+        size_t count = end - begin;
+        std::vector<uint8_t> scratch(65 * count);
+        std::vector<SM3_Message> messages(count);
+        std::vector<SM3_Digest> parents(count);
+        for (size_t i = 0; i < count; ++i) {
+            size_t right = NodePosition(level, begin + i) - 1;
+            size_t left = right - ((size_t(1) << level) - 1);
+            uint8_t* p = scratch.data() + 65 * i;
+            p[0] = 0x01;
+            std::memcpy(p + 1, nodes[left].data(), 32);
+            std::memcpy(p + 33, nodes[right].data(), 32);
+            messages[i] = {p, 65};
+        }
+        SM3_MultiBuffer::HashBatch(messages.data(), count, parents[0].data());
+        for (size_t i = 0; i < count; ++i) {
+            nodes[NodePosition(level, begin + i)] = parents[i];
+        }
+    }
+
+    // Grows the file, and its mapping with it, by doubling.
+    void Reserve(size_t needed) {
+        if (needed <= capacity) {
+            return;
+        }
+        size_t newCapacity = std::max(needed, std::max(2 * capacity, initialCapacity));
+        size_t size = sizeof(Header) + 32 * newCapacity;
+        if (ftruncate(fd, static_cast<off_t>(size)) != 0) {
+            throw std::system_error(errno, std::generic_category(), "SM3_MerkleLog::Reserve: ftruncate");
+        }
+        grown = true;
+        void* p = mremap(map, mapSize, size, MREMAP_MAYMOVE);
+        if (p == MAP_FAILED) {
+            throw std::system_error(errno, std::generic_category(), "SM3_MerkleLog::Reserve: mremap");
+        }
+        SetMapping(p, size);
+    }
+
+    void Map(size_t size) {
+        void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED) {
+            Fail("SM3_MerkleLog: mmap");
+        }
+        SetMapping(p, size);
+    }
+
+    void SetMapping(void* p, size_t size) {
+        map = static_cast<uint8_t*>(p);
+        mapSize = size;
+        header = reinterpret_cast<Header*>(map);
+        nodes = reinterpret_cast<SM3_Digest*>(map + sizeof(Header));
+        capacity = (size - sizeof(Header)) / 32;
+    }
+
+    [[noreturn]] void Fail(const std::string& what) {
+        int error = errno;
+        Close();
+        throw std::system_error(error, std::generic_category(), what);
+    }
+
+    void Close() {
+        if (map) {
+            munmap(map, mapSize);
+            map = nullptr;
+        }
+        if (fd >= 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+};
@@ -0,0 +1,401 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <climits>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+#include <linux/futex.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "sm3.h"
+#include "sm3_mb.h"
+
+// In-process hashing service for many threads that each hash short messages.
+// Submit() links the request into a lock-free multi-producer queue and returns a
+// Future; one batcher thread drains the queue, sorts requests into buckets by
+// padded block count, and hands each bucket to SM3_MultiBuffer as soon as it can
+// fill every lane, so messages in one call finish together. A bucket that cannot
+// fill the lanes waits at most maxWait from its oldest request, which bounds the
+// latency a lone request pays for the chance of company. std::future is not used:
+// its shared state and once-flag cost several times what SM3_MultiBuffer spends
+// hashing a short message, so the digest is published in the request node itself
+// and a waiting reader sleeps on a futex. For the same reason request nodes are
+// carved from per-thread slabs rather than allocated one at a time, and message
+// bytes are never copied.
+class SM3_HashService {
+public:
+    struct Options {
+        std::chrono::microseconds maxWait{50};
+        // Most messages handed to one HashBatch call, rounded down to a lane
+        // multiple; also how many requests one pass takes off the queue.
+        size_t maxBatch = 256;
+        SM3_MultiBuffer::Width width = SM3_MultiBuffer::Width::Auto;
+    };
+
+    struct Counters {
+        uint64_t requests = 0;
+        uint64_t batches = 0;
+        // Batches dispatched short of a lane multiple because maxWait expired.
+        uint64_t partialBatches = 0;
+    };
+
+private:
+    struct Request;
+
+public:
+    // Handle to one submitted message. Get() blocks until the digest is published;
+    // a handle dropped unread leaves its request to the batcher to free.
+    class Future {
+    public:
+        Future() = default;
+        Future(Future&& other) noexcept : request(other.request) {
+            other.request = nullptr;
+        }
+        Future& operator=(Future&& other) noexcept {
+            if (this != &other) {
+                Release();
+                request = other.request;
+                other.request = nullptr;
+            }
+            return *this;
+        }
+        ~Future() {
+            Release();
+        }
+
+        bool Valid() const {
+            return request != nullptr;
+        }
+
+        bool Ready() const {
+            return request->state.load(std::memory_order_acquire) == done;
+        }
+
+        const SM3_Digest& Get() const {
+            for (;;) {
+                uint32_t state = request->state.load(std::memory_order_acquire);
+                if (state == done) {
+                    return request->digest;
+                }
+                if (state == waiting ||
+                    request->state.compare_exchange_weak(state, waiting, std::memory_order_acquire)) {
+                    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&request->state), FUTEX_WAIT_PRIVATE, waiting,
+                            nullptr, nullptr, 0);
+                }
+            }
+        }
+
+    private:
+        friend class SM3_HashService;
+        Request* request = nullptr;
+
+        explicit Future(Request* request) : request(request) {}
+
+        void Release() {
+            if (request && request->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                DeleteRequest(request);
+            }
+            request = nullptr;
+        }
+    };
+
+    SM3_HashService() : SM3_HashService(Options()) {}
+
+    explicit SM3_HashService(Options options)
+        : options(options), lanes(SM3_MultiBuffer::Lanes(options.width)), head(&stub), tail(&stub) {
+        this->options.maxBatch = std::max(lanes, options.maxBatch / lanes * lanes);
+        batcher = std::thread([this] { BatcherLoop(); });
+    }
+
+    // Completes every request already submitted. No thread may submit once
+    // destruction has begun.
+    ~SM3_HashService() {
+        stopping.store(true);
+        Wake();
+        batcher.join();
+    }
+
+    SM3_HashService(const SM3_HashService&) = delete;
+    SM3_HashService& operator=(const SM3_HashService&) = delete;
+
+    // Takes the message over; the request holds it until both the batcher and
+    // the Future are done with it.
+    Future Submit(std::string message) {
+        Request* request = NewRequest();
+        request->owned = std::move(message);
+        request->data = reinterpret_cast<const uint8_t*>(request->owned.data());
+        request->length = request->owned.size();
+        return Enqueue(request);
+    }
+
+    // Hashes the caller's buffer in place: it must stay valid and unchanged
+    // until Get() returns or Ready() is true.
+    Future Submit(const uint8_t* data, size_t length) {
+        Request* request = NewRequest();
+        request->data = data;
+        request->length = length;
+        return Enqueue(request);
+    }
+
+    Counters Stats() const {
+        Counters counters;
+        counters.requests = requests.load(std::memory_order_relaxed);
+        counters.batches = batches.load(std::memory_order_relaxed);
+        counters.partialBatches = partialBatches.load(std::memory_order_relaxed);
+        return counters;
+    }
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    enum : uint32_t { pending, waiting, done };
+
+    struct Slab;
+
+    // Owned jointly by the batcher and the Future until both let go.
+    struct Request {
+        std::atomic<Request*> next{nullptr};
+        std::atomic<uint32_t> state{pending};
+        std::atomic<uint32_t> refs{2};
+        Clock::time_point submitted;
+        const uint8_t* data = nullptr;
+        size_t length = 0;
+        // Backs data when the message was handed over as a string.
+        std::string owned;
+        SM3_Digest digest;
+        Slab* slab = nullptr;
+    };
+
+    // Requests are carved in order from a slab owned by the submitting thread,
+    // and are released by whichever of the batcher and the Future lets go last.
+    // Rather than passing nodes back to their owner, a slab counts its requests
+    // still alive and returns to the heap when the last one goes; the owner's
+    // reference keeps it until the thread moves on to a new slab or exits.
+    struct Slab {
+        static constexpr size_t size = 64;
+        std::atomic<size_t> refs{size + 1};
+        size_t used = 0;
+        alignas(Request) unsigned char storage[size * sizeof(Request)];
+    };
+
+    struct SlabCursor {
+        Slab* slab = nullptr;
+        ~SlabCursor() {
+            Retire(slab);
+        }
+    };
+
+    static Request* NewRequest() {
+        static thread_local SlabCursor cursor;
+        if (!cursor.slab || cursor.slab->used == Slab::size) {
+            Retire(cursor.slab);
+            cursor.slab = new Slab;
+        }
+        Slab* slab = cursor.slab;
+        Request* request = new (slab->storage + slab->used++ * sizeof(Request)) Request;
+        request->slab = slab;
+        return request;
+    }
+
+    static void DeleteRequest(Request* request) {
+        Slab* slab = request->slab;
+        request->~Request();
+        Release(slab, 1);
+    }
+
+    // Drops the owner's reference along with those of the requests never carved.
+    static void Retire(Slab* slab) {
+        if (slab) {
+            Release(slab, 1 + Slab::size - slab->used);
+        }
+    }
+
+    static void Release(Slab* slab, size_t count) {
+        if (slab->refs.fetch_sub(count, std::memory_order_acq_rel) == count) {
+            delete slab;
+        }
+    }
+
+    Future Enqueue(Request* request) {
+        request->submitted = Clock::now();
+        Push(request);
+        requests.fetch_add(1, std::memory_order_relaxed);
+        // Pairs with the fence in BatcherLoop: either the batcher sees this
+        // request before it sleeps, or this thread sees it asleep and wakes it.
+        // Only the first submitter to see it asleep pays for the wakeup.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleeping.load(std::memory_order_relaxed) && sleeping.exchange(false)) {
+            Wake();
+        }
+        return Future(request);
+    }
+
+    // Buckets hold messages of 1 .. bucketCount - 1 padded blocks; the last one
+    // takes everything longer, where lane refill in HashBatch evens out lengths.
+    static constexpr size_t bucketCount = 9;
+
+    Options options;
+    size_t lanes;
+
+    // Vyukov's intrusive MPSC queue: producers swap themselves into head and then
+    // link the previous node to them; only the batcher reads tail. The stub node
+    // keeps the list non-empty so that a push never touches tail.
+    alignas(64) std::atomic<Request*> head;
+    alignas(64) Request* tail;
+    Request stub;
+
+    std::atomic<uint64_t> requests{0};
+    std::atomic<uint64_t> batches{0};
+    std::atomic<uint64_t> partialBatches{0};
+
+    std::atomic<bool> stopping{false};
+    std::atomic<bool> sleeping{false};
+    std::mutex sleepMutex;
+    std::condition_variable wake;
+    std::thread batcher;
+
+    // Batcher scratch, reused across dispatches.
+    std::vector<SM3_Message> messages;
+    std::vector<uint8_t> digests;
+    std::vector<uint8_t> sleepers;
+
+    void Push(Request* request) {
+        request->next.store(nullptr, std::memory_order_relaxed);
+        Request* previous = head.exchange(request, std::memory_order_acq_rel);
+        previous->next.store(request, std::memory_order_release);
+    }
+
+    // Null when the queue is empty or its only request is still being linked.
+    Request* Pop() {
+        Request* first = tail;
+        Request* next = first->next.load(std::memory_order_acquire);
+        if (first == &stub) {
+            if (!next) {
+                return nullptr;
+            }
+            tail = next;
+            first = next;
+            next = next->next.load(std::memory_order_acquire);
+        }
+        if (next) {
+            tail = next;
+            return first;
+        }
+        if (first != head.load(std::memory_order_acquire)) {
+            return nullptr;
+        }
+        Push(&stub);
+        next = first->next.load(std::memory_order_acquire);
+        if (next) {
+            tail = next;
+            return first;
+        }
+        return nullptr;
+    }
+
+    void Wake() {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        wake.notify_one();
+    }
+
+    static size_t Bucket(size_t length) {
+        size_t blocks = (length + 9 + 63) / 64;
+        return blocks < bucketCount ? blocks - 1 : bucketCount - 1;
+    }
+
+    void BatcherLoop() {
+        // The default 50 us timer slack would double the default maxWait.
+        prctl(PR_SET_TIMERSLACK, 1000UL);
+        std::array<std::vector<Request*>, bucketCount> pending;
+        for (;;) {
+            size_t drained = 0;
+            while (Request* request = Pop()) {
+                pending[Bucket(request->length)].push_back(request);
+                // Keep draining bounded so full buckets do not wait on a flood.
+                if (++drained == options.maxBatch) {
+                    break;
+                }
+            }
+
+            bool stop = stopping.load(std::memory_order_acquire) && !drained;
+            Clock::time_point now = Clock::now();
+            Clock::time_point deadline = Clock::time_point::max();
+            bool empty = true;
+            for (std::vector<Request*>& bucket : pending) {
+                size_t begin = 0;
+                while (bucket.size() - begin >= lanes) {
+                    size_t count = std::min(options.maxBatch, (bucket.size() - begin) / lanes * lanes);
+                    Dispatch(bucket.data() + begin, count);
+                    begin += count;
+                }
+                if (begin < bucket.size() && (stop || now - bucket[begin]->submitted >= options.maxWait)) {
+                    Dispatch(bucket.data() + begin, bucket.size() - begin);
+                    partialBatches.fetch_add(1, std::memory_order_relaxed);
+                    begin = bucket.size();
+                }
+                bucket.erase(bucket.begin(), bucket.begin() + begin);
+                if (!bucket.empty()) {
+                    empty = false;
+                    deadline = std::min(deadline, bucket.front()->submitted + options.maxWait);
+                }
+            }
+            if (stop && empty) {
+                return;
+            }
+            if (drained) {
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock(sleepMutex);
+            sleeping.store(true, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (tail->next.load(std::memory_order_acquire) == nullptr && !stopping.load()) {
+                if (empty) {
+                    wake.wait(lock);
+                } else {
+                    wake.wait_until(lock, deadline);
+                }
+            }
+            sleeping.store(false, std::memory_order_relaxed);
+        }
+    }
+
+    void Dispatch(Request* const* batch, size_t count) {
+        messages.resize(count);
+        digests.resize(32 * count);
+        sleepers.resize(count);
+        for (size_t i = 0; i < count; ++i) {
+            messages[i] = {batch[i]->data, batch[i]->length};
+        }
+        SM3_MultiBuffer::HashBatch(messages.data(), count, digests.data(), options.width);
+        // Publish the whole batch before waking anyone: a woken reader that
+        // preempts the batcher then finds the rest of its window done as well,
+        // instead of going back to sleep on its next request.
+        for (size_t i = 0; i < count; ++i) {
+            Request* request = batch[i];
+            std::memcpy(request->digest.data(), digests.data() + 32 * i, 32);
+            sleepers[i] = request->state.exchange(done, std::memory_order_acq_rel) == waiting;
+        }
+        for (size_t i = 0; i < count; ++i) {
+            Request* request = batch[i];
+            if (sleepers[i]) {
+                syscall(SYS_futex, reinterpret_cast<uint32_t*>(&request->state), FUTEX_WAKE_PRIVATE, INT_MAX,
+                        nullptr, nullptr, 0);
+            }
+            if (request->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                DeleteRequest(request);
+            }
+        }
+        batches.fetch_add(1, std::memory_order_relaxed);
+    }
+};
@@ -0,0 +1,214 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <x86intrin.h>
+#ifdef SM3_INSTRUMENT
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Opt-in instrumentation of the SM3 hot paths. Compiled with SM3_INSTRUMENT
+// (cmake -DSM_INSTRUMENT=ON) the hashers count bytes and blocks per compression
+// engine and TSC cycles per phase, and, on threads that called EnablePerf(),
+// cache misses and branch mispredicts per phase. Without it SM3_STATS_SCOPE and
+// SM3_STATS_COUNT expand to nothing and Snapshot() reads zero. Counters are
+// process-wide relaxed atomics, bumped once per call rather than per block
+// except in the Reference engine, which times expansion and rounds separately.
+enum class SM3_Phase { Expand, Rounds, Compress, Lanes, Buffer, Pad, Count };
+
+enum class SM3_Engine { Reference, Unrolled, Interleaved, AVX512, LanesAVX2, LanesAVX512, Count };
+
+struct SM3_PhaseStats {
+    uint64_t calls = 0;
+    uint64_t cycles = 0;
+    uint64_t cacheMisses = 0;
+    uint64_t branchMisses = 0;
+};
+
+struct SM3_StatsSnapshot {
+    std::array<SM3_PhaseStats, static_cast<size_t>(SM3_Phase::Count)> phases{};
+    std::array<uint64_t, static_cast<size_t>(SM3_Engine::Count)> bytes{};
+    std::array<uint64_t, static_cast<size_t>(SM3_Engine::Count)> blocks{};
+
+    std::string ToJson() const;
+};
+
+class SM3_Stats {
+public:
+#ifdef SM3_INSTRUMENT
+    static constexpr bool enabled = true;
+#else
+    static constexpr bool enabled = false;
+#endif
+
+    static const char* Name(SM3_Phase phase) {
+        static const char* const names[] = {"expand", "rounds", "compress", "lanes", "buffer", "pad"};
+        return names[static_cast<size_t>(phase)];
+    }
+
+    static const char* Name(SM3_Engine engine) {
+        static const char* const names[] = {"reference", "unrolled", "interleaved", "avx512", "lanes_avx2",
+                                             "lanes_avx512"};
+        return names[static_cast<size_t>(engine)];
+    }
+
+    static SM3_StatsSnapshot Snapshot() {
+        SM3_StatsSnapshot snapshot;
+        for (size_t i = 0; i < phaseCount; ++i) {
+            snapshot.phases[i].calls = phases[i][0].load(std::memory_order_relaxed);
+            snapshot.phases[i].cycles = phases[i][1].load(std::memory_order_relaxed);
+            snapshot.phases[i].cacheMisses = phases[i][2].load(std::memory_order_relaxed);
+            snapshot.phases[i].branchMisses = phases[i][3].load(std::memory_order_relaxed);
+        }
+        for (size_t i = 0; i < engineCount; ++i) {
+            snapshot.bytes[i] = engines[i][0].load(std::memory_order_relaxed);
+            snapshot.blocks[i] = engines[i][1].load(std::memory_order_relaxed);
+        }
+        return snapshot;
+    }
+
+    static void Reset() {
+        for (auto& phase : phases) {
+            for (auto& counter : phase) {
+                counter.store(0, std::memory_order_relaxed);
+            }
+        }
+        for (auto& engine : engines) {
+            for (auto& counter : engine) {
+                counter.store(0, std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Opens a cache-miss / branch-miss counter group for the calling thread.
+    // False when instrumentation is compiled out or the kernel refuses.
+    static bool EnablePerf() {
+#ifdef SM3_INSTRUMENT
+        int& fd = PerfFd();
+        if (fd >= 0) {
+            return true;
+        }
+        int leader = PerfOpen(PERF_COUNT_HW_CACHE_MISSES, -1);
+        if (leader < 0) {
+            return false;
+        }
+        if (PerfOpen(PERF_COUNT_HW_BRANCH_MISSES, leader) < 0) {
+            close(leader);
+            return false;
+        }
+        ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+        fd = leader;
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    static void Count(SM3_Engine engine, uint64_t bytes, uint64_t blocks) {
+        engines[static_cast<size_t>(engine)][0].fetch_add(bytes, std::memory_order_relaxed);
+        engines[static_cast<size_t>(engine)][1].fetch_add(blocks, std::memory_order_relaxed);
+    }
+
+    // Times the enclosing block as one call of `phase`.
+    class Scope {
+    public:
+        explicit Scope(SM3_Phase phase) : phase(static_cast<size_t>(phase)) {
+            ReadPerf(perf);
+            tsc = __rdtsc();
+        }
+
+        ~Scope() {
+            uint64_t elapsed = __rdtsc() - tsc;
+            phases[phase][0].fetch_add(1, std::memory_order_relaxed);
+            phases[phase][1].fetch_add(elapsed, std::memory_order_relaxed);
+            uint64_t now[2] = {perf[0], perf[1]};
+            if (ReadPerf(now)) {
+                phases[phase][2].fetch_add(now[0] - perf[0], std::memory_order_relaxed);
+                phases[phase][3].fetch_add(now[1] - perf[1], std::memory_order_relaxed);
+            }
+        }
+
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+
+    private:
+        size_t phase;
+        uint64_t tsc;
+        uint64_t perf[2] = {0, 0};
+    };
+
+private:
+    static constexpr size_t phaseCount = static_cast<size_t>(SM3_Phase::Count);
+    static constexpr size_t engineCount = static_cast<size_t>(SM3_Engine::Count);
+
+    // Per phase: calls, cycles, cache misses, branch misses. Per engine: bytes, blocks.
+    inline static std::atomic<uint64_t> phases[phaseCount][4];
+    inline static std::atomic<uint64_t> engines[engineCount][2];
+
+    static int& PerfFd() {
+        thread_local int fd = -1;
+        return fd;
+    }
+
+#ifdef SM3_INSTRUMENT
+    static int PerfOpen(uint64_t config, int group) {
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = config;
+        attr.read_format = PERF_FORMAT_GROUP;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, group, 0));
+    }
+#endif
+
+    static bool ReadPerf(uint64_t values[2]) {
+#ifdef SM3_INSTRUMENT
+        int fd = PerfFd();
+        uint64_t group[3];
+        if (fd >= 0 && read(fd, group, sizeof(group)) == static_cast<ssize_t>(sizeof(group))) {
+            values[0] = group[1];
+            values[1] = group[2];
+            return true;
+        }
+#else
+        (void)values;
+#endif
+        return false;
+    }
+};
+
+inline std::string SM3_StatsSnapshot::ToJson() const {
+    std::string json = std::string("{\"enabled\":") + (SM3_Stats::enabled ? "true" : "false") + ",\"phases\":{";
+    for (size_t i = 0; i < phases.size(); ++i) {
+        const SM3_PhaseStats& p = phases[i];
+        json += (i ? ",\"" : "\"") + std::string(SM3_Stats::Name(static_cast<SM3_Phase>(i))) +
+                "\":{\"calls\":" + std::to_string(p.calls) + ",\"cycles\":" + std::to_string(p.cycles) +
+                ",\"cache_misses\":" + std::to_string(p.cacheMisses) +
+                ",\"branch_misses\":" + std::to_string(p.branchMisses) + "}";
+    }
+    json += "},\"engines\":{";
+    for (size_t i = 0; i < bytes.size(); ++i) {
+        json += (i ? ",\"" : "\"") + std::string(SM3_Stats::Name(static_cast<SM3_Engine>(i))) +
+                "\":{\"bytes\":" + std::to_string(bytes[i]) + ",\"blocks\":" + std::to_string(blocks[i]) + "}";
+    }
+    return json + "}}";
+}
+
+#ifdef SM3_INSTRUMENT
+#define SM3_STATS_JOIN2(a, b) a##b
+#define SM3_STATS_JOIN(a, b) SM3_STATS_JOIN2(a, b)
+#define SM3_STATS_SCOPE(phase) SM3_Stats::Scope SM3_STATS_JOIN(sm3StatsScope, __LINE__)(SM3_Phase::phase)
+#define SM3_STATS_COUNT(engine, bytes, blocks) SM3_Stats::Count(engine, bytes, blocks)
+#else
+#define SM3_STATS_SCOPE(phase) static_cast<void>(0)
+#define SM3_STATS_COUNT(engine, bytes, blocks) static_cast<void>(0)
+#endif
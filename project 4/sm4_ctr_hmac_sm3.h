@@ -0,0 +1,106 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include "sm3.h"
+#include "sm3_hmac.h"
+#include "sm4.h"
+
+// Encrypt-then-MAC records: SM4-CTR for confidentiality and HMAC-SM3 over the
+// ciphertext for integrity, behind one Seal()/Open() pair. The record goes
+// through in chunks, each encrypted then hashed (hashed then decrypted in
+// Open()), so in-place records work in both directions. This is an API, not a
+// speedup: single-stream SM3 costs five times what SM4-CTR does, and the
+// prefetcher already hides reading the ciphertext back, so Seal() runs at the
+// speed of sm4_ctr_encrypt followed by a separate MAC pass.
+//
+// The tag is HMAC-SM3(macKey, A || IV || C || AL), AL being the bit length of the
+// associated data A as a 64-bit big-endian integer, the layout of the
+// AES-CBC-HMAC-SHA2 AEAD drafts. The IV is under the MAC, so a changed counter
+// cannot turn a valid record into different plaintext.
+class SM4_CTR_HMAC_SM3 {
+public:
+    // Bytes encrypted and hashed per step, a multiple of the 256-byte CTR batch
+    // and the 64-byte SM3 block.
+    static constexpr size_t defaultChunk = size_t(8) << 10;
+
+    SM4_CTR_HMAC_SM3(const uint8_t encKey[16], const uint8_t* macKey, size_t macKeyLength,
+                     size_t chunk = defaultChunk)
+        : hmac(macKey, macKeyLength), chunk(std::max<size_t>(256, chunk / 256 * 256)) {
+        sm4_key_schedule(&ks, encKey);
+    }
+
+    // Encrypts length bytes of in to out (which may be in) and writes the tag.
+    void Seal(const uint8_t iv[16], const uint8_t* aad, size_t aadLength, const uint8_t* in, uint8_t* out,
+              size_t length, uint8_t tag[32]) const {
+        SM3_Algorithm mac = Begin(iv, aad, aadLength);
+        uint8_t counter[16];
+        std::memcpy(counter, iv, 16);
+        for (size_t offset = 0; offset < length; offset += chunk) {
+            size_t n = std::min(chunk, length - offset);
+            sm4_ctr_encrypt(&ks, counter, in + offset, out + offset, n);
+            mac.Update(out + offset, n);
+            AddCounter(counter, chunk / 16);
+        }
+        SM3_Digest digest = Finish(mac, aadLength);
+        std::memcpy(tag, digest.data(), digest.size());
+    }
+
+    // Decrypts in to out (which may be in) if tag matches. Plaintext is written
+    // as the record is read; on a mismatch out is cleared and false returned,
+    // as sm4_gcm_decrypt does.
+    bool Open(const uint8_t iv[16], const uint8_t* aad, size_t aadLength, const uint8_t* in, uint8_t* out,
+              size_t length, const uint8_t tag[32]) const {
+        SM3_Algorithm mac = Begin(iv, aad, aadLength);
+        uint8_t counter[16];
+        std::memcpy(counter, iv, 16);
+        for (size_t offset = 0; offset < length; offset += chunk) {
+            size_t n = std::min(chunk, length - offset);
+            mac.Update(in + offset, n);
+            sm4_ctr_encrypt(&ks, counter, in + offset, out + offset, n);
+            AddCounter(counter, chunk / 16);
+        }
+        if (!SM3_HMAC::Equal(Finish(mac, aadLength).data(), tag)) {
+            std::memset(out, 0, length);
+            return false;
+        }
+        return true;
+    }
+
+    size_t Chunk() const {
+        return chunk;
+    }
+
+private:
+    sm4_key_t ks;
+    SM3_HMAC hmac;
+    size_t chunk;
+
+    SM3_Algorithm Begin(const uint8_t iv[16], const uint8_t* aad, size_t aadLength) const {
+        SM3_Algorithm mac = hmac.Begin();
+        mac.Update(aad, aadLength);
+        mac.Update(iv, 16);
+        return mac;
+    }
+
+    SM3_Digest Finish(SM3_Algorithm& mac, size_t aadLength) const {
+        uint8_t bits[8];
+        uint64_t count = static_cast<uint64_t>(aadLength) * 8;
+        for (int i = 0; i < 8; ++i) {
+            bits[i] = static_cast<uint8_t>(count >> (56 - 8 * i));
+        }
+        mac.Update(bits, 8);
+        return hmac.Finish(mac);
+    }
+
+    // 128-bit big-endian counter += blocks, as sm4_ctr_encrypt counts.
+    static void AddCounter(uint8_t counter[16], uint64_t blocks) {
+        for (int i = 15; i >= 0 && blocks; --i) {
+            uint64_t sum = counter[i] + (blocks & 0xff);
+            counter[i] = static_cast<uint8_t>(sum);
+            blocks = (blocks >> 8) + (sum >> 8);
+        }
+    }
+};
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed-size worker pool. The thread that calls ParallelFor works on the range
+// too, so a pool of size n runs n - 1 background workers.
+class ThreadPool {
+public:
+    explicit ThreadPool(size_t threads = std::max<size_t>(1, std::thread::hardware_concurrency())) {
+        for (size_t i = 1; i < threads; ++i) {
+            workers.emplace_back([this] { WorkerLoop(); });
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(queueMutex);
+            stopping = true;
+        }
+        queueReady.notify_all();
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    size_t Size() const {
+        return workers.size() + 1;
+    }
+
+    static ThreadPool& Shared() {
+        static ThreadPool pool;
+        return pool;
+    }
+
+    // Calls body(begin, end) on consecutive chunks of [0, count) of at most grain
+    // items and returns once every chunk has run. Helpers that are only scheduled
+    // after the caller drained the range find nothing left and return at once, so
+    // nested calls from inside a chunk cannot deadlock.
+    template <typename Body>
+    void ParallelFor(size_t count, size_t grain, Body&& body) {
+        grain = std::max<size_t>(grain, 1);
+        size_t chunks = (count + grain - 1) / grain;
+        if (chunks <= 1 || workers.empty()) {
+            if (count) {
+                body(0, count);
+            }
+            return;
+        }
+
+        struct Range {
+            std::atomic<size_t> next{0};
+            std::atomic<size_t> done{0};
+            std::mutex mutex;
+            std::condition_variable finished;
+        };
+        auto range = std::make_shared<Range>();
+        auto drain = [range, count, grain, chunks, &body] {
+            size_t chunk;
+            while ((chunk = range->next.fetch_add(1)) < chunks) {
+                size_t begin = chunk * grain;
+                body(begin, std::min(count, begin + grain));
+                if (range->done.fetch_add(1) + 1 == chunks) {
+                    std::lock_guard<std::mutex> lock(range->mutex);
+                    range->finished.notify_all();
+                }
+            }
+        };
+
+        size_t helpers = std::min(workers.size(), chunks - 1);
+        {
+            std::lock_guard<std::mutex> lock(queueMutex);
+            for (size_t i = 0; i < helpers; ++i) {
+                tasks.emplace_back(drain);
+            }
+        }
+        queueReady.notify_all();
+
+        drain();
+        std::unique_lock<std::mutex> lock(range->mutex);
+        range->finished.wait(lock, [&] { return range->done.load() == chunks; });
+    }
+
+private:
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> tasks;
+    std::mutex queueMutex;
+    std::condition_variable queueReady;
+    bool stopping = false;
+
+    void WorkerLoop() {
+        for (;;) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(queueMutex);
+                queueReady.wait(lock, [this] { return stopping || !tasks.empty(); });
+                if (stopping && tasks.empty()) {
+                    return;
+                }
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+            task();
+        }
+    }
+};
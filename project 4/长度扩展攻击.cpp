@@ -1,184 +1,160 @@
+#include <chrono>
 #include <iostream>
+#include <string>
 #include <vector>
-#include <iomanip>
-#include <sstream>
 #include <cstdint>
+#include <cstring>
+#include "sm3.h"
+#include "sm3_mb.h"
 
-class SM3_Algorithm {
-private:
-    static const uint32_t initialVector[8];
-    uint32_t state[8];
-    uint64_t bitCount;
-    std::vector<uint8_t> messageBuffer;
-
-    static inline uint32_t rotateLeft(uint32_t x, int  n) {
-        return (x << n) | (x >> (32 - n));
-    }
-
-    static inline uint32_t funcFF(uint32_t x, uint32_t y, uint32_t z, int j) {
-        return (j < 16) ? (x ^ y ^ z) : ((x & y) | (y & z) | (z & x));
-    }
-
-    static inline uint32_t funcGG(uint32_t x, uint32_t y, uint32_t z, int j) {
-        return (j < 16) ? (x ^ y ^ z) : ((x & z) | (~x & y));
-    }
-
-    static inline uint32_t transformP0(uint32_t x) {
-        return x ^ rotateLeft(x, 9) ^ rotateLeft(x, 17);
-    }
-
-    static inline uint32_t transformP1(uint32_t x) {
-        return x ^ rotateLeft(x, 15) ^ rotateLeft(x, 23);
-    }
+// The victim: authenticates messages as SM3(secret || message) and answers only
+// whether a tag verifies. Batches are checked through SM3_MultiBuffer.
+class Oracle {
+public:
+    explicit Oracle(std::string secret) : secret(std::move(secret)) {}
 
-    static inline uint32_t constantT(int round) {
-        return (round < 16) ? 0x79cc4519 : 0x7a879d8a;
+    std::string Sign(const std::string& message) const {
+        return SM3_Algorithm::ComputeHash(secret + message);
     }
 
-    void processMessageBlock(const uint8_t* block) {
-        uint32_t W[68];
-        for (int i = 0; i < 16; ++i) {
-            W[i] = (static_cast<uint32_t>(block[4*i]) << 24) |
-                   (static_cast<uint32_t>(block[4*i + 1]) << 16) |
-                   (static_cast<uint32_t>(block[4*i + 2]) << 8) |
-                   static_cast<uint32_t>(block[4*i + 3]);
-        }
-        
-        for (int i = 16; i < 68; ++i) {
-            W[i] = transformP1(W[i - 16] ^ W[i - 9] ^ rotateLeft(W[i - 3], 15)) ^ 
-                   rotateLeft(W[i - 13], 7) ^ W[i - 6];
+    // accepted[i] says whether tags[i] is the tag of messages[i]; returns how many were.
+    size_t VerifyBatch(const std::vector<std::string>& messages, const std::vector<SM3_Digest>& tags,
+                       std::vector<bool>& accepted) const {
+        std::vector<std::string> keyed(messages.size());
+        std::vector<SM3_Message> batch(messages.size());
+        for (size_t i = 0; i < messages.size(); ++i) {
+            keyed[i] = secret + messages[i];
+            batch[i] = {reinterpret_cast<const uint8_t*>(keyed[i].data()), keyed[i].size()};
         }
-        
-        uint32_t W1[64];
-        for (int i = 0; i < 64; ++i) {
-            W1[i] = W[i] ^ W[i + 4];
+        std::vector<uint8_t> digests = SM3_MultiBuffer::HashBatch(batch);
+        accepted.assign(messages.size(), false);
+        size_t count = 0;
+        for (size_t i = 0; i < messages.size(); ++i) {
+            accepted[i] = std::memcmp(digests.data() + 32 * i, tags[i].data(), 32) == 0;
+            count += accepted[i];
         }
-
-        uint32_t A = state[0], B = state[1], C = state[2], D = state[3];
-        uint32_t E = state[4], F = state[5], G = state[6], H = state[7];
-
-        for (int j = 0; j < 64; ++j) {
-            uint32_t SS1 = rotateLeft(rotateLeft(A, 12) + E + rotateLeft(constantT(j), j % 32), 7);
-            uint32_t SS2 = SS1 ^ rotateLeft(A, 12);
-            uint32_t TT1 = funcFF(A, B, C, j) + D + SS2 + W1[j];
-            uint32_t TT2 = funcGG(E, F, G, j) + H + SS1 + W[j];
-
-            D = C;
-            C = rotateLeft(B, 9);
-            B = A;
-            A = TT1;
-            H = G;
-            G = rotateLeft(F, 19);
-            F = E;
-            E = transformP0(TT2);
-        }
-
-        state[0] ^= A; state[1] ^= B; state[2] ^= C; state[3] ^= D;
-        state[4] ^= E; state[5] ^= F; state[6] ^= G; state[7] ^= H;
+        return count;
     }
 
-    void padData() {
-        size_t currentLength = messageBuffer.size();
-        size_t paddingSize = (currentLength % 64 < 56) ? (56 - currentLength % 64) : (120 - currentLength % 64);
-        
-        messageBuffer.push_back(0x80);
-        messageBuffer.insert(messageBuffer.end(), paddingSize - 1, 0x00);
-
-        for (int i = 7; i >= 0; --i) {
-            messageBuffer.push_back((bitCount >> (i * 8)) & 0xFF);
-        }
-    }
+private:
+    std::string secret;
+};
 
+class Attack {
 public:
-    SM3_Algorithm() {
-        reset();
-    }
-
-    void reset() {
+    // One forged (message, tag) pair: the attacker's guess of the secret length,
+    // and which suffix it extends the message with.
+    struct Forgery {
+        size_t keyLength;
+        size_t suffix;
+        std::string message;
+        SM3_Digest tag;
+    };
+
+    // The padding SM3 appends to a message of `length` bytes: 0x80, zeros up to
+    // 56 mod 64, then the bit length as a 64-bit big-endian integer.
+    static std::string padding(size_t length) {
+        size_t zeros = (55 - length % 64 + 64) % 64;
+        std::string pad(1 + zeros + 8, '\0');
+        pad[0] = static_cast<char>(0x80);
+        uint64_t bits = static_cast<uint64_t>(length) * 8;
         for (int i = 0; i < 8; ++i) {
-            state[i] = initialVector[i];
+            pad[1 + zeros + i] = static_cast<char>(bits >> (56 - 8 * i));
         }
-        bitCount = 0;
-        messageBuffer.clear();
+        return pad;
     }
 
-    void update(const uint8_t* inputData, size_t length) {
-        bitCount += length * 8;
-        messageBuffer.insert(messageBuffer.end(), inputData, inputData + length);
-
-        while (messageBuffer.size() >= 64) {
-            processMessageBlock(messageBuffer.data());
-            messageBuffer.erase(messageBuffer.begin(), messageBuffer.begin() + 64);
-        }
+    static size_t paddedLength(size_t length) {
+        return (length + 9 + 63) / 64 * 64;
     }
 
-    std::vector<uint8_t> finalize() {
-        padData();
-        while (messageBuffer.size() >= 64) {
-            processMessageBlock(messageBuffer.data());
-            messageBuffer.erase(messageBuffer.begin(), messageBuffer.begin() + 64);
+    static SM3_Digest parseDigest(const std::string& hex) {
+        if (hex.size() != 64) {
+            throw std::invalid_argument("Attack::parseDigest: expected 64 hex digits");
         }
-
-        std::vector<uint8_t> output(32);
-        for (int i = 0; i < 8; ++i) {
-            output[4*i] = (state[i] >> 24) & 0xFF;
-            output[4*i + 1] = (state[i] >> 16) & 0xFF;
-            output[4*i + 2] = (state[i] >> 8) & 0xFF;
-            output[4*i + 3] = state[i] & 0xFF;
+        auto nibble = [](char c) -> int {
+            if (c >= '0' && c <= '9') return c - '0';
+            if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+            if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+            throw std::invalid_argument("Attack::parseDigest: not a hex digit");
+        };
+        SM3_Digest digest;
+        for (size_t i = 0; i < digest.size(); ++i) {
+            digest[i] = static_cast<uint8_t>(nibble(hex[2 * i]) << 4 | nibble(hex[2 * i + 1]));
         }
-        return output;
+        return digest;
     }
 
-    static std::string computeHash(const std::string& input) {
-        SM3_Algorithm hasher;
-        hasher.update(reinterpret_cast<const uint8_t*>(input.data()), input.size());
-        auto hashBytes = hasher.finalize();
-        
-        std::ostringstream hexStream;
-        for (const auto& byte : hashBytes) {
-            hexStream << std::hex << std::setw(2) << std::setfill('0') << static_cast<int>(byte);
-        }
-        return hexStream.str();
-    }
-};
-
-const uint32_t SM3_Algorithm::initialVector[8] = {
-    0x7380166f, 0x4914b2b9, 0x172442d7, 0xda8a0600,
-    0xa96f30bc, 0x163138aa, 0xe38dee4d, 0xb0fb0e4e
-};
-
-class Attack {
-public:
+    // From H(secret || message) and the length of secret || message alone, the
+    // digest of secret || message || padding || additionalData: the known digest
+    // is the chaining value after the padded message, so hashing resumes there.
     static std::string executeAttack(
         const std::string& hashString,
         size_t originalLength,
         const std::string& additionalData) {
 
-        std::vector<uint8_t> hashBytes(32);
-        for (size_t i = 0; i < hashString.length(); i += 2) {
-            std::string byteString = hashString.substr(i, 2);
-            hashBytes[i / 2] = static_cast<uint8_t>(std::stoi(byteString, nullptr, 16));
-        }
+        SM3_Algorithm attacker(parseDigest(hashString), paddedLength(originalLength));
+        attacker.Update(additionalData);
+        return SM3_Algorithm::ToHex(attacker.Finalize());
+    }
 
-        size_t paddingSize = 56 - (originalLength + 1) % 64;
-        if (paddingSize > 56) {
-            paddingSize += 64;
+    // Every forgery of `message` (signed as `digest`) for secret lengths in
+    // [minKey, maxKey] and each suffix. The tag depends on the guess only through
+    // the padded length, so one lane job per (padded length, suffix) covers all
+    // guesses that share it; the jobs run together in one multi-lane batch, each
+    // resuming the digest's chaining value at its own length. No suffixes or an
+    // empty key range give no forgeries.
+    static std::vector<Forgery> executeBatch(
+        const SM3_Digest& digest,
+        const std::string& message,
+        size_t minKey, size_t maxKey,
+        const std::vector<std::string>& suffixes) {
+
+        if (suffixes.empty() || minKey > maxKey) {
+            return {};
         }
-
-        size_t totalBytes = originalLength + 1 + paddingSize + 8;
-        uint64_t totalBits = totalBytes * 8;
-
-        SM3_Algorithm attacker;
-        attacker.update(reinterpret_cast<const uint8_t*>(hashBytes.data()), hashBytes.size());
-        attacker.update(reinterpret_cast<const uint8_t*>(additionalData.data()), additionalData.size());
-
-        auto forgedHash = attacker.finalize();
-        std::ostringstream forgedHexStream;
-        for (const auto& byte : forgedHash) {
-            forgedHexStream << std::hex << std::setw(2) << std::setfill('0') << static_cast<int>(byte);
+        std::vector<uint64_t> paddings;
+        for (size_t key = minKey; key <= maxKey; ++key) {
+            uint64_t length = paddedLength(key + message.size());
+            if (paddings.empty() || paddings.back() != length) {
+                paddings.push_back(length);
+            }
+        }
+        // The digest is the chaining value, one big-endian word per 4 bytes.
+        uint32_t chain[8];
+        for (int i = 0; i < 8; ++i) {
+            chain[i] = static_cast<uint32_t>(digest[4 * i]) << 24 | static_cast<uint32_t>(digest[4 * i + 1]) << 16 |
+                       static_cast<uint32_t>(digest[4 * i + 2]) << 8 | digest[4 * i + 3];
         }
 
-        return forgedHexStream.str();
+        std::vector<uint64_t> prefixLengths;
+        std::vector<SM3_Message> jobs;
+        for (uint64_t length : paddings) {
+            for (const std::string& s : suffixes) {
+                prefixLengths.push_back(length);
+                jobs.push_back({reinterpret_cast<const uint8_t*>(s.data()), s.size()});
+            }
+        }
+        std::vector<uint8_t> tags(32 * jobs.size());
+        SM3_MultiBuffer::HashBatchResume(chain, prefixLengths.data(), jobs.data(), jobs.size(),
+                                         tags.data());
+
+        std::vector<Forgery> forgeries;
+        forgeries.reserve((maxKey - minKey + 1) * suffixes.size());
+        size_t job = 0;
+        for (size_t key = minKey; key <= maxKey; ++key) {
+            size_t length = key + message.size();
+            while (prefixLengths[job] != paddedLength(length)) {
+                job += suffixes.size();
+            }
+            std::string extended = message + padding(length);
+            for (size_t s = 0; s < suffixes.size(); ++s) {
+                Forgery f{key, s, extended + suffixes[s], {}};
+                std::memcpy(f.tag.data(), tags.data() + 32 * (job + s), 32);
+                forgeries.push_back(std::move(f));
+            }
+        }
+        return forgeries;
     }
 };
 
@@ -192,12 +168,58 @@ int main() {
     std::cout << "Message: " << originalData << std::endl;
     std::cout << "Combi_Meassage: " << completeMessage << std::endl;
 
-    std::string originalHash = SM3_Algorithm::computeHash(completeMessage);
+    std::string originalHash = SM3_Algorithm::ComputeHash(completeMessage);
     std::cout << "Hash_message: " << originalHash << std::endl;
 
-    std::string forgedMessage = completeMessage + additional;
+    // What the server would hash if sent originalData || padding || additional.
+    std::string forgedMessage = completeMessage + Attack::padding(completeMessage.length()) + additional;
     std::string forgedHash = Attack::executeAttack(originalHash, completeMessage.length(), additional);
+    std::string realHash = SM3_Algorithm::ComputeHash(forgedMessage);
     std::cout << "Fake_hash: " << forgedHash << std::endl;
+    std::cout << "Real_hash: " << realHash << std::endl;
+    std::cout << "Forgery accepted: " << (forgedHash == realHash ? "yes" : "no") << std::endl;
+
+    // Without knowing the secret's length: try every length up to 256 bytes with
+    // a set of suffixes, and let the oracle say which forgeries it accepts.
+    Oracle oracle(key);
+    SM3_Digest tag = Attack::parseDigest(oracle.Sign(originalData));
+    std::vector<std::string> suffixes;
+    for (int i = 0; i < 16; ++i) {
+        suffixes.push_back("&role=admin&id=" + std::to_string(i));
+    }
+    std::vector<Attack::Forgery> forgeries = Attack::executeBatch(tag, originalData, 1, 256, suffixes);
+    std::vector<std::string> messages;
+    std::vector<SM3_Digest> tags;
+    for (const auto& f : forgeries) {
+        messages.push_back(f.message);
+        tags.push_back(f.tag);
+    }
+    std::vector<bool> accepted;
+    size_t hits = oracle.VerifyBatch(messages, tags, accepted);
+    size_t wrongLength = 0;
+    for (size_t i = 0; i < forgeries.size(); ++i) {
+        wrongLength += accepted[i] && forgeries[i].keyLength != key.size();
+    }
+    std::cout << "Batch forgery over key lengths 1-256 (" << SM3_MultiBuffer::Lanes() << " lanes):" << std::endl;
+    std::cout << "  Candidates: " << forgeries.size() << ", accepted: " << hits
+              << " (expected " << suffixes.size() << "), accepted at a wrong key length: " << wrongLength << std::endl;
+    std::cout << "  No suffixes: " << Attack::executeBatch(tag, originalData, 1, 256, {}).size()
+              << " forgeries, key range 256-1: " << Attack::executeBatch(tag, originalData, 256, 1, suffixes).size()
+              << " forgeries (expected 0 and 0)" << std::endl;
+
+    const int rounds = 20;
+    auto start = std::chrono::steady_clock::now();
+    for (int r = 0; r < rounds; ++r) {
+        forgeries = Attack::executeBatch(tag, originalData, 1, 256, suffixes);
+    }
+    std::chrono::duration<double> forging = std::chrono::steady_clock::now() - start;
+    start = std::chrono::steady_clock::now();
+    for (int r = 0; r < rounds; ++r) {
+        hits = oracle.VerifyBatch(messages, tags, accepted);
+    }
+    std::chrono::duration<double> checking = std::chrono::steady_clock::now() - start;
+    std::cout << "  Forged candidates per second: " << rounds * forgeries.size() / forging.count()
+              << ", checked by the oracle per second: " << rounds * messages.size() / checking.count() << std::endl;
 
     return 0;
 }